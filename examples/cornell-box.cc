@@ -1,3 +1,5 @@
+#include <chrono>
+#include <csignal>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -35,6 +37,43 @@ ABSL_FLAG(std::size_t, render_target_subsamples, 4,
           "Number of subsamples to collect from each pixel and frequency bin");
 ABSL_FLAG(std::size_t, render_maxdepth, 8,
           "Maximum depth of bounces to consider");
+ABSL_FLAG(std::size_t, render_roulette_depth, 3,
+          "Depth after which paths are randomly terminated by throughput");
+ABSL_FLAG(std::size_t, render_tile_size, 16,
+          "Edge length of the square pixel tiles scheduled across threads");
+ABSL_FLAG(std::size_t, render_wavelength_packet_size, 4,
+          "Number of frequency bins traced together along each path");
+
+ABSL_FLAG(bool, render_direct_lighting, true,
+          "Sample the scene's lights directly at each diffuse surface");
+
+ABSL_FLAG(bool, render_power_heuristic, true,
+          "Combine light and material samples with the power heuristic, "
+          "rather than the balance heuristic");
+
+ABSL_FLAG(float, render_adaptive_threshold, 0.0,
+          "If positive, keep sampling bins whose estimated relative error is "
+          "above this threshold");
+ABSL_FLAG(std::size_t, render_adaptive_round_samples, 4,
+          "Samples added to each noisy bin per adaptive round");
+ABSL_FLAG(std::size_t, render_adaptive_max_subsamples, 256,
+          "Maximum number of subsamples adaptive sampling will collect from "
+          "any bin");
+ABSL_FLAG(std::size_t, render_adaptive_budget, 0,
+          "Maximum number of samples adaptive sampling may add (0 for no "
+          "limit)");
+
+ABSL_FLAG(bool, render_progressive, false,
+          "Render in passes over the whole image, so that stopping early "
+          "leaves a uniformly-sampled image");
+ABSL_FLAG(double, render_time_limit, 0.0,
+          "Stop rendering after this many seconds (0 for no limit)");
+ABSL_FLAG(std::size_t, render_sample_budget, 0,
+          "Stop rendering after this many samples (0 for no limit)");
+
+ABSL_FLAG(std::string, bunny_cache, "",
+          "Map the bunny from this mesh cache (see mesh_converter) instead of "
+          "parsing bunny.obj");
 
 ABSL_FLAG(bool, resume, false,
           "Should we re-open our output file, and add more samples");
@@ -42,12 +81,35 @@ ABSL_FLAG(bool, resume, false,
 using namespace frustum;
 using namespace ballistae;
 
+// Raised by SIGINT, so that an interrupted render still writes its samples.
+cancellation_token interrupt_token;
+
+extern "C" void handle_interrupt(int signal) { interrupt_token.cancel(); }
+
 int main(int argc, char **argv) {
   absl::ParseCommandLine(argc, argv);
 
   options the_options;
   the_options.maxdepth = absl::GetFlag(FLAGS_render_maxdepth);
+  the_options.roulette_depth = absl::GetFlag(FLAGS_render_roulette_depth);
   the_options.target_subsamples = absl::GetFlag(FLAGS_render_target_subsamples);
+  the_options.tile_size = absl::GetFlag(FLAGS_render_tile_size);
+  the_options.wavelength_packet_size =
+      absl::GetFlag(FLAGS_render_wavelength_packet_size);
+  the_options.direct_lighting = absl::GetFlag(FLAGS_render_direct_lighting);
+  the_options.heuristic = absl::GetFlag(FLAGS_render_power_heuristic)
+                              ? mis_heuristic::power
+                              : mis_heuristic::balance;
+  the_options.adaptive_threshold =
+      absl::GetFlag(FLAGS_render_adaptive_threshold);
+  the_options.adaptive_round_samples =
+      absl::GetFlag(FLAGS_render_adaptive_round_samples);
+  the_options.adaptive_max_subsamples =
+      absl::GetFlag(FLAGS_render_adaptive_max_subsamples);
+  the_options.adaptive_budget = absl::GetFlag(FLAGS_render_adaptive_budget);
+  the_options.progressive = absl::GetFlag(FLAGS_render_progressive);
+  the_options.sample_budget = absl::GetFlag(FLAGS_render_sample_budget);
+  the_options.cancel = &interrupt_token;
 
   std::string output_file = absl::GetFlag(FLAGS_output_file);
 
@@ -92,6 +154,14 @@ int main(int argc, char **argv) {
           sample_db.wavelength_size, absl::GetFlag(FLAGS_wavelength_bins));
       return 1;
     }
+
+    if (the_options.adaptive_threshold > 0.0f && !sample_db.tracks_variance) {
+      std::cerr << absl::StreamFormat(
+          "Adaptive sampling requested, but the existing spectral image %s "
+          "doesn't track variance\n",
+          output_file);
+      return 1;
+    }
   } else {
     std::ifstream in(output_file, std::ifstream::binary);
     if (in) {
@@ -106,6 +176,9 @@ int main(int argc, char **argv) {
                                absl::GetFlag(FLAGS_wavelength_bins),
                                absl::GetFlag(FLAGS_wavelength_min),
                                absl::GetFlag(FLAGS_wavelength_max));
+    if (the_options.adaptive_threshold > 0.0f) {
+      sample_db.track_variance();
+    }
   }
 
   scene the_scene;
@@ -130,7 +203,10 @@ int main(int argc, char **argv) {
   infinity infinity;
   sphere sphere;
 
-  surface_mesh bunny = surface_mesh_from_obj_file("bunny.obj", true);
+  std::string bunny_cache = absl::GetFlag(FLAGS_bunny_cache);
+  surface_mesh bunny = bunny_cache.empty()
+                           ? surface_mesh_from_obj_file("bunny.obj", true)
+                           : surface_mesh_from_cache(bunny_cache);
 
   box center_box({span<double>{0, 0.5}, {0, 0.5}, {0, 0.5}});
 
@@ -163,17 +239,40 @@ int main(int argc, char **argv) {
 
   crush(the_scene, 0.0);
 
+  tri_mesh_footprint bunny_footprint = bunny.footprint();
+  std::cerr << absl::StreamFormat(
+      "%s: %d bytes%s (attributes %d, indices %d, tree %d, blocks %d)\n",
+      bunny_cache.empty() ? "bunny.obj" : bunny_cache,
+      bunny_footprint.total(), bunny_cache.empty() ? "" : " mapped",
+      bunny_footprint.attributes, bunny_footprint.indices,
+      bunny_footprint.tree, bunny_footprint.blocks);
+
   pinhole the_camera({1, 1, 2}, {1, 0, 0, 0, 1, 0, 0, 0, 1},
                      {0.02, 0.018, 0.012});
 
   the_camera.set_eye(fixvec<double, 3>{5, 5, 1} - the_camera.center);
 
+  // The time limit covers only the render itself, not scene loading.
+  double time_limit = absl::GetFlag(FLAGS_render_time_limit);
+  if (time_limit > 0.0) {
+    the_options.deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(time_limit));
+  }
+
+  std::signal(SIGINT, handle_interrupt);
+
   render_scene(the_options, &sample_db, the_camera, the_scene,
                [](size_t cur, size_t tot) {
-                 std::cerr << absl::StreamFormat("\r%d/%d %d%%", cur, tot,
-                                                 (cur / (tot / 100)));
+                 std::cerr << absl::StreamFormat(
+                     "\r%d/%d %d%%", cur, tot, tot == 0 ? 0 : cur * 100 / tot);
                });
 
+  if (interrupt_token.is_cancelled()) {
+    std::cerr << "\nInterrupted, writing the samples collected so far";
+  }
+
   std::cerr << "\n";
 
   std::ofstream out(output_file, std::ofstream::binary);
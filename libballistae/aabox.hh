@@ -108,7 +108,7 @@ inline span<double> ray_test(const ray_segment &r, const aabox &b) {
 inline double surface_area(const aabox &box) {
   double accum = 0;
   for (size_t axis_a = 0; axis_a < 3; ++axis_a) {
-    for (size_t axis_b = axis_a; axis_b < 3; ++axis_b) {
+    for (size_t axis_b = axis_a + 1; axis_b < 3; ++axis_b) {
       accum +=
           double(2) * measure(box.spans[axis_a]) * measure(box.spans[axis_b]);
     }
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ballistae {
+
+/// A table for drawing indices in proportion to a set of weights in constant
+/// time (Vose's alias method).
+///
+/// Each slot is picked uniformly.  The slot's own index is kept with
+/// probability PROBABILITY[slot], and otherwise its ALIAS is taken.
+/// A single uniform value makes both choices, so that stratification of the
+/// values carries over to the indices drawn.
+struct alias_table {
+  std::vector<double> probability;
+  std::vector<std::uint32_t> alias;
+
+  /// The sum of the weights that the table was built from.
+  double total_weight;
+
+  /// Draw an index, using the uniform value U in [0, 1).
+  ///
+  /// The integer part of U * size() picks the slot, and the fractional part
+  /// decides between the slot and its alias.
+  std::size_t operator()(double u) const;
+};
+
+inline alias_table make_alias_table(const std::vector<double> &weights) {
+  alias_table result;
+  result.probability.resize(weights.size());
+  result.alias.resize(weights.size());
+
+  result.total_weight = 0;
+  for (double w : weights) {
+    result.total_weight += w;
+  }
+
+  if (result.total_weight <= 0) {
+    return result;
+  }
+
+  // Scale so that the mean weight is 1, then pair each slot below 1 with one
+  // above it.
+  std::vector<double> scaled(weights.size());
+  std::vector<std::uint32_t> small;
+  std::vector<std::uint32_t> large;
+  for (std::size_t i = 0; i < weights.size(); ++i) {
+    scaled[i] = weights[i] * weights.size() / result.total_weight;
+    (scaled[i] < 1.0 ? small : large).push_back(std::uint32_t(i));
+  }
+
+  while (!small.empty() && !large.empty()) {
+    std::uint32_t s = small.back();
+    small.pop_back();
+    std::uint32_t l = large.back();
+
+    result.probability[s] = scaled[s];
+    result.alias[s] = l;
+
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+
+  // Whatever is left over is 1, up to rounding.
+  for (std::uint32_t i : large) {
+    result.probability[i] = 1.0;
+    result.alias[i] = i;
+  }
+  for (std::uint32_t i : small) {
+    result.probability[i] = 1.0;
+    result.alias[i] = i;
+  }
+
+  return result;
+}
+
+inline std::size_t alias_table::operator()(double u) const {
+  double scaled = u * this->probability.size();
+  std::size_t slot =
+      std::min(std::size_t(scaled), this->probability.size() - 1);
+  double keep = scaled - slot;
+  return keep < this->probability[slot] ? slot : this->alias[slot];
+}
+
+}  // namespace ballistae
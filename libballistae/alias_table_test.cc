@@ -0,0 +1,92 @@
+#include "libballistae/alias_table.hh"
+
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace ballistae {
+namespace {
+
+// Count the indices drawn from TABLE for COUNT evenly spaced values of u.
+std::vector<std::size_t> stratified_counts(const alias_table &table,
+                                           std::size_t count) {
+  std::vector<std::size_t> counts(table.probability.size(), 0);
+  for (std::size_t i = 0; i < count; ++i) {
+    std::size_t drawn = table((i + 0.5) / count);
+    EXPECT_LT(drawn, counts.size());
+    if (drawn < counts.size()) ++counts[drawn];
+  }
+  return counts;
+}
+
+TEST(AliasTable, FrequenciesFollowWeights) {
+  std::vector<double> weights = {1.0, 2.0, 0.5, 7.0, 3.0, 0.25, 1.0, 5.25};
+  alias_table table = make_alias_table(weights);
+  EXPECT_DOUBLE_EQ(table.total_weight, 20.0);
+
+  // Evenly spaced values hit each slot the same number of times, spread over
+  // its keep/alias split, so the counts are exact up to one per slot.
+  constexpr std::size_t count = 8 * 10000;
+  std::vector<std::size_t> counts = stratified_counts(table, count);
+  for (std::size_t i = 0; i < weights.size(); ++i) {
+    double expected = count * weights[i] / table.total_weight;
+    EXPECT_NEAR(counts[i], expected, double(weights.size())) << "index " << i;
+  }
+}
+
+TEST(AliasTable, RandomFrequenciesFollowWeights) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<double> weight(0.0, 1.0);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+  std::vector<double> weights(37);
+  for (double &w : weights) w = weight(gen);
+  alias_table table = make_alias_table(weights);
+
+  constexpr std::size_t count = 1000000;
+  std::vector<std::size_t> counts(weights.size(), 0);
+  for (std::size_t i = 0; i < count; ++i) {
+    ++counts[table(uniform(gen))];
+  }
+
+  // Five standard deviations of a binomial count.
+  for (std::size_t i = 0; i < weights.size(); ++i) {
+    double p = weights[i] / table.total_weight;
+    double sigma = std::sqrt(count * p * (1 - p));
+    EXPECT_NEAR(counts[i], count * p, 5 * sigma) << "index " << i;
+  }
+}
+
+TEST(AliasTable, ZeroWeightsAreNeverDrawn) {
+  std::vector<double> weights = {0.0, 3.0, 0.0, 0.0, 1.0, 0.0, 2.0, 0.0};
+  alias_table table = make_alias_table(weights);
+
+  std::vector<std::size_t> counts = stratified_counts(table, 100003);
+  for (std::size_t i = 0; i < weights.size(); ++i) {
+    if (weights[i] == 0.0) {
+      EXPECT_EQ(counts[i], 0u) << "index " << i;
+    }
+  }
+
+  // Including at the ends of [0, 1), and on slot boundaries.
+  for (std::size_t slot = 0; slot <= weights.size(); ++slot) {
+    for (double u : {double(slot) / weights.size(),
+                     std::nextafter(double(slot) / weights.size(), 0.0)}) {
+      if (u < 0.0 || u >= 1.0) continue;
+      EXPECT_NE(weights[table(u)], 0.0) << "u " << u;
+    }
+  }
+}
+
+TEST(AliasTable, SingleWeight) {
+  alias_table table = make_alias_table({4.0});
+  EXPECT_EQ(table(0.0), 0u);
+  EXPECT_EQ(table(0.5), 0u);
+  EXPECT_EQ(table(std::nextafter(1.0, 0.0)), 0u);
+}
+
+}  // namespace
+}  // namespace ballistae
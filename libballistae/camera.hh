@@ -4,6 +4,7 @@
 #include <random>
 
 #include "libballistae/ray.hh"
+#include "libballistae/sample_rng.hh"
 #include "libballistae/vector.hh"
 
 namespace ballistae {
@@ -14,7 +15,7 @@ class camera {
 
   virtual ray image_to_ray(std::size_t cur_row, std::size_t img_rows,
                            std::size_t cur_col, std::size_t img_cols,
-                           std::mt19937 &rng) const = 0;
+                           sample_rng &rng) const = 0;
 };
 
 }  // namespace ballistae
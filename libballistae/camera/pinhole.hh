@@ -1,7 +1,7 @@
 #ifndef BALLISTAE_CAMERA_PINHOLE_HH
 #define BALLISTAE_CAMERA_PINHOLE_HH
 
-#include <random>
+#include <array>
 
 #include "frustum/indicial/fixed.hh"
 #include "libballistae/camera.hh"
@@ -26,7 +26,7 @@ class pinhole : public ballistae::camera {
 
   virtual ray image_to_ray(std::size_t cur_row, std::size_t img_rows,
                            std::size_t cur_col, std::size_t img_cols,
-                           std::mt19937 &rng) const override {
+                           sample_rng &rng) const override {
     using frustum::eltwise_mul;
     using frustum::normalise;
 
@@ -35,10 +35,10 @@ class pinhole : public ballistae::camera {
     double d_img_cols = static_cast<double>(img_cols);
     double d_img_rows = static_cast<double>(img_rows);
 
-    std::uniform_real_distribution<double> ss_dist(0.0, 1.0);
+    std::array<double, 2> jitter = uniform_2d(rng);
 
-    double y = 1.0 - 2.0 * (d_cur_col - ss_dist(rng)) / d_img_cols;
-    double z = 1.0 - 2.0 * (d_cur_row - ss_dist(rng)) / d_img_rows;
+    double y = 1.0 - 2.0 * (d_cur_col - jitter[0]) / d_img_cols;
+    double z = 1.0 - 2.0 * (d_cur_row - jitter[1]) / d_img_rows;
 
     fixvec<double, 3> image_coords{1.0, y, z};
 
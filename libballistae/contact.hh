@@ -7,6 +7,13 @@
 
 namespace ballistae {
 
+/// The ways a ray can meet a surface: entering it, leaving it, or running
+/// along it.  CONTACT_HIT marks a contact that lies on the surface's extent.
+constexpr int CONTACT_INTO = (1 << 0);
+constexpr int CONTACT_EXIT = (1 << 1);
+constexpr int CONTACT_SKIM = (1 << 2);
+constexpr int CONTACT_HIT = (1 << 3);
+
 struct contact final {
   double t;
   ray r;
@@ -0,0 +1,74 @@
+#include "libballistae/geometry/cylinder.hh"
+
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include "gtest/gtest.h"
+
+namespace ballistae {
+namespace {
+
+constexpr double inf = std::numeric_limits<double>::infinity();
+
+ray_segment make_query(const fixvec<double, 3> &point,
+                       const fixvec<double, 3> &slope, span<double> segment) {
+  ray_segment result;
+  result.the_ray.point = point;
+  result.the_ray.slope = normalise(slope);
+  result.the_ray.patch_area = 0.0;
+  result.the_segment = segment;
+  return result;
+}
+
+TEST(Cylinder, HitsAcrossTheAxis) {
+  cylinder c({0.0, 0.0, 0.0}, {0.0, 0.0, 2.0}, 1.0);
+
+  int type = 0;
+  contact into = c.ray_nearest(
+      make_query({-3.0, 0.0, 5.0}, {1.0, 0.0, 0.0}, {0.0, inf}), &type);
+  EXPECT_DOUBLE_EQ(into.t, 2.0);
+  EXPECT_EQ(type, CONTACT_INTO);
+  EXPECT_DOUBLE_EQ(into.p(0), -1.0);
+  EXPECT_DOUBLE_EQ(into.n(0), -1.0);
+
+  contact exit = c.ray_nearest(
+      make_query({-3.0, 0.0, 5.0}, {1.0, 0.0, 0.0}, {3.0, inf}), &type);
+  EXPECT_DOUBLE_EQ(exit.t, 4.0);
+  EXPECT_EQ(type, CONTACT_EXIT);
+
+  // Passing outside, the ray never enters.
+  EXPECT_TRUE(std::isnan(
+      c.ray_into(make_query({-3.0, 2.0, 5.0}, {1.0, 0.0, 0.0}, {0.0, inf})).t));
+}
+
+// ray_nearest finds in one pass what ray_into and ray_exit find together.
+TEST(Cylinder, NearestMatchesIntoAndExit) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<double> coord(-3.0, 3.0);
+
+  cylinder c({0.5, -0.25, 0.0}, {1.0, 2.0, 3.0}, 1.5);
+  int hits = 0;
+  for (int trial = 0; trial < 10000; ++trial) {
+    ray_segment query =
+        make_query({coord(gen), coord(gen), coord(gen)},
+                   {coord(gen), coord(gen), coord(gen)},
+                   {trial % 2 ? 0.0 : coord(gen), trial % 3 ? inf : 4.0});
+
+    int type = 0;
+    int expected_type = 0;
+    contact actual = c.ray_nearest(query, &type);
+    contact expected = c.geometry::ray_nearest(query, &expected_type);
+    if (std::isnan(expected.t)) {
+      EXPECT_TRUE(std::isnan(actual.t)) << "trial " << trial;
+      continue;
+    }
+    if (std::isfinite(expected.t)) ++hits;
+    EXPECT_DOUBLE_EQ(actual.t, expected.t) << "trial " << trial;
+    EXPECT_EQ(type, expected_type) << "trial " << trial;
+  }
+  EXPECT_GT(hits, 2000);
+}
+
+}  // namespace
+}  // namespace ballistae
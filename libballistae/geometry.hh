@@ -1,13 +1,16 @@
 #ifndef LIBBALLISTAE_GEOM_PLUGIN_INTERFACE_HH
 #define LIBBALLISTAE_GEOM_PLUGIN_INTERFACE_HH
 
+#include <cmath>
 #include <cstddef>
+#include <random>
 #include <vector>
 
 #include "frustum/geometry/affine_transform.hh"
 #include "libballistae/aabox.hh"
 #include "libballistae/contact.hh"
 #include "libballistae/ray.hh"
+#include "libballistae/sample_rng.hh"
 #include "libballistae/span.hh"
 
 namespace ballistae {
@@ -23,8 +26,87 @@ class geometry {
   virtual contact ray_into(const ray_segment &query) const = 0;
 
   virtual contact ray_exit(const ray_segment &query) const = 0;
+
+  /// Find the nearest contact in QUERY's segment, whether the ray is entering
+  /// or leaving the geometry.
+  ///
+  /// CONTACT_TYPE receives CONTACT_INTO or CONTACT_EXIT.  Returns
+  /// contact::nan() if there is no contact.
+  ///
+  /// The default calls ray_into and ray_exit; geometries that can find both
+  /// in one pass should override it.
+  virtual contact ray_nearest(const ray_segment &query,
+                              int *contact_type) const;
+
+  /// Whether there is any contact in QUERY's segment.
+  ///
+  /// The default calls ray_nearest.
+  virtual bool ray_occluded(const ray_segment &query) const;
+
+  /// The area of the surface, in model space.
+  ///
+  /// Geometries that can't be sampled by area, such as infinite ones, return
+  /// zero.
+  virtual double surface_area() const { return 0; }
+
+  /// Get ready for sample_surface, after crush(TIME).
+  ///
+  /// crush() only has to make surface_area() ready.  The scene calls this
+  /// just for the geometries that it samples as lights, so that others
+  /// needn't build tables for sampling.  The default does nothing.
+  virtual void prepare_sampling(double time) {}
+
+  /// Pick a point on the surface, uniformly by area, in model space.
+  ///
+  /// The contact's P, N, MTL2, and MTL3 are set.  Only valid if
+  /// surface_area() is positive, and after prepare_sampling().
+  virtual contact sample_surface(sample_rng &rng) const {
+    return contact::nan();
+  }
+
+  /// Whether every contact lies at infinity, beyond any other geometry.
+  ///
+  /// Such geometries act as the scene's environment: they are only looked at
+  /// when a ray hits nothing else, and they never occlude anything.
+  virtual bool at_infinity() const { return false; }
 };
 
+inline contact geometry::ray_nearest(const ray_segment &query,
+                                     int *contact_type) const {
+  using std::isnan;
+
+  ray_segment cur_query = query;
+
+  contact into_contact = this->ray_into(cur_query);
+  bool into_valid = !isnan(into_contact.t) &&
+                    contains(cur_query.the_segment, into_contact.t);
+  if (into_valid) {
+    cur_query.the_segment.hi = into_contact.t;
+  }
+
+  contact exit_contact = this->ray_exit(cur_query);
+  if (!isnan(exit_contact.t) &&
+      contains(cur_query.the_segment, exit_contact.t)) {
+    *contact_type = CONTACT_EXIT;
+    return exit_contact;
+  }
+
+  if (into_valid) {
+    *contact_type = CONTACT_INTO;
+    return into_contact;
+  }
+
+  return contact::nan();
+}
+
+inline bool geometry::ray_occluded(const ray_segment &query) const {
+  using std::isnan;
+
+  int contact_type;
+  contact c = this->ray_nearest(query, &contact_type);
+  return !isnan(c.t) && contains(query.the_segment, c.t);
+}
+
 }  // namespace ballistae
 
 #endif
@@ -23,6 +23,42 @@ class box : public geometry {
 
   virtual void crush(double time) {}
 
+  virtual double surface_area() const {
+    return ballistae::surface_area(aabox{spans});
+  }
+
+  virtual contact sample_surface(sample_rng &rng) const {
+    // The two faces across each axis share an area.
+    std::array<double, 3> face_area;
+    for (size_t i = 0; i < 3; ++i) {
+      face_area[i] =
+          measure(spans[(i + 1) % 3]) * measure(spans[(i + 2) % 3]);
+    }
+
+    double pick = uniform_1d(rng) * 2.0 *
+                  (face_area[0] + face_area[1] + face_area[2]);
+    size_t axis = 0;
+    while (axis < 2 && pick >= 2.0 * face_area[axis]) {
+      pick -= 2.0 * face_area[axis];
+      ++axis;
+    }
+    bool hi_face = pick >= face_area[axis];
+
+    std::array<double, 2> u = uniform_2d(rng);
+    size_t axis_a = (axis + 1) % 3;
+    size_t axis_b = (axis + 2) % 3;
+
+    contact result;
+    result.p(axis) = hi_face ? spans[axis].hi : spans[axis].lo;
+    result.p(axis_a) = spans[axis_a].lo + u[0] * measure(spans[axis_a]);
+    result.p(axis_b) = spans[axis_b].lo + u[1] * measure(spans[axis_b]);
+    result.n = {0, 0, 0};
+    result.n(axis) = hi_face ? 1 : -1;
+    result.mtl2 = {0, 0};
+    result.mtl3 = {result.p};
+    return result;
+  }
+
   virtual contact ray_into(const ray_segment &query) const {
     using std::max;
     using std::min;
@@ -120,6 +156,61 @@ class box : public geometry {
       return contact::nan();
     }
   }
+
+  virtual contact ray_nearest(const ray_segment &query,
+                              int *contact_type) const {
+    using std::swap;
+
+    span<double> cover = {-std::numeric_limits<double>::infinity(),
+                          std::numeric_limits<double>::infinity()};
+
+    fixvec<double, 3> into_axis = {0, 0, 0};
+    fixvec<double, 3> exit_axis = {0, 0, 0};
+    for (size_t i = 0; i < 3; ++i) {
+      span<double> cur = {
+          (spans[i].lo - query.the_ray.point(i)) / query.the_ray.slope(i),
+          (spans[i].hi - query.the_ray.point(i)) / query.the_ray.slope(i)};
+
+      double normal_component = -1;
+      if (cur.hi < cur.lo) {
+        swap(cur.lo, cur.hi);
+        normal_component = 1;
+      }
+
+      if (!(overlaps(cover, cur))) return contact::nan();
+
+      if (cover.lo < cur.lo) {
+        cover.lo = cur.lo;
+        into_axis = {0, 0, 0};
+        into_axis[i] = normal_component;
+      }
+
+      if (cur.hi < cover.hi) {
+        cover.hi = cur.hi;
+        exit_axis = {0, 0, 0};
+        exit_axis[i] = -normal_component;
+      }
+    }
+
+    contact result;
+    if (contains(query.the_segment, cover.lo)) {
+      *contact_type = CONTACT_INTO;
+      result.t = cover.lo;
+      result.n = into_axis;
+    } else if (contains(query.the_segment, cover.hi)) {
+      *contact_type = CONTACT_EXIT;
+      result.t = cover.hi;
+      result.n = exit_axis;
+    } else {
+      return contact::nan();
+    }
+
+    result.r = query.the_ray;
+    result.p = eval_ray(query.the_ray, result.t);
+    result.mtl2 = {0, 0};
+    result.mtl3 = {result.p};
+    return result;
+  }
 };
 
 }  // namespace ballistae
@@ -1,12 +1,15 @@
 #ifndef BALLISTAE_GEOMETRY_CYLINDER_HH
 #define BALLISTAE_GEOMETRY_CYLINDER_HH
 
-#include <frustum-0/indicial/fixed.hh>
-#include <libballistae/contact.hh>
-#include <libballistae/geometry.hh>
-#include <libballistae/ray.hh>
-#include <libballistae/span.hh>
-#include <libballistae/vector.hh>
+#include <cmath>
+#include <limits>
+
+#include "frustum/indicial/fixed.hh"
+#include "libballistae/contact.hh"
+#include "libballistae/geometry.hh"
+#include "libballistae/ray.hh"
+#include "libballistae/span.hh"
+#include "libballistae/vector.hh"
 
 namespace ballistae {
 
@@ -25,22 +28,22 @@ class cylinder : public geometry {
 
   virtual ~cylinder() {}
 
-  virtual aabox<double, 3> get_aabox() {
+  virtual aabox get_aabox() {
     // Only a few infinite cylinders are bounded on any of the principle axes.
 
-    aabox<double, 3> infinity = {-std::numeric_limits<double>::infinity(),
-                                 std::numeric_limits<double>::infinity(),
-                                 -std::numeric_limits<double>::infinity(),
-                                 std::numeric_limits<double>::infinity(),
-                                 -std::numeric_limits<double>::infinity(),
-                                 std::numeric_limits<double>::infinity()};
+    aabox infinity = {-std::numeric_limits<double>::infinity(),
+                      std::numeric_limits<double>::infinity(),
+                      -std::numeric_limits<double>::infinity(),
+                      std::numeric_limits<double>::infinity(),
+                      -std::numeric_limits<double>::infinity(),
+                      std::numeric_limits<double>::infinity()};
 
     return infinity;
   }
 
   virtual void crush(double time) {}
 
-  virtual contact<double> ray_into(const ray_segment<double, 3> &query) const {
+  virtual contact ray_into(const ray_segment &query) const {
     using std::atan2;
     using std::sqrt;
 
@@ -57,7 +60,7 @@ class cylinder : public geometry {
       // Ray hits cylinder.
 
       if (contains(query.the_segment, t_min)) {
-        contact<double> result;
+        contact result;
 
         result.t = t_min;
         result.r = query.the_ray;
@@ -68,27 +71,27 @@ class cylinder : public geometry {
 
         return result;
       } else {
-        return contact<double>::nan();
+        return contact::nan();
       }
     } else {
       // Ray misses cylinder.  It could miss outside or inside.
 
       if (c > double(0)) {
-        return ballistae::contact<double>::nan();
+        return contact::nan();
       } else {
         if (contains(query.the_segment,
                      -std::numeric_limits<double>::infinity())) {
-          contact<double> result;
+          contact result;
           result.t = -std::numeric_limits<double>::infinity();
           result.r = query.the_ray;
           return result;
         } else
-          return contact<double>::nan();
+          return contact::nan();
       }
     }
   }
 
-  virtual contact<double> ray_exit(const ray_segment<double, 3> &query) const {
+  virtual contact ray_exit(const ray_segment &query) const {
     using std::atan2;
     using std::sqrt;
 
@@ -105,7 +108,7 @@ class cylinder : public geometry {
       // The ray hits the cylinder.
 
       if (contains(query.the_segment, t_max)) {
-        contact<double> result;
+        contact result;
 
         result.t = t_max;
         result.r = query.the_ray;
@@ -116,21 +119,75 @@ class cylinder : public geometry {
 
         return result;
       } else {
-        return contact<double>::nan();
+        return contact::nan();
       }
     } else {
       // Ray misses cylinder.  It could miss inside or outside.
 
       if (contains(query.the_segment,
                    std::numeric_limits<double>::infinity())) {
-        contact<double> result;
+        contact result;
         result.t = std::numeric_limits<double>::infinity();
         result.r = query.the_ray;
         return result;
       } else
-        return contact<double>::nan();
+        return contact::nan();
     }
   }
+
+  virtual contact ray_nearest(const ray_segment &query,
+                              int *contact_type) const {
+    using std::atan2;
+    using std::sqrt;
+
+    auto foil_a = reject(axis, query.the_ray.slope);
+    auto foil_b = reject(axis, query.the_ray.point - center);
+
+    double a = iprod(foil_a, foil_a);
+    double b = 2.0 * iprod(foil_a, foil_b);
+    double c = iprod(foil_b, foil_b) - radius_squared;
+
+    double root = sqrt(b * b - 4.0 * a * c);
+    double t_min = (-b - root) / (2.0 * a);
+    double t_max = (-b + root) / (2.0 * a);
+
+    if (std::isnan(t_min)) {
+      // Ray misses cylinder.  It could miss inside or outside.
+      contact result;
+      result.r = query.the_ray;
+      if (c <= double(0) &&
+          contains(query.the_segment,
+                   -std::numeric_limits<double>::infinity())) {
+        *contact_type = CONTACT_INTO;
+        result.t = -std::numeric_limits<double>::infinity();
+        return result;
+      } else if (contains(query.the_segment,
+                          std::numeric_limits<double>::infinity())) {
+        *contact_type = CONTACT_EXIT;
+        result.t = std::numeric_limits<double>::infinity();
+        return result;
+      } else
+        return contact::nan();
+    }
+
+    contact result;
+    if (contains(query.the_segment, t_min)) {
+      *contact_type = CONTACT_INTO;
+      result.t = t_min;
+    } else if (contains(query.the_segment, t_max)) {
+      *contact_type = CONTACT_EXIT;
+      result.t = t_max;
+    } else
+      return contact::nan();
+
+    result.r = query.the_ray;
+    result.p = eval_ray(query.the_ray, result.t);
+    result.n = reject(axis, result.p - center);
+    result.mtl2 = {result.p(0), std::atan2(result.p(1), result.p(2))};
+    result.mtl3 = result.p;
+
+    return result;
+  }
 };
 
 }  // namespace ballistae
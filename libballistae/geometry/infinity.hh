@@ -66,6 +66,29 @@ class infinity final : public geometry {
       return contact::nan();
     }
   }
+
+  virtual contact ray_nearest(const ray_segment &query,
+                              int *contact_type) const {
+    // Leaving at negative infinity is nearer than entering at infinity.
+    auto infty = std::numeric_limits<double>::infinity();
+    if (query.the_segment.lo == -infty) {
+      *contact_type = CONTACT_EXIT;
+      return this->ray_exit(query);
+    } else if (query.the_segment.hi == infty) {
+      *contact_type = CONTACT_INTO;
+      return this->ray_into(query);
+    } else {
+      return contact::nan();
+    }
+  }
+
+  virtual bool ray_occluded(const ray_segment &query) const {
+    // Contacts with infinity lie at the ends of the ray, so they never come
+    // between two points.
+    return false;
+  }
+
+  virtual bool at_infinity() const { return true; }
 };
 
 }  // namespace ballistae
@@ -3,15 +3,19 @@
 
 #include <algorithm>
 #include <array>
-#include <cinttypes>
+#include <charconv>
 #include <cstddef>
-#include <cstdio>
-#include <cstdlib>
+#include <cstdint>
 #include <cstring>
+#include <memory>
 #include <string>
+#include <system_error>
 #include <tuple>
+#include <vector>
 
 #include "libballistae/geometry/tri_mesh.hh"
+#include "libballistae/mapped_file.hh"
+#include "libballistae/thread_pool.hh"
 
 namespace ballistae {
 
@@ -41,32 +45,31 @@ std::tuple<bool, const char *> parse_literal(const char *src, const char *lim,
     return std::make_tuple(false, src);
 }
 
-std::tuple<bool, const char *, size_t> parse_size_t(const char *src,
-                                                    const char *lim) {
-  const char *cur = src;
-
-  char *strtoumax_end;
-  uintmax_t parsed = std::strtoumax(cur, &strtoumax_end, 10);
-  cur = strtoumax_end;
-  if (parsed < std::numeric_limits<size_t>::min() ||
-      parsed > std::numeric_limits<size_t>::max() || cur == src)
-    return std::make_tuple(false, src, std::numeric_limits<size_t>::max());
-  else
-    return std::make_tuple(true, cur, parsed);
+/// Skip any spaces and tabs at the start of [src, lim).
+const char *skip_blanks(const char *src, const char *lim) {
+  while (src != lim && (*src == 0x9 || *src == 0x20)) ++src;
+  return src;
 }
 
+/// Parse a decimal number, after any blanks.
+///
+/// Unlike strtod, this never reads past LIM and ignores the locale.
 std::tuple<bool, const char *, double> parse_double(const char *src,
                                                     const char *lim) {
-  const char *cur = src;
+  const char *cur = skip_blanks(src, lim);
 
-  char *strtod_end;
-  double parsed = std::strtod(cur, &strtod_end);
-  cur = strtod_end;
+  // from_chars doesn't take a plus sign.
+  if (cur != lim && *cur == '+') {
+    ++cur;
+    if (cur != lim && *cur == '-') return std::make_tuple(false, src, 0.0);
+  }
 
-  if (cur == src)
+  double parsed;
+  std::from_chars_result result = std::from_chars(cur, lim, parsed);
+  if (result.ec != std::errc())
     return std::make_tuple(false, src, 0.0);
   else
-    return std::make_tuple(true, cur, parsed);
+    return std::make_tuple(true, result.ptr, parsed);
 }
 
 /// Parse a newline sequence.
@@ -139,7 +142,7 @@ std::tuple<bool, const char *> parse_texcoord_line(const char *src,
   std::tie(success, cur) = parse_newline(cur, lim);
   if (!success) return std::make_tuple(false, src);
 
-  the_mesh.m.push_back({u, v});
+  the_mesh.m.push_back({float(u), float(v)});
 
   return std::make_tuple(true, cur);
 }
@@ -170,7 +173,7 @@ std::tuple<bool, const char *> parse_normal_line(const char *src,
     swap(y, z);
   }
 
-  the_mesh.n.push_back({x, y, z});
+  the_mesh.n.push_back({float(x), float(y), float(z)});
 
   return std::make_tuple(true, cur);
 }
@@ -201,25 +204,70 @@ std::tuple<bool, const char *> parse_vertex_line(const char *src,
     swap(y, z);
   }
 
-  the_mesh.v.push_back({x, y, z});
+  the_mesh.v.push_back({float(x), float(y), float(z)});
 
   return std::make_tuple(true, cur);
 }
 
+/// A face corner whose index counted back from the most recent element.
+struct obj_relative_index {
+  /// 0 for positions, 1 for material coordinates, 2 for normals.
+  std::uint32_t attribute;
+  std::uint32_t corner;
+
+  /// The face, within the chunk's index array for ATTRIBUTE.
+  std::size_t face;
+};
+
+/// What parse_obj_chunk makes of a run of lines.
+struct obj_chunk {
+  int errc = OBJ_ERRC_NONE;
+
+  /// The number of lines parsed, including the one with the error, if any.
+  std::size_t lines = 0;
+
+  /// Face indices are still 1-based.
+  tri_mesh mesh;
+
+  /// The corners whose indices were resolved against the chunk's own
+  /// attributes.  They still need to be shifted by the number of elements
+  /// that came before the chunk.
+  std::vector<obj_relative_index> relative;
+};
+
+/// Parse a "Wavefront obj" index, after any blanks.
+///
+/// Indices are 1-based, or negative to count back from the most recent
+/// element (-1 being the last).  Either way, they must fit in 32 bits.
+std::tuple<bool, const char *, std::int64_t> parse_index(const char *src,
+                                                         const char *lim) {
+  const char *cur = skip_blanks(src, lim);
+
+  bool negative = cur != lim && *cur == '-';
+  if (negative) ++cur;
+
+  std::uint32_t parsed;
+  std::from_chars_result result = std::from_chars(cur, lim, parsed);
+  if (result.ec != std::errc() || parsed == 0)
+    return std::make_tuple(false, src, std::int64_t(0));
+  else
+    return std::make_tuple(true, result.ptr,
+                           negative ? -std::int64_t(parsed) : parsed);
+}
+
 /// Parse a "Wavefront obj"-style index triple.
 ///
-/// Any unspecified indices will be returned as size_t's max value.
-std::tuple<bool, const char *, std::array<size_t, 3>> parse_index_triple(
-    const char *src, const char *lim) {
+/// Any unspecified indices will be returned as 0, which is never a valid
+/// index.
+std::tuple<bool, const char *, std::array<std::int64_t, 3>>
+parse_index_triple(const char *src, const char *lim) {
   const char *cur = src;
 
-  std::array<size_t, 3> result = {std::numeric_limits<size_t>::max(),
-                                  std::numeric_limits<size_t>::max(),
-                                  std::numeric_limits<size_t>::max()};
+  std::array<std::int64_t, 3> result = {0, 0, 0};
 
   bool success;
 
-  std::tie(success, cur, result[0]) = parse_size_t(cur, lim);
+  std::tie(success, cur, result[0]) = parse_index(cur, lim);
   if (!success) return std::make_tuple(false, src, result);
 
   // If don't get a slash next, we're done.
@@ -230,7 +278,7 @@ std::tuple<bool, const char *, std::array<size_t, 3>> parse_index_triple(
   // texture-coordinate index, BUT it must then be immediately followed by
   // another slash.  If we do get a texture coordinate index, then we are done
   // if we aren't immediately followed by a slash.
-  std::tie(success, cur, result[1]) = parse_size_t(cur, lim);
+  std::tie(success, cur, result[1]) = parse_index(cur, lim);
   if (!success) {
     std::tie(success, cur) = parse_literal(cur, lim, "/");
     if (!success) return std::make_tuple(false, src, result);
@@ -241,22 +289,21 @@ std::tuple<bool, const char *, std::array<size_t, 3>> parse_index_triple(
 
   // Capture the normal index.  If we reached this point, a normal index is
   // required.
-  std::tie(success, cur, result[2]) = parse_size_t(cur, lim);
+  std::tie(success, cur, result[2]) = parse_index(cur, lim);
   if (!success) return std::make_tuple(false, src, result);
 
   return std::make_tuple(true, cur, result);
 }
 
 std::tuple<bool, const char *> parse_face_line(const char *src, const char *lim,
-                                               tri_mesh &the_mesh,
-                                               bool swapyz) {
+                                               obj_chunk &chunk, bool swapyz) {
   const char *cur = src;
 
   bool success;
   std::tie(success, cur) = parse_literal(cur, lim, "f");
   if (!success) return std::make_tuple(false, src);
 
-  std::array<std::array<size_t, 3>, 3> index_triples;
+  std::array<std::array<std::int64_t, 3>, 3> index_triples;
 
   std::tie(success, cur, index_triples[0]) = parse_index_triple(cur, lim);
   if (!success) return std::make_tuple(false, src);
@@ -270,21 +317,44 @@ std::tuple<bool, const char *> parse_face_line(const char *src, const char *lim,
   std::tie(success, cur) = parse_newline(cur, lim);
   if (!success) return std::make_tuple(false, src);
 
-  tri_face_idx assembled = {
-      {index_triples[0][0], index_triples[1][0], index_triples[2][0]},
-      {index_triples[0][1], index_triples[1][1], index_triples[2][1]},
-      {index_triples[0][2], index_triples[1][2], index_triples[2][2]}};
-
-  if (swapyz) {
-    using std::swap;
+  tri_mesh &the_mesh = chunk.mesh;
+  std::array<std::size_t, 3> seen = {the_mesh.v.size(), the_mesh.m.size(),
+                                     the_mesh.n.size()};
+  std::array<std::vector<tri_face_idx> *, 3> faces = {
+      &the_mesh.fv, &the_mesh.fm, &the_mesh.fn};
+
+  // Index arrays for attributes that no corner of the face names are left
+  // alone.  A corner that leaves out an attribute that another corner names
+  // keeps its 0, which the sanity check rejects.
+  for (size_t attribute = 0; attribute < 3; ++attribute) {
+    tri_face_idx assembled;
+    std::array<bool, 3> relative;
+    for (size_t corner = 0; corner < 3; ++corner) {
+      std::int64_t index = index_triples[corner][attribute];
+      relative[corner] = index < 0;
+      assembled[corner] =
+          std::uint32_t(index < 0 ? seen[attribute] + 1 + index : index);
+    }
+    if (assembled == tri_face_idx{0, 0, 0} &&
+        relative == std::array<bool, 3>{false, false, false})
+      continue;
+
+    if (swapyz) {
+      using std::swap;
+      swap(assembled[1], assembled[2]);
+      swap(relative[1], relative[2]);
+    }
 
-    swap(assembled.vi[1], assembled.vi[2]);
-    swap(assembled.ni[1], assembled.ni[2]);
-    swap(assembled.mi[1], assembled.mi[2]);
+    for (size_t corner = 0; corner < 3; ++corner) {
+      if (relative[corner]) {
+        chunk.relative.push_back({std::uint32_t(attribute),
+                                  std::uint32_t(corner),
+                                  faces[attribute]->size()});
+      }
+    }
+    faces[attribute]->push_back(assembled);
   }
 
-  the_mesh.f.push_back(assembled);
-
   return std::make_tuple(true, cur);
 }
 
@@ -339,90 +409,170 @@ std::tuple<bool, const char *> parse_usemtl_line(const char *src,
   return std::make_tuple(true, cur);
 }
 
-std::tuple<int, size_t, tri_mesh> parse_obj(const char *src, const char *lim,
-                                            bool swapyz) {
-  tri_mesh the_mesh;
-  size_t cur_line = 0;
+/// Parse the lines in [src, lim), which must begin at the start of a line.
+obj_chunk parse_obj_chunk(const char *src, const char *lim, bool swapyz) {
+  obj_chunk chunk;
 
   const char *cur = src;
   while (cur != lim) {
-    ++cur_line;
+    ++chunk.lines;
     bool success;
 
-    std::tie(success, cur) = parse_blank_line(cur, lim);
-    if (success) continue;
-
-    std::tie(success, cur) = parse_comment_line(cur, lim);
-    if (success) continue;
-
-    std::tie(success, cur) = parse_group_line(cur, lim);
-    if (success) continue;
-
-    std::tie(success, cur) = parse_mtllib_line(cur, lim);
-    if (success) continue;
-
-    std::tie(success, cur) = parse_usemtl_line(cur, lim);
-    if (success) continue;
+    // Only the parser for the kind of line named by its first characters
+    // gets to look at it.
+    switch (*cur) {
+      case '#':
+        std::tie(success, cur) = parse_comment_line(cur, lim);
+        break;
+      case 'g':
+        std::tie(success, cur) = parse_group_line(cur, lim);
+        break;
+      case 'm':
+        std::tie(success, cur) = parse_mtllib_line(cur, lim);
+        break;
+      case 'u':
+        std::tie(success, cur) = parse_usemtl_line(cur, lim);
+        break;
+      case 'f':
+        std::tie(success, cur) = parse_face_line(cur, lim, chunk, swapyz);
+        break;
+      case 'v':
+        if (lim - cur >= 2 && cur[1] == 't') {
+          std::tie(success, cur) = parse_texcoord_line(cur, lim, chunk.mesh);
+        } else if (lim - cur >= 2 && cur[1] == 'n') {
+          std::tie(success, cur) =
+              parse_normal_line(cur, lim, chunk.mesh, swapyz);
+        } else {
+          std::tie(success, cur) =
+              parse_vertex_line(cur, lim, chunk.mesh, swapyz);
+        }
+        break;
+      default:
+        std::tie(success, cur) = parse_blank_line(cur, lim);
+        break;
+    }
 
-    std::tie(success, cur) = parse_vertex_line(cur, lim, the_mesh, swapyz);
-    if (success) continue;
+    if (!success) {
+      chunk.errc = OBJ_ERRC_PARSE_ERROR;
+      return chunk;
+    }
+  }
 
-    std::tie(success, cur) = parse_texcoord_line(cur, lim, the_mesh);
-    if (success) continue;
+  return chunk;
+}
 
-    std::tie(success, cur) = parse_normal_line(cur, lim, the_mesh, swapyz);
-    if (success) continue;
+/// Parse the "Wavefront obj" file held in [src, lim).
+///
+/// The file is cut into chunks at line boundaries, which are parsed in
+/// parallel on the shared thread pool and then spliced together.  Chunks are
+/// at least MIN_CHUNK_SIZE bytes, so that the splicing doesn't show.
+std::tuple<int, size_t, tri_mesh> parse_obj(
+    const char *src, const char *lim, bool swapyz,
+    std::size_t min_chunk_size = std::size_t(1) << 20) {
+  thread_pool &pool = thread_pool::shared();
+
+  // A few chunks per thread, so that uneven chunks still balance.
+  std::size_t size = lim - src;
+  std::size_t chunk_count = std::max<std::size_t>(
+      1, std::min(size / std::max<std::size_t>(min_chunk_size, 1),
+                  4 * (pool.size() + 1)));
+
+  std::vector<const char *> bounds(chunk_count + 1);
+  bounds[0] = src;
+  bounds[chunk_count] = lim;
+  for (std::size_t i = 1; i < chunk_count; ++i) {
+    const char *cut = std::max(bounds[i - 1], src + size / chunk_count * i);
+    const void *newline = std::memchr(cut, 0xa, lim - cut);
+    bounds[i] =
+        newline == nullptr ? lim : static_cast<const char *>(newline) + 1;
+  }
 
-    std::tie(success, cur) = parse_face_line(cur, lim, the_mesh, swapyz);
-    if (success) continue;
+  std::vector<obj_chunk> chunks(chunk_count);
+  auto parse_chunks = [&](std::size_t chunk_src, std::size_t chunk_lim) {
+    for (std::size_t i = chunk_src; i < chunk_lim; ++i) {
+      chunks[i] = parse_obj_chunk(bounds[i], bounds[i + 1], swapyz);
+    }
+  };
+  parallel_for(&pool, chunk_count, 1, parse_chunks);
 
-    return std::make_tuple(OBJ_ERRC_PARSE_ERROR, cur_line, (tri_mesh()));
+  size_t cur_line = 0;
+  for (const obj_chunk &chunk : chunks) {
+    cur_line += chunk.lines;
+    if (chunk.errc != OBJ_ERRC_NONE)
+      return std::make_tuple(chunk.errc, cur_line, (tri_mesh()));
   }
 
-  // Correct from 1-based indices to 0-based indices.
-  for (tri_face_idx &idx : the_mesh.f) {
-    for (size_t i = 0; i < 3; ++i) {
-      --idx.vi[i];
-      if (idx.ni[i] != std::numeric_limits<size_t>::max()) --idx.ni[i];
-      if (idx.mi[i] != std::numeric_limits<size_t>::max()) --idx.mi[i];
+  // Each chunk's elements follow those of the chunks before it.  STARTS holds
+  // the offsets of positions, material coordinates, and normals, then of the
+  // corresponding index arrays.
+  std::vector<std::array<std::size_t, 6>> starts(chunk_count + 1);
+  starts[0] = {0, 0, 0, 0, 0, 0};
+  for (std::size_t i = 0; i < chunk_count; ++i) {
+    const tri_mesh &m = chunks[i].mesh;
+    std::array<std::size_t, 6> sizes = {m.v.size(),  m.m.size(),
+                                        m.n.size(),  m.fv.size(),
+                                        m.fm.size(), m.fn.size()};
+    for (std::size_t k = 0; k < 6; ++k) {
+      starts[i + 1][k] = starts[i][k] + sizes[k];
     }
   }
 
+  tri_mesh the_mesh;
+  the_mesh.v.resize(starts[chunk_count][0]);
+  the_mesh.m.resize(starts[chunk_count][1]);
+  the_mesh.n.resize(starts[chunk_count][2]);
+  the_mesh.fv.resize(starts[chunk_count][3]);
+  the_mesh.fm.resize(starts[chunk_count][4]);
+  the_mesh.fn.resize(starts[chunk_count][5]);
+
+  auto splice_chunks = [&](std::size_t chunk_src, std::size_t chunk_lim) {
+    for (std::size_t i = chunk_src; i < chunk_lim; ++i) {
+      const tri_mesh &m = chunks[i].mesh;
+      const std::array<std::size_t, 6> &at = starts[i];
+      std::copy(m.v.begin(), m.v.end(), the_mesh.v.begin() + at[0]);
+      std::copy(m.m.begin(), m.m.end(), the_mesh.m.begin() + at[1]);
+      std::copy(m.n.begin(), m.n.end(), the_mesh.n.begin() + at[2]);
+
+      std::array<const std::vector<tri_face_idx> *, 3> from = {&m.fv, &m.fm,
+                                                               &m.fn};
+      std::array<std::vector<tri_face_idx> *, 3> to = {
+          &the_mesh.fv, &the_mesh.fm, &the_mesh.fn};
+
+      // Correct from 1-based indices to 0-based indices.  Missing indices
+      // wrap around to out of range.
+      for (std::size_t k = 0; k < 3; ++k) {
+        tri_face_idx *out = to[k]->data() + at[3 + k];
+        for (const tri_face_idx &idx : *from[k]) {
+          *out++ = {idx[0] - 1, idx[1] - 1, idx[2] - 1};
+        }
+      }
+
+      for (const obj_relative_index &r : chunks[i].relative) {
+        std::size_t face = at[3 + r.attribute] + r.face;
+        (*to[r.attribute])[face][r.corner] += std::uint32_t(at[r.attribute]);
+      }
+    }
+  };
+  parallel_for(&pool, chunk_count, 1, splice_chunks);
+  chunks.clear();
+
   if (!tri_mesh_sanity_check(the_mesh))
     return std::make_tuple(OBJ_ERRC_INSANE, cur_line, (tri_mesh()));
 
-  return std::make_tuple(OBJ_ERRC_NONE, cur_line, the_mesh);
+  return std::make_tuple(OBJ_ERRC_NONE, cur_line, std::move(the_mesh));
 }
 
+/// Load the "Wavefront obj" file at FILENAME, which is mapped into memory
+/// rather than read.
 std::tuple<int, size_t, tri_mesh> tri_mesh_load_obj(const std::string &filename,
                                                     bool swapyz) {
-  FILE *f = std::fopen(filename.c_str(), "rb");
-  if (f == nullptr) {
-    return std::make_tuple(OBJ_ERRC_FILE_NOT_OPENABLE, std::size_t(0),
-                           tri_mesh());
-  }
-
-  std::fseek(f, 0, SEEK_END);
-  long fsize = std::ftell(f);
-  std::fseek(f, 0, SEEK_SET);
-
-  std::vector<char> buf(fsize + 1);
-  std::fread(&buf[0], 1, fsize, f);
-  if (std::ferror(f)) {
-    std::fclose(f);
+  std::unique_ptr<mapped_file> file = map_file(filename);
+  if (file == nullptr) {
     return std::make_tuple(OBJ_ERRC_FILE_NOT_OPENABLE, std::size_t(0),
                            tri_mesh());
   }
-  std::fclose(f);
-  buf[buf.size() - 1] = 0;
-
-  int errc = OBJ_ERRC_NONE;
-  size_t error_line = 0;
-  tri_mesh the_mesh;
 
-  std::tie(errc, error_line, the_mesh) =
-      parse_obj(&buf[0], &buf[buf.size()], swapyz);
-  return std::make_tuple(errc, error_line, the_mesh);
+  return parse_obj(file->data, file->data + file->size, swapyz);
 }
 
 }  // namespace ballistae
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "libballistae/geometry/tri_mesh.hh"
+#include "libballistae/mapped_file.hh"
+
+namespace ballistae {
+
+constexpr int PLY_ERRC_NONE = 0;
+constexpr int PLY_ERRC_FILE_NOT_OPENABLE = 1;
+
+/// The file is a PLY file, but not binary little-endian.
+constexpr int PLY_ERRC_FILE_NOT_LOADABLE = 2;
+constexpr int PLY_ERRC_PARSE_ERROR = 3;
+constexpr int PLY_ERRC_INSANE = 4;
+
+/// The scalar types of PLY properties.
+enum class ply_type {
+  none,
+  int8,
+  uint8,
+  int16,
+  uint16,
+  int32,
+  uint32,
+  float32,
+  float64,
+};
+
+/// The type named NAME, under either its old or its sized name, or none.
+inline ply_type ply_type_from_name(const std::string &name) {
+  if (name == "char" || name == "int8") return ply_type::int8;
+  if (name == "uchar" || name == "uint8") return ply_type::uint8;
+  if (name == "short" || name == "int16") return ply_type::int16;
+  if (name == "ushort" || name == "uint16") return ply_type::uint16;
+  if (name == "int" || name == "int32") return ply_type::int32;
+  if (name == "uint" || name == "uint32") return ply_type::uint32;
+  if (name == "float" || name == "float32") return ply_type::float32;
+  if (name == "double" || name == "float64") return ply_type::float64;
+  return ply_type::none;
+}
+
+inline std::size_t ply_type_size(ply_type type) {
+  switch (type) {
+    case ply_type::int8:
+    case ply_type::uint8:
+      return 1;
+    case ply_type::int16:
+    case ply_type::uint16:
+      return 2;
+    case ply_type::int32:
+    case ply_type::uint32:
+    case ply_type::float32:
+      return 4;
+    case ply_type::float64:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+/// Read a little-endian value of type TYPE from SRC.
+template <class T>
+T ply_read(ply_type type, const char *src) {
+  auto load = [src](auto value) {
+    std::memcpy(&value, src, sizeof(value));
+    return T(value);
+  };
+  switch (type) {
+    case ply_type::int8:
+      return load(std::int8_t());
+    case ply_type::uint8:
+      return load(std::uint8_t());
+    case ply_type::int16:
+      return load(std::int16_t());
+    case ply_type::uint16:
+      return load(std::uint16_t());
+    case ply_type::int32:
+      return load(std::int32_t());
+    case ply_type::uint32:
+      return load(std::uint32_t());
+    case ply_type::float32:
+      return load(float());
+    case ply_type::float64:
+      return load(double());
+    default:
+      return T();
+  }
+}
+
+struct ply_property {
+  std::string name;
+  ply_type type;
+
+  /// The type of the length of a list property, or none for a scalar.
+  ply_type count_type;
+};
+
+struct ply_element {
+  std::string name;
+  std::uint64_t count;
+  std::vector<ply_property> properties;
+
+  /// The size of each record, or 0 if the element has list properties.
+  std::size_t stride() const {
+    std::size_t result = 0;
+    for (const ply_property &p : this->properties) {
+      if (p.count_type != ply_type::none) return 0;
+      result += ply_type_size(p.type);
+    }
+    return result;
+  }
+
+  /// The offset of property NAME within each record, or -1 if there is no
+  /// such property.  Only meaningful if the element has a stride.
+  std::ptrdiff_t offset(const std::string &name) const {
+    std::size_t result = 0;
+    for (const ply_property &p : this->properties) {
+      if (p.name == name) return result;
+      result += ply_type_size(p.type);
+    }
+    return -1;
+  }
+
+  const ply_property *property(const std::string &name) const {
+    for (const ply_property &p : this->properties) {
+      if (p.name == name) return &p;
+    }
+    return nullptr;
+  }
+};
+
+struct ply_header {
+  std::vector<ply_element> elements;
+
+  /// The size of the header, through the end_header line.
+  std::size_t size;
+};
+
+/// Parse the header at the start of [src, lim).
+///
+/// On error, the second result is the line of the header at fault.
+inline std::tuple<int, std::size_t, ply_header> parse_ply_header(
+    const char *src, const char *lim) {
+  ply_header header;
+  header.size = 0;
+
+  const char *cur = src;
+  std::size_t cur_line = 0;
+  bool format_seen = false;
+  while (true) {
+    ++cur_line;
+    if (cur == lim) {
+      return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line, ply_header());
+    }
+    const char *eol =
+        static_cast<const char *>(std::memchr(cur, 0xa, lim - cur));
+    if (eol == nullptr) {
+      return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line, ply_header());
+    }
+    std::istringstream line(std::string(cur, eol));
+    cur = eol + 1;
+
+    std::string keyword;
+    line >> keyword;
+
+    if (cur_line == 1) {
+      if (keyword != "ply") {
+        return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line, ply_header());
+      }
+    } else if (keyword == "format") {
+      std::string format, version;
+      line >> format >> version;
+      if (!line) {
+        return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line, ply_header());
+      }
+      if (format != "binary_little_endian") {
+        return std::make_tuple(PLY_ERRC_FILE_NOT_LOADABLE, cur_line,
+                               ply_header());
+      }
+      format_seen = true;
+    } else if (keyword == "element") {
+      ply_element element;
+      line >> element.name >> element.count;
+      if (!line) {
+        return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line, ply_header());
+      }
+      header.elements.push_back(std::move(element));
+    } else if (keyword == "property") {
+      ply_property property;
+      std::string type;
+      line >> type;
+      if (type == "list") {
+        std::string count_type;
+        line >> count_type >> type;
+        property.count_type = ply_type_from_name(count_type);
+        if (property.count_type == ply_type::none ||
+            property.count_type == ply_type::float32 ||
+            property.count_type == ply_type::float64) {
+          return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line,
+                                 ply_header());
+        }
+      } else {
+        property.count_type = ply_type::none;
+      }
+      property.type = ply_type_from_name(type);
+      line >> property.name;
+      if (!line || property.type == ply_type::none ||
+          header.elements.empty()) {
+        return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line, ply_header());
+      }
+      header.elements.back().properties.push_back(std::move(property));
+    } else if (keyword == "end_header") {
+      break;
+    } else if (keyword != "comment" && keyword != "obj_info" &&
+               !keyword.empty()) {
+      return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line, ply_header());
+    }
+  }
+
+  if (!format_seen) {
+    return std::make_tuple(PLY_ERRC_PARSE_ERROR, cur_line, ply_header());
+  }
+
+  header.size = cur - src;
+  return std::make_tuple(PLY_ERRC_NONE, cur_line, header);
+}
+
+/// Copy the properties NAMES of each fixed-size record of ELEMENT, starting
+/// at SRC, into OUT.
+///
+/// Where the properties are consecutive floats, as they usually are, each
+/// record is copied as a block, and the whole element at once if the
+/// properties are all there is to it.
+template <std::size_t N>
+void ply_gather(const ply_element &element, const char *src,
+                const std::array<const char *, N> &names,
+                fixvec<float, N> *out) {
+  static_assert(sizeof(fixvec<float, N>) == N * sizeof(float) &&
+                    std::is_trivially_copyable<fixvec<float, N>>::value,
+                "fixvec must be laid out like an array");
+
+  std::size_t stride = element.stride();
+  std::array<std::ptrdiff_t, N> offsets;
+  std::array<ply_type, N> types;
+  bool packed = true;
+  for (std::size_t k = 0; k < N; ++k) {
+    offsets[k] = element.offset(names[k]);
+    types[k] = element.property(names[k])->type;
+    packed = packed && types[k] == ply_type::float32 &&
+             offsets[k] == offsets[0] + std::ptrdiff_t(k * sizeof(float));
+  }
+
+  if (packed && stride == sizeof(fixvec<float, N>)) {
+    std::memcpy(out, src, element.count * stride);
+  } else if (packed) {
+    for (std::size_t i = 0; i < element.count; ++i) {
+      std::memcpy(&out[i], src + i * stride + offsets[0], sizeof(out[i]));
+    }
+  } else {
+    for (std::size_t i = 0; i < element.count; ++i) {
+      for (std::size_t k = 0; k < N; ++k) {
+        out[i][k] = ply_read<float>(types[k], src + i * stride + offsets[k]);
+      }
+    }
+  }
+}
+
+/// Parse a binary little-endian PLY file held in [src, lim).
+///
+/// Positions come from the x, y, and z properties of the "vertex" element,
+/// along with normals from nx, ny, and nz, and material coordinates from u
+/// and v (or s and t), where present.  Faces come from the vertex_indices (or
+/// vertex_index) list of the "face" element.  Faces with more than three
+/// corners are split into fans.  Other elements and properties are skipped.
+///
+/// On a header error, the second result is the line of the header at fault.
+/// Otherwise it is the number of header lines.
+inline std::tuple<int, std::size_t, tri_mesh> parse_ply(const char *src,
+                                                        const char *lim,
+                                                        bool swapyz) {
+  int errc;
+  std::size_t header_lines;
+  ply_header header;
+  std::tie(errc, header_lines, header) = parse_ply_header(src, lim);
+  if (errc != PLY_ERRC_NONE) {
+    return std::make_tuple(errc, header_lines, tri_mesh());
+  }
+
+  // The data is read in place, so the host must share its byte order.
+  const std::uint32_t probe = 1;
+  std::uint8_t probe_low;
+  std::memcpy(&probe_low, &probe, 1);
+  if (probe_low != 1) {
+    return std::make_tuple(PLY_ERRC_FILE_NOT_LOADABLE, header_lines,
+                           tri_mesh());
+  }
+
+  auto fail = [&](int errc) {
+    return std::make_tuple(errc, header_lines, tri_mesh());
+  };
+
+  tri_mesh the_mesh;
+  const char *cur = src + header.size;
+  for (const ply_element &element : header.elements) {
+    std::size_t stride = element.stride();
+
+    if (element.name == "vertex") {
+      if (stride == 0) return fail(PLY_ERRC_PARSE_ERROR);
+      if (std::uint64_t(lim - cur) / stride < element.count) {
+        return fail(PLY_ERRC_PARSE_ERROR);
+      }
+
+      auto has = [&](std::initializer_list<const char *> names) {
+        for (const char *name : names) {
+          if (element.property(name) == nullptr) return false;
+        }
+        return true;
+      };
+
+      if (!has({"x", "y", "z"})) return fail(PLY_ERRC_PARSE_ERROR);
+      the_mesh.v.resize(element.count);
+      ply_gather<3>(element, cur, {"x", "y", "z"}, the_mesh.v.data());
+
+      if (has({"nx", "ny", "nz"})) {
+        the_mesh.n.resize(element.count);
+        ply_gather<3>(element, cur, {"nx", "ny", "nz"}, the_mesh.n.data());
+      }
+
+      if (has({"u", "v"})) {
+        the_mesh.m.resize(element.count);
+        ply_gather<2>(element, cur, {"u", "v"}, the_mesh.m.data());
+      } else if (has({"s", "t"})) {
+        the_mesh.m.resize(element.count);
+        ply_gather<2>(element, cur, {"s", "t"}, the_mesh.m.data());
+      }
+
+      cur += element.count * stride;
+      continue;
+    }
+
+    if (stride != 0) {
+      // Nothing here for us, and it can be skipped in one go.
+      if (std::uint64_t(lim - cur) / stride < element.count) {
+        return fail(PLY_ERRC_PARSE_ERROR);
+      }
+      cur += element.count * stride;
+      continue;
+    }
+
+    bool faces = element.name == "face";
+    const ply_property *indices = element.property("vertex_indices");
+    if (indices == nullptr) indices = element.property("vertex_index");
+    if (faces &&
+        (indices == nullptr || indices->count_type == ply_type::none ||
+         indices->type == ply_type::float32 ||
+         indices->type == ply_type::float64)) {
+      return fail(PLY_ERRC_PARSE_ERROR);
+    }
+
+    // Faces written as a bare list of 32-bit indices, which are nearly always
+    // triangles, can be copied as they are.
+    bool packed = faces && element.properties.size() == 1 &&
+                  ply_type_size(indices->type) == sizeof(std::uint32_t);
+    std::size_t count_size = faces ? ply_type_size(indices->count_type) : 0;
+    if (faces) the_mesh.fv.reserve(element.count);
+
+    for (std::uint64_t i = 0; i < element.count; ++i) {
+      if (packed &&
+          std::size_t(lim - cur) >= count_size + sizeof(tri_face_idx) &&
+          ply_read<std::uint64_t>(indices->count_type, cur) == 3) {
+        tri_face_idx face;
+        std::memcpy(&face, cur + count_size, sizeof(face));
+        the_mesh.fv.push_back(face);
+        cur += count_size + sizeof(face);
+        continue;
+      }
+
+      for (const ply_property &p : element.properties) {
+        std::size_t value_size = ply_type_size(p.type);
+        if (p.count_type == ply_type::none) {
+          if (std::size_t(lim - cur) < value_size) {
+            return fail(PLY_ERRC_PARSE_ERROR);
+          }
+          cur += value_size;
+          continue;
+        }
+
+        std::size_t list_count_size = ply_type_size(p.count_type);
+        if (std::size_t(lim - cur) < list_count_size) {
+          return fail(PLY_ERRC_PARSE_ERROR);
+        }
+        std::int64_t count = ply_read<std::int64_t>(p.count_type, cur);
+        cur += list_count_size;
+        if (count < 0 || std::uint64_t(lim - cur) / value_size <
+                             std::uint64_t(count)) {
+          return fail(PLY_ERRC_PARSE_ERROR);
+        }
+
+        if (faces && &p == indices) {
+          if (count < 3) return fail(PLY_ERRC_INSANE);
+          auto corner = [&](std::int64_t k) {
+            return ply_read<std::uint32_t>(p.type, cur + k * value_size);
+          };
+          for (std::int64_t k = 2; k < count; ++k) {
+            the_mesh.fv.push_back({corner(0), corner(k - 1), corner(k)});
+          }
+        }
+        cur += count * value_size;
+      }
+    }
+  }
+
+  if (swapyz) {
+    using std::swap;
+    for (auto *attribute : {&the_mesh.v, &the_mesh.n}) {
+      for (fixvec<float, 3> &p : *attribute) swap(p[1], p[2]);
+    }
+    for (tri_face_idx &face : the_mesh.fv) swap(face[1], face[2]);
+  }
+
+  // Normals and material coordinates belong to the vertices, so they share
+  // the position indices.
+  if (!the_mesh.n.empty()) the_mesh.fn = the_mesh.fv;
+  if (!the_mesh.m.empty()) the_mesh.fm = the_mesh.fv;
+
+  if (!tri_mesh_sanity_check(the_mesh)) return fail(PLY_ERRC_INSANE);
+
+  return std::make_tuple(PLY_ERRC_NONE, header_lines, std::move(the_mesh));
+}
+
+/// Load the binary little-endian PLY file at FILENAME, which is mapped into
+/// memory rather than read.
+inline std::tuple<int, std::size_t, tri_mesh> tri_mesh_load_ply(
+    const std::string &filename, bool swapyz) {
+  std::unique_ptr<mapped_file> file = map_file(filename);
+  if (file == nullptr) {
+    return std::make_tuple(PLY_ERRC_FILE_NOT_OPENABLE, std::size_t(0),
+                           tri_mesh());
+  }
+
+  return parse_ply(file->data, file->data + file->size, swapyz);
+}
+
+}  // namespace ballistae
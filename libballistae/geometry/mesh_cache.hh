@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <iterator>
+#include <string>
+#include <type_traits>
+
+#include "libballistae/geometry/tri_mesh.hh"
+#include "libballistae/kd_tree.hh"
+#include "libballistae/mapped_file.hh"
+#include "third_party/zlib/zlib.h"
+
+namespace ballistae {
+
+/// A mesh cache holds the parts of a crunched mesh that rendering reads (see
+/// tri_mesh_view), so that a mesh can be mapped into memory and used in
+/// place, without parsing the source file or building its tree.
+///
+/// The file is a mesh_cache_header followed by one section for each array.
+/// Sections hold the arrays exactly as they are laid out in memory, each
+/// starting at a multiple of mesh_cache_alignment bytes into the file.  Since
+/// that layout depends on the machine and the build, the header records
+/// enough of it to turn away files written with a different one.
+
+constexpr char mesh_cache_magic[8] = {'B', 'L', 'S', 'T', 'M', 'E', 'S', 'H'};
+
+/// Bumped whenever the layout of the file or of any stored type changes.
+constexpr std::uint32_t mesh_cache_version = 1;
+
+constexpr std::uint32_t mesh_cache_byte_order = 0x01020304;
+
+constexpr std::uint64_t mesh_cache_alignment = 64;
+
+struct mesh_cache_section {
+  /// Bytes from the start of the file.
+  std::uint64_t offset;
+
+  /// The number of elements.
+  std::uint64_t count;
+};
+
+struct mesh_cache_header {
+  std::array<char, 8> magic;
+  std::uint32_t version;
+
+  /// mesh_cache_byte_order, as written.
+  std::uint32_t byte_order;
+
+  /// The sizes of the stored types.
+  std::uint32_t vertex_size;
+  std::uint32_t face_size;
+  std::uint32_t wide_node_size;
+  std::uint32_t block_size;
+
+  std::uint64_t file_size;
+
+  /// The CRC-32 of everything after the header.
+  std::uint32_t payload_crc;
+
+  /// The CRC-32 of the header, with this field zero.
+  std::uint32_t header_crc;
+
+  /// The bounds of the mesh, axis by axis, low then high.
+  std::array<double, 6> bounds;
+
+  mesh_cache_section vertices;
+  mesh_cache_section faces;
+  mesh_cache_section wide_nodes;
+  mesh_cache_section blocks;
+  mesh_cache_section leaf_blocks;
+};
+
+/// The CRC-32 of [DATA, DATA + SIZE), continuing from CRC.
+inline std::uint32_t mesh_cache_crc(std::uint32_t crc, const void *data,
+                                    std::size_t size) {
+  // zlib takes 32-bit lengths.
+  const Bytef *cur = static_cast<const Bytef *>(data);
+  while (size != 0) {
+    uInt chunk = uInt(std::min<std::size_t>(size, std::size_t(1) << 30));
+    crc = std::uint32_t(crc32(crc, cur, chunk));
+    cur += chunk;
+    size -= chunk;
+  }
+  return crc;
+}
+
+inline std::uint32_t mesh_cache_header_crc(mesh_cache_header header) {
+  header.header_crc = 0;
+  return mesh_cache_crc(0, &header, sizeof(header));
+}
+
+/// A mesh cache, mapped into memory.
+struct mesh_cache {
+  /// Keeps the arrays of VIEW alive.
+  std::shared_ptr<const mapped_file> file;
+
+  tri_mesh_view view;
+};
+
+/// Write MESH to a new mesh cache at FILENAME.
+///
+/// Throws std::runtime_error if the file can't be written.
+inline void write_mesh_cache(const std::string &filename,
+                             const tri_mesh_view &mesh) {
+  auto align = [](std::uint64_t offset) {
+    return (offset + mesh_cache_alignment - 1) / mesh_cache_alignment *
+           mesh_cache_alignment;
+  };
+
+  mesh_cache_header header;
+  std::memset(&header, 0, sizeof(header));
+  std::copy(std::begin(mesh_cache_magic), std::end(mesh_cache_magic),
+            header.magic.begin());
+  header.version = mesh_cache_version;
+  header.byte_order = mesh_cache_byte_order;
+  header.vertex_size = sizeof(mesh.v.data[0]);
+  header.face_size = sizeof(mesh.fv.data[0]);
+  header.wide_node_size = sizeof(mesh.wide_nodes.data[0]);
+  header.block_size = sizeof(mesh.blocks.data[0]);
+  for (size_t axis = 0; axis < 3; ++axis) {
+    header.bounds[2 * axis] = mesh.bounds.spans[axis].lo;
+    header.bounds[2 * axis + 1] = mesh.bounds.spans[axis].hi;
+  }
+
+  // Lay out the sections one after another.
+  std::uint64_t offset = align(sizeof(header));
+  auto place = [&](const auto &array, mesh_cache_section *section) {
+    section->offset = offset;
+    section->count = array.size;
+    offset = align(offset + array.size * sizeof(array.data[0]));
+  };
+  place(mesh.v, &header.vertices);
+  place(mesh.fv, &header.faces);
+  place(mesh.wide_nodes, &header.wide_nodes);
+  place(mesh.blocks, &header.blocks);
+  place(mesh.leaf_blocks, &header.leaf_blocks);
+  header.file_size = offset;
+
+  std::ofstream out(filename, std::ofstream::binary | std::ofstream::trunc);
+  if (!out) {
+    throw std::runtime_error("could not create mesh cache: " + filename);
+  }
+
+  // The header is written again once the payload's CRC is known.
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  static const std::array<char, mesh_cache_alignment> zeros = {};
+  std::uint32_t crc = 0;
+  std::uint64_t written = sizeof(header);
+  auto emit = [&](const void *data, std::uint64_t size) {
+    crc = mesh_cache_crc(crc, data, size);
+    out.write(static_cast<const char *>(data), std::streamsize(size));
+    written += size;
+  };
+  auto emit_section = [&](const auto &array,
+                          const mesh_cache_section &section) {
+    emit(zeros.data(), section.offset - written);
+    emit(array.data, array.size * sizeof(array.data[0]));
+  };
+  emit_section(mesh.v, header.vertices);
+  emit_section(mesh.fv, header.faces);
+  emit_section(mesh.wide_nodes, header.wide_nodes);
+  emit_section(mesh.blocks, header.blocks);
+  emit_section(mesh.leaf_blocks, header.leaf_blocks);
+  emit(zeros.data(), header.file_size - written);
+
+  header.payload_crc = crc;
+  header.header_crc = mesh_cache_header_crc(header);
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  out.close();
+  if (!out) {
+    throw std::runtime_error("could not write mesh cache: " + filename);
+  }
+}
+
+/// Whether every index stored in VIEW points into the array it indexes,
+/// every interior link of the wide tree points forward, so that traversal
+/// ends, and every block lane without a face has NaN vertices, so that it is
+/// never hit.
+///
+/// This reads every array but the vertices, linearly.
+inline bool mesh_cache_links_valid(const tri_mesh_view &view) {
+  for (std::size_t i = 0; i < view.wide_nodes.size; ++i) {
+    const kd_wide_node &node = view.wide_nodes[i];
+    for (std::size_t slot = 0; slot < kd_wide_node_width; ++slot) {
+      std::uint64_t link = node.link[slot];
+      std::uint64_t count = node.count[slot];
+      if (count == kd_node::interior) {
+        if (link <= i || link >= view.wide_nodes.size) return false;
+        continue;
+      }
+      if (count == 0) continue;
+
+      // The leaf's first block, and enough blocks after it for its faces.
+      if (link + count > view.leaf_blocks.size) return false;
+      std::uint64_t blocks = (count + tri_block_width - 1) / tri_block_width;
+      if (view.leaf_blocks[link] + blocks > view.blocks.size) return false;
+    }
+  }
+
+  for (std::size_t i = 0; i < view.blocks.size; ++i) {
+    const tri_block &block = view.blocks[i];
+    for (std::size_t lane = 0; lane < tri_block_width; ++lane) {
+      std::uint32_t face = block.face[lane];
+      if (face != UINT32_MAX) {
+        if (face >= view.fv.size) return false;
+        continue;
+      }
+
+      // An unused lane is only never hit if all of its vertices are NaN.
+      for (std::size_t axis = 0; axis < 3; ++axis) {
+        if (!std::isnan(block.v0[axis][lane]) ||
+            !std::isnan(block.v1[axis][lane]) ||
+            !std::isnan(block.v2[axis][lane])) {
+          return false;
+        }
+      }
+    }
+  }
+
+  for (std::size_t i = 0; i < view.fv.size; ++i) {
+    for (std::uint32_t vertex : view.fv[i]) {
+      if (vertex >= view.v.size) return false;
+    }
+  }
+
+  return true;
+}
+
+/// Map the mesh cache at FILENAME into memory.
+///
+/// The header is always checked, and so is every stored index (see
+/// mesh_cache_links_valid), so that a damaged file can't send rendering
+/// outside the mapping.  The payload's CRC is only checked if VERIFY_PAYLOAD
+/// is set, since that also reads the vertices.
+///
+/// Throws std::runtime_error if the file can't be mapped, or isn't a mesh
+/// cache that this build can use.
+inline mesh_cache read_mesh_cache(const std::string &filename,
+                                  bool verify_payload) {
+  std::shared_ptr<const mapped_file> file = map_file(filename);
+  if (file == nullptr) {
+    throw std::runtime_error("could not map mesh cache: " + filename);
+  }
+
+  mesh_cache_header header;
+  if (file->size < sizeof(header)) {
+    throw std::runtime_error("mesh cache is truncated: " + filename);
+  }
+  std::memcpy(&header, file->data, sizeof(header));
+
+  if (!std::equal(header.magic.begin(), header.magic.end(),
+                  std::begin(mesh_cache_magic))) {
+    throw std::runtime_error("not a mesh cache: " + filename);
+  }
+  if (header.header_crc != mesh_cache_header_crc(header)) {
+    throw std::runtime_error("mesh cache header is corrupt: " + filename);
+  }
+  if (header.version != mesh_cache_version ||
+      header.byte_order != mesh_cache_byte_order ||
+      header.vertex_size != sizeof(fixvec<float, 3>) ||
+      header.face_size != sizeof(tri_face_idx) ||
+      header.wide_node_size != sizeof(kd_wide_node) ||
+      header.block_size != sizeof(tri_block)) {
+    throw std::runtime_error(
+        "mesh cache was written by an incompatible version: " + filename);
+  }
+  if (header.file_size != file->size) {
+    throw std::runtime_error("mesh cache is truncated: " + filename);
+  }
+
+  if (verify_payload &&
+      header.payload_crc != mesh_cache_crc(0, file->data + sizeof(header),
+                                           file->size - sizeof(header))) {
+    throw std::runtime_error("mesh cache is corrupt: " + filename);
+  }
+
+  auto section = [&](const mesh_cache_section &s, auto *array) {
+    using T = std::remove_reference_t<decltype(array->data[0])>;
+    if (s.offset % mesh_cache_alignment != 0 || s.offset > file->size ||
+        s.count > (file->size - s.offset) / sizeof(T)) {
+      throw std::runtime_error("mesh cache is corrupt: " + filename);
+    }
+    array->data = reinterpret_cast<const T *>(file->data + s.offset);
+    array->size = s.count;
+  };
+
+  mesh_cache result;
+  section(header.vertices, &result.view.v);
+  section(header.faces, &result.view.fv);
+  section(header.wide_nodes, &result.view.wide_nodes);
+  section(header.blocks, &result.view.blocks);
+  section(header.leaf_blocks, &result.view.leaf_blocks);
+  if (!mesh_cache_links_valid(result.view)) {
+    throw std::runtime_error("mesh cache is corrupt: " + filename);
+  }
+  for (size_t axis = 0; axis < 3; ++axis) {
+    result.view.bounds.spans[axis] = {header.bounds[2 * axis],
+                                      header.bounds[2 * axis + 1]};
+  }
+  result.file = std::move(file);
+  return result;
+}
+
+}  // namespace ballistae
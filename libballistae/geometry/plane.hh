@@ -72,6 +72,31 @@ class plane : public geometry {
       return contact::nan();
     }
   }
+
+  virtual contact ray_nearest(const ray_segment &query,
+                              int *contact_type) const {
+    auto height = query.the_ray.point(0);
+    auto slope = query.the_ray.slope(0);
+    auto t = -height / slope;
+
+    if (slope != double(0) && contains(query.the_segment, t)) {
+      *contact_type = slope < double(0) ? CONTACT_INTO : CONTACT_EXIT;
+
+      contact result;
+
+      result.t = t;
+      result.r = query.the_ray;
+      result.p = eval_ray(query.the_ray, t);
+      result.n = {1, 0, 0};
+      result.mtl2 = {result.p(1), result.p(2)};
+      result.mtl3 = result.p;
+
+      return result;
+    } else {
+      // Ray never intersects plane.
+      return contact::nan();
+    }
+  }
 };
 
 }  // namespace ballistae
@@ -8,6 +8,7 @@
 #include "libballistae/ray.hh"
 #include "libballistae/span.hh"
 #include "libballistae/vector.hh"
+#include "libballistae/vector_distributions.hh"
 
 namespace ballistae {
 
@@ -27,6 +28,22 @@ class sphere : public geometry {
     // Nothing to do.
   }
 
+  virtual double surface_area() const { return 4.0 * M_PI; }
+
+  virtual contact sample_surface(sample_rng &rng) const {
+    using std::acos;
+    using std::atan2;
+
+    uniform_unitv_distribution<double, 3> point_dist;
+
+    contact result;
+    result.p = point_dist(rng);
+    result.n = result.p;
+    result.mtl2 = {atan2(result.p(0), result.p(1)), acos(result.p(2))};
+    result.mtl3 = result.p;
+    return result;
+  }
+
   virtual contact ray_into(const ray_segment &query) const {
     using std::acos;
     using std::atan2;
@@ -81,6 +98,44 @@ class sphere : public geometry {
       return contact::nan();
     }
   }
+
+  virtual contact ray_nearest(const ray_segment &query,
+                              int *contact_type) const {
+    using std::acos;
+    using std::asin;
+    using std::atan2;
+    using std::sqrt;
+
+    auto b = iprod(query.the_ray.slope, query.the_ray.point);
+    auto c = iprod(query.the_ray.point, query.the_ray.point) - 1.0;
+
+    // We rely on std::sqrt's mandated NaN behavior.
+    auto root = sqrt(b * b - c);
+    auto t_min = -b - root;
+    auto t_max = -b + root;
+
+    contact result;
+    if (contains(query.the_segment, t_min)) {
+      auto p = eval_ray(query.the_ray, t_min);
+      *contact_type = CONTACT_INTO;
+      result.t = t_min;
+      result.p = p;
+      result.mtl2 = {atan2(p(0), p(1)), acos(p(2))};
+    } else if (contains(query.the_segment, t_max)) {
+      auto p = eval_ray(query.the_ray, t_max);
+      *contact_type = CONTACT_EXIT;
+      result.t = t_max;
+      result.p = p;
+      result.mtl2 = {atan2(p(0), p(1)), asin(p(2))};
+    } else {
+      return contact::nan();
+    }
+
+    result.n = normalise(result.p);
+    result.mtl3 = result.p;
+    result.r = query.the_ray;
+    return result;
+  }
 };
 
 }  // namespace ballistae
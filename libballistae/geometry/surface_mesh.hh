@@ -1,8 +1,11 @@
 #ifndef BALLISTAE_GEOMETRY_SURFACE_MESH_HH
 #define BALLISTAE_GEOMETRY_SURFACE_MESH_HH
 
+#include "libballistae/alias_table.hh"
 #include "libballistae/geometry.hh"
 #include "libballistae/geometry/load_obj.hh"
+#include "libballistae/geometry/load_ply.hh"
+#include "libballistae/geometry/mesh_cache.hh"
 #include "libballistae/geometry/tri_mesh.hh"
 #include "libballistae/kd_tree.hh"
 
@@ -10,32 +13,111 @@ namespace ballistae {
 
 class surface_mesh : public ballistae::geometry {
   tri_mesh mesh;
-  kd_tree<tri_face_crunched> mesh_crushed;
+  tri_mesh_crunched mesh_crushed;
+
+  /// Set if the mesh was mapped from a cache, in which case mesh and
+  /// mesh_crushed are empty.
+  mesh_cache cache;
+
+  /// The sum of the areas of the faces.
+  double total_area = 0;
+
+  /// Picks faces of mesh in proportion to their areas.  Only built by
+  /// prepare_sampling(), since it takes as much memory as the faces.
+  alias_table face_picker;
   double last_crush_time = std::numeric_limits<double>::quiet_NaN();
+  double last_sampling_time = std::numeric_limits<double>::quiet_NaN();
 
  public:
   surface_mesh(const tri_mesh &mesh_in) : mesh(mesh_in) {}
 
+  surface_mesh(mesh_cache cache_in) : cache(std::move(cache_in)) {}
+
   surface_mesh(const surface_mesh &other) = default;
   surface_mesh(surface_mesh &&other) = default;
 
   virtual ~surface_mesh() {}
 
-  virtual aabox get_aabox() { return mesh_crushed.root->bounds; }
+  /// The arrays that rendering reads, wherever they live.
+  tri_mesh_view view() const {
+    return cache.file ? cache.view : make_tri_mesh_view(mesh, mesh_crushed);
+  }
+
+  virtual aabox get_aabox() { return view().bounds; }
 
   virtual void crush(double time) {
     if (time != last_crush_time) {
-      mesh_crushed = crunch(mesh);
+      if (!cache.file) {
+        mesh_crushed = crunch(mesh);
+      }
+
+      tri_mesh_view faces = view();
+      total_area = 0;
+      for (size_t i = 0; i < faces.fv.size; ++i) {
+        total_area += face_area(load_face_v(faces, i));
+      }
     }
     last_crush_time = time;
   }
 
+  virtual void prepare_sampling(double time) {
+    if (time != last_sampling_time) {
+      tri_mesh_view faces = view();
+      std::vector<double> face_areas(faces.fv.size);
+      for (size_t i = 0; i < faces.fv.size; ++i) {
+        face_areas[i] = face_area(load_face_v(faces, i));
+      }
+      face_picker = make_alias_table(face_areas);
+    }
+    last_sampling_time = time;
+  }
+
   virtual contact ray_into(const ray_segment &query) const {
-    return tri_mesh_contact(query, mesh_crushed, CONTACT_INTO);
+    return tri_mesh_contact(query, view(), CONTACT_INTO);
   }
 
   virtual contact ray_exit(const ray_segment &query) const {
-    return tri_mesh_contact(query, mesh_crushed, CONTACT_EXIT);
+    return tri_mesh_contact(query, view(), CONTACT_EXIT);
+  }
+
+  virtual contact ray_nearest(const ray_segment &query,
+                              int *contact_type) const {
+    return tri_mesh_contact(query, view(), CONTACT_INTO | CONTACT_EXIT,
+                            contact_type);
+  }
+
+  virtual bool ray_occluded(const ray_segment &query) const {
+    return tri_mesh_occluded(query, view());
+  }
+
+  virtual double surface_area() const { return total_area; }
+
+  /// The memory held by the mesh, once crushed.
+  ///
+  /// For a mesh mapped from a cache, the sizes of the mapped sections, whose
+  /// pages belong to the page cache rather than to the process.
+  tri_mesh_footprint footprint() const {
+    return cache.file ? get_footprint(cache.view)
+                      : get_footprint(mesh, mesh_crushed);
+  }
+
+  virtual contact sample_surface(sample_rng &rng) const {
+    using std::sqrt;
+
+    tri_face_verts face = load_face_v(view(), face_picker(uniform_1d(rng)));
+
+    // Uniform over the triangle.
+    std::array<double, 2> u = uniform_2d(rng);
+    double root = sqrt(u[0]);
+    double along = u[1];
+
+    contact result;
+    result.p = face.v0 + (root * (1.0 - along)) * (face.v1 - face.v0) +
+               (root * along) * (face.v2 - face.v0);
+    result.n = get_face_normal(face);
+    result.mtl2 = {0, 0};
+    result.mtl3 = result.p;
+    return result;
   }
 };
 
@@ -50,9 +132,8 @@ surface_mesh surface_mesh_from_obj_file(std::string filename, bool swapyz) {
   } else if (errc == OBJ_ERRC_FILE_NOT_LOADABLE) {
     throw std::runtime_error("could not load file: " + filename);
   } else if (errc == OBJ_ERRC_PARSE_ERROR) {
-    // TODO(ahmedtd): Do this with absl instead
-    throw std::runtime_error("error at line %d while parsing file: " +
-                             filename);
+    throw std::runtime_error("error at line " + std::to_string(err_line) +
+                             " while parsing file: " + filename);
   } else if (errc == OBJ_ERRC_INSANE) {
     throw std::runtime_error("obj file is not self consistent: " + filename);
   } else if (errc != OBJ_ERRC_NONE) {
@@ -62,6 +143,39 @@ surface_mesh surface_mesh_from_obj_file(std::string filename, bool swapyz) {
   return (surface_mesh(std::move(the_mesh)));
 }
 
+surface_mesh surface_mesh_from_ply_file(std::string filename, bool swapyz) {
+  int errc;
+  size_t err_line;
+  tri_mesh the_mesh;
+  std::tie(errc, err_line, the_mesh) = tri_mesh_load_ply(filename, swapyz);
+
+  if (errc == PLY_ERRC_FILE_NOT_OPENABLE) {
+    throw std::runtime_error("could not read file: " + filename);
+  } else if (errc == PLY_ERRC_FILE_NOT_LOADABLE) {
+    throw std::runtime_error("ply file is not binary little-endian: " +
+                             filename);
+  } else if (errc == PLY_ERRC_PARSE_ERROR) {
+    throw std::runtime_error("error at header line " +
+                             std::to_string(err_line) +
+                             " or in the data of ply file: " + filename);
+  } else if (errc == PLY_ERRC_INSANE) {
+    throw std::runtime_error("ply file is not self consistent: " + filename);
+  } else if (errc != PLY_ERRC_NONE) {
+    throw std::runtime_error("unknown error parsing file: " + filename);
+  }
+
+  return (surface_mesh(std::move(the_mesh)));
+}
+
+/// Load a mesh from a cache written by write_mesh_cache.
+///
+/// The cache is mapped, not read, so the mesh is ready as soon as the header
+/// has been checked.  Set VERIFY to check the whole file against its CRC.
+surface_mesh surface_mesh_from_cache(const std::string &filename,
+                                     bool verify = false) {
+  return surface_mesh(read_mesh_cache(filename, verify));
+}
+
 }  // namespace ballistae
 
 #endif
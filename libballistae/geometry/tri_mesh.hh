@@ -1,14 +1,25 @@
 #ifndef BALLISTAE_GEOMETRY_TRI_MESH_HH
 #define BALLISTAE_GEOMETRY_TRI_MESH_HH
 
+#include <algorithm>
 #include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <utility>
 #include <vector>
 
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 #include "libballistae/aabox.hh"
 #include "libballistae/contact.hh"
 #include "libballistae/kd_tree.hh"
 #include "libballistae/ray.hh"
 #include "libballistae/span.hh"
+#include "libballistae/thread_pool.hh"
 #include "libballistae/vector.hh"
 
 namespace ballistae {
@@ -19,116 +30,242 @@ struct tri_face_verts {
   ballistae::fixvec<double, 3> v2;
 };
 
-struct tri_face_normals {
-  ballistae::fixvec<double, 3> v0;
-  ballistae::fixvec<double, 3> v1;
-  ballistae::fixvec<double, 3> v2;
-};
+/// Indices of the three corners of a face, into one of a mesh's attribute
+/// arrays.
+using tri_face_idx = std::array<std::uint32_t, 3>;
 
-struct tri_face_texcoords {
-  ballistae::fixvec<double, 2> v0;
-  ballistae::fixvec<double, 2> v1;
-  ballistae::fixvec<double, 2> v2;
-};
+/// A triangle mesh, stored compactly.
+///
+/// Attributes are float, and faces index them with 32-bit indices.  Each
+/// attribute other than position is either present for every face, in which
+/// case its index array has one entry per face, or absent, in which case its
+/// index array is empty.
+struct tri_mesh {
+  std::vector<ballistae::fixvec<float, 3>> v;
+  std::vector<ballistae::fixvec<float, 3>> n;
+  std::vector<ballistae::fixvec<float, 2>> m;
 
-/// 3-element indexer.  Used to define face vertices, normals, and material
-/// coordinates.
-struct tri_face_idx {
-  std::array<size_t, 3> vi;
-  std::array<size_t, 3> mi;
-  std::array<size_t, 3> ni;
-};
+  /// The vertex positions of each face, into V.
+  std::vector<tri_face_idx> fv;
 
-struct tri_mesh {
-  std::vector<ballistae::fixvec<double, 3>> v;
-  std::vector<ballistae::fixvec<double, 3>> n;
-  std::vector<ballistae::fixvec<double, 2>> m;
+  /// The vertex normals of each face, into N.  Empty if absent.
+  std::vector<tri_face_idx> fn;
 
-  std::vector<tri_face_idx> f;
+  /// The material coordinates of each face, into M.  Empty if absent.
+  std::vector<tri_face_idx> fm;
 };
 
-tri_face_verts load_face_v(const tri_mesh &mesh, const tri_face_idx &idx) {
-  return {mesh.v[idx.vi[0]], mesh.v[idx.vi[1]], mesh.v[idx.vi[2]]};
+inline ballistae::aabox get_face_aabox(const tri_mesh &mesh,
+                                       std::size_t face) {
+  using std::max;
+  using std::min;
+
+  const tri_face_idx &idx = mesh.fv[face];
+  aabox result;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    float a = mesh.v[idx[0]](axis);
+    float b = mesh.v[idx[1]](axis);
+    float c = mesh.v[idx[2]](axis);
+    result.spans[axis] = {min({a, b, c}), max({a, b, c})};
+  }
+  return result;
 }
 
-tri_face_normals load_face_n(const tri_mesh &mesh, const tri_face_idx &idx) {
-  return {mesh.n[idx.ni[0]], mesh.n[idx.ni[1]], mesh.n[idx.ni[2]]};
+/// The unit normal of the face, following its winding.
+inline fixvec<double, 3> get_face_normal(const tri_face_verts &v) {
+  return normalise(cprod(v.v1 - v.v0, v.v2 - v.v0));
 }
 
-tri_face_texcoords load_face_m(const tri_mesh &mesh, const tri_face_idx &idx) {
-  return {mesh.m[idx.mi[0]], mesh.m[idx.mi[1]], mesh.m[idx.mi[2]]};
+inline double face_area(const tri_face_verts &v) {
+  return norm(cprod(v.v1 - v.v0, v.v2 - v.v0)) / 2.0;
 }
 
-struct tri_face_crunched {
-  ballistae::fixvec<double, 3> v0;
-  ballistae::fixvec<double, 3> u;
-  ballistae::fixvec<double, 3> v;
-  ballistae::fixvec<double, 3> n;
-
-  double uu;
-  double vv;
-  double uv;
-  double recip_denom;
+/// The number of triangles in a tri_block.
+constexpr size_t tri_block_width = 4;
+
+/// Up to four triangles from one leaf of a mesh's kd_tree, in float.
+///
+/// Coordinates are stored axis by axis, so that the same coordinate of every
+/// triangle can be loaded into one SIMD register.  Unused lanes hold NaN
+/// vertices, which are never hit.
+struct alignas(16) tri_block {
+  std::array<std::array<float, tri_block_width>, 3> v0;
+  std::array<std::array<float, tri_block_width>, 3> v1;
+  std::array<std::array<float, tri_block_width>, 3> v2;
+
+  /// The index of each lane's face in the mesh.
+  std::array<std::uint32_t, tri_block_width> face;
 };
 
-ballistae::aabox get_aabox(const tri_face_crunched &f) {
-  using std::minmax_element;
+/// The acceleration structures for a tri_mesh.
+///
+/// Only face indices and the float blocks are kept.  Everything else needed
+/// at intersection time is worked out from the mesh when it is needed.
+struct tri_mesh_crunched {
+  /// The indices of the mesh's faces, arranged by the tree.
+  kd_tree<std::uint32_t> tree;
+
+  /// The faces of each leaf of TREE, packed into blocks.
+  std::vector<tri_block> blocks;
+
+  /// The first block of each leaf, indexed by the leaf's first element.
+  /// Only the entries for the first elements of non-empty leaves are
+  /// meaningful.
+  std::vector<std::uint32_t> leaf_blocks;
+};
 
-  fixvec<double, 3> v0 = f.v0;
-  fixvec<double, 3> v1 = f.v0 + f.u;
-  fixvec<double, 3> v2 = f.v0 + f.v;
+tri_mesh_crunched crunch(const tri_mesh &m) {
+  using std::move;
 
-  std::array<double, 3> x = {v0(0), v1(0), v2(0)};
-  std::array<double, 3> y = {v0(1), v1(1), v2(1)};
-  std::array<double, 3> z = {v0(2), v1(2), v2(2)};
+  auto face_aabox = [&](std::uint32_t face) {
+    return get_face_aabox(m, face);
+  };
 
-  aabox result = {from_ptr_pair(minmax_element(x.begin(), x.end())),
-                  from_ptr_pair(minmax_element(y.begin(), y.end())),
-                  from_ptr_pair(minmax_element(z.begin(), z.end()))};
+  std::vector<std::uint32_t> faces(m.fv.size());
+  std::iota(faces.begin(), faces.end(), std::uint32_t(0));
+
+  tri_mesh_crunched result;
+  result.tree = kd_tree<std::uint32_t>(move(faces), face_aabox);
+
+  kd_tree_refine_sah(result.tree, face_aabox);
+
+  // Pack each leaf's faces into blocks, leaving the last block of a leaf
+  // partly empty if need be.
+  result.leaf_blocks.resize(result.tree.finite_elements.size());
+  for (const kd_node &node : result.tree.nodes) {
+    if (!node.is_leaf() || node.count == 0) continue;
+
+    result.leaf_blocks[node.link] = std::uint32_t(result.blocks.size());
+    for (size_t src = 0; src < node.count; src += tri_block_width) {
+      tri_block block;
+      for (size_t axis = 0; axis < 3; ++axis) {
+        block.v0[axis].fill(std::numeric_limits<float>::quiet_NaN());
+        block.v1[axis].fill(std::numeric_limits<float>::quiet_NaN());
+        block.v2[axis].fill(std::numeric_limits<float>::quiet_NaN());
+      }
+      block.face.fill(UINT32_MAX);
+
+      for (size_t lane = 0; lane < tri_block_width && src + lane < node.count;
+           ++lane) {
+        std::uint32_t face =
+            result.tree.finite_elements[node.link + src + lane];
+        const tri_face_idx &idx = m.fv[face];
+        for (size_t axis = 0; axis < 3; ++axis) {
+          block.v0[axis][lane] = m.v[idx[0]](axis);
+          block.v1[axis][lane] = m.v[idx[1]](axis);
+          block.v2[axis][lane] = m.v[idx[2]](axis);
+        }
+        block.face[lane] = face;
+      }
+      result.blocks.push_back(block);
+    }
+  }
 
   return result;
 }
 
-ballistae::kd_tree<tri_face_crunched> crunch(const tri_mesh &m) {
-  using std::log;
-  using std::move;
+/// A read-only run of COUNT values of T, wherever they are stored.
+template <class T>
+struct array_ref {
+  const T *data = nullptr;
+  std::size_t size = 0;
 
-  std::vector<tri_face_crunched> facets(m.f.size());
+  const T &operator[](std::size_t i) const { return this->data[i]; }
+};
+
+template <class T>
+array_ref<T> make_array_ref(const std::vector<T> &v) {
+  return {v.data(), v.size()};
+}
 
-  for (size_t i = 0; i < m.f.size(); ++i) {
-    using std::max;
-    using std::min;
+/// The parts of a crunched mesh that are read while rendering.
+///
+/// The arrays may belong to a tri_mesh and tri_mesh_crunched, or lie in a
+/// mapped mesh cache.
+struct tri_mesh_view {
+  array_ref<fixvec<float, 3>> v;
+  array_ref<tri_face_idx> fv;
 
-    tri_face_verts v = load_face_v(m, m.f[i]);
-    tri_face_crunched cf;
+  /// The wide kd_tree over the faces.  Leaves index LEAF_BLOCKS.
+  array_ref<kd_wide_node> wide_nodes;
+  array_ref<tri_block> blocks;
+  array_ref<std::uint32_t> leaf_blocks;
 
-    cf.v0 = v.v0;
+  aabox bounds;
+};
 
-    cf.u = v.v1 - v.v0;
-    cf.v = v.v2 - v.v0;
+inline tri_mesh_view make_tri_mesh_view(const tri_mesh &mesh,
+                                        const tri_mesh_crunched &crunched) {
+  tri_mesh_view result;
+  result.v = make_array_ref(mesh.v);
+  result.fv = make_array_ref(mesh.fv);
+  result.wide_nodes = make_array_ref(crunched.tree.wide_nodes);
+  result.blocks = make_array_ref(crunched.blocks);
+  result.leaf_blocks = make_array_ref(crunched.leaf_blocks);
+  result.bounds = crunched.tree.bounds;
+  return result;
+}
 
-    cf.n = normalise(cprod(cf.u, cf.v));
+inline tri_face_verts load_face_v(const tri_mesh_view &mesh,
+                                  std::size_t face) {
+  const tri_face_idx &idx = mesh.fv[face];
+  auto load = [&](std::uint32_t i) -> fixvec<double, 3> {
+    return {mesh.v[i](0), mesh.v[i](1), mesh.v[i](2)};
+  };
+  return {load(idx[0]), load(idx[1]), load(idx[2])};
+}
 
-    cf.uu = iprod(cf.u, cf.u);
-    cf.uv = iprod(cf.u, cf.v);
-    cf.vv = iprod(cf.v, cf.v);
+/// The memory held by a mesh and its acceleration structures, in bytes.
+struct tri_mesh_footprint {
+  /// Positions, normals, and material coordinates.
+  std::size_t attributes;
 
-    cf.recip_denom = 1.0 / (cf.uu * cf.vv - cf.uv * cf.uv);
+  /// Per-face indices into the attributes.
+  std::size_t indices;
 
-    facets[i] = cf;
-  }
+  /// The kd_tree's nodes and face order.
+  std::size_t tree;
 
-  kd_tree<tri_face_crunched> result(move(facets), get_aabox);
+  /// The float blocks tested at leaves.
+  std::size_t blocks;
 
-  kd_tree_refine_sah(result.root.get(), get_aabox, 1.0, 0.9);
+  std::size_t total() const {
+    return this->attributes + this->indices + this->tree + this->blocks;
+  }
+};
 
+template <class T>
+std::size_t vector_bytes(const std::vector<T> &v) {
+  return v.capacity() * sizeof(T);
+}
+
+inline tri_mesh_footprint get_footprint(const tri_mesh &mesh,
+                                        const tri_mesh_crunched &crunched) {
+  tri_mesh_footprint result;
+  result.attributes =
+      vector_bytes(mesh.v) + vector_bytes(mesh.n) + vector_bytes(mesh.m);
+  result.indices =
+      vector_bytes(mesh.fv) + vector_bytes(mesh.fn) + vector_bytes(mesh.fm);
+  result.tree = vector_bytes(crunched.tree.nodes) +
+                vector_bytes(crunched.tree.wide_nodes) +
+                vector_bytes(crunched.tree.finite_elements) +
+                vector_bytes(crunched.tree.infinite_elements);
+  result.blocks =
+      vector_bytes(crunched.blocks) + vector_bytes(crunched.leaf_blocks);
   return result;
 }
 
-constexpr int CONTACT_INTO = (1 << 0);
-constexpr int CONTACT_EXIT = (1 << 1);
-constexpr int CONTACT_SKIM = (1 << 2);
-constexpr int CONTACT_HIT = (1 << 3);
+/// The size of the arrays that VIEW reads, in bytes.  Normals and material
+/// coordinates aren't part of a view, and nor is the kd_tree's binary form.
+inline tri_mesh_footprint get_footprint(const tri_mesh_view &view) {
+  tri_mesh_footprint result;
+  result.attributes = view.v.size * sizeof(view.v.data[0]);
+  result.indices = view.fv.size * sizeof(view.fv.data[0]);
+  result.tree = view.wide_nodes.size * sizeof(view.wide_nodes.data[0]);
+  result.blocks = view.blocks.size * sizeof(view.blocks.data[0]) +
+                  view.leaf_blocks.size * sizeof(view.leaf_blocks.data[0]);
+  return result;
+}
 
 struct tri_contact {
   // Type of the contact.
@@ -137,10 +274,6 @@ struct tri_contact {
   // The ray parameter of intersection.
   double ray_t;
 
-  // The two triangular parameters of intersection.
-  double tri_s;
-  double tri_t;
-
   // The point of intersection.
   ballistae::fixvec<double, 3> p;
 
@@ -148,81 +281,263 @@ struct tri_contact {
   ballistae::fixvec<double, 3> n;
 };
 
-tri_contact tri_face_contact(const ballistae::ray_segment &query,
-                             const tri_face_crunched &f, const int want_type) {
-  const ray &r = query.the_ray;
+/// A ray, prepared for testing against tri_blocks.
+///
+/// Triangles are tested in a frame where the ray starts at the origin and
+/// runs along the z axis (Woop, Benthin, and Wald, "Watertight Ray/Triangle
+/// Intersection", 2013).  KZ is the axis along which the ray travels
+/// fastest, and the other two axes are sheared so that the ray runs straight
+/// along it.  Since each edge is tested the same way for the triangles on
+/// either side of it, a ray can't slip through a crack between them.
+struct tri_ray {
+  std::array<float, 3> point;
+  std::size_t kx;
+  std::size_t ky;
+  std::size_t kz;
+  float sx;
+  float sy;
+  float sz;
+};
 
-  double cosine = iprod(f.n, r.slope);
-  double offset = iprod(f.n, r.point - f.v0);
-  double ray_t = -offset / cosine;
+inline tri_ray make_tri_ray(const ray &r) {
+  using std::abs;
 
-  if (!contains(query.the_segment, ray_t)) {
-    tri_contact result;
-    result.type = 0;
-    return result;
+  tri_ray result;
+  for (size_t i = 0; i < 3; ++i) {
+    result.point[i] = float(r.point(i));
   }
 
-  int contact_type = 0;
-  if (cosine < 0.0)
-    contact_type = CONTACT_INTO;
-  else if (cosine > 0.0)
-    contact_type = CONTACT_EXIT;
-  else if (cosine == 0.0 && offset == 0.0)
-    contact_type = CONTACT_SKIM;
-
-  if (!(contact_type & want_type)) {
-    tri_contact result;
-    result.type = contact_type;
-    return result;
+  result.kz = 0;
+  for (size_t i = 1; i < 3; ++i) {
+    if (abs(r.slope(i)) > abs(r.slope(result.kz))) {
+      result.kz = i;
+    }
+  }
+  result.kx = (result.kz + 1) % 3;
+  result.ky = (result.kx + 1) % 3;
+
+  // Keep the frame right-handed, so that windings keep their sign.
+  if (r.slope(result.kz) < 0.0) {
+    std::swap(result.kx, result.ky);
+  }
+
+  result.sx = float(r.slope(result.kx) / r.slope(result.kz));
+  result.sy = float(r.slope(result.ky) / r.slope(result.kz));
+  result.sz = float(1.0 / r.slope(result.kz));
+  return result;
+}
+
+/// tri_block_test, one triangle at a time.
+///
+/// Used where SSE is not available, and to check the SSE version.
+inline unsigned tri_block_test_scalar(const tri_block &block, const tri_ray &r,
+                                      float t_lo, float t_hi, int want_type,
+                                      std::array<float, tri_block_width> *t) {
+  // A triangle whose vertices wind counterclockwise, seen from where the ray
+  // comes from, has a positive determinant, and faces the ray.
+  bool want_into = want_type & CONTACT_INTO;
+  bool want_exit = want_type & CONTACT_EXIT;
+
+  unsigned result = 0;
+  for (size_t i = 0; i < tri_block_width; ++i) {
+    auto transform = [&](const std::array<std::array<float, 4>, 3> &vert,
+                         float *x, float *y, float *z) {
+      *z = vert[r.kz][i] - r.point[r.kz];
+      *x = (vert[r.kx][i] - r.point[r.kx]) - r.sx * *z;
+      *y = (vert[r.ky][i] - r.point[r.ky]) - r.sy * *z;
+    };
+
+    float ax, ay, az, bx, by, bz, cx, cy, cz;
+    transform(block.v0, &ax, &ay, &az);
+    transform(block.v1, &bx, &by, &bz);
+    transform(block.v2, &cx, &cy, &cz);
+
+    float eu = cx * by - cy * bx;
+    float ev = ax * cy - ay * cx;
+    float ew = bx * ay - by * ax;
+
+    bool inside = (eu >= 0 && ev >= 0 && ew >= 0) ||
+                  (eu <= 0 && ev <= 0 && ew <= 0);
+
+    float det = eu + ev + ew;
+    (*t)[i] = r.sz * (eu * az + ev * bz + ew * cz) / det;
+
+    bool facing = (want_into && det > 0) || (want_exit && det < 0);
+    if (inside && facing && (*t)[i] >= t_lo && (*t)[i] <= t_hi) {
+      result |= 1u << i;
+    }
   }
+  return result;
+}
 
-  fixvec<double, 3> p = eval_ray(r, ray_t);
-  fixvec<double, 3> w = p - f.v0;
+/// Test R over [T_LO, T_HI] against every triangle of BLOCK at once.
+///
+/// Only triangles that R enters (if WANT_TYPE has CONTACT_INTO) or leaves (if
+/// it has CONTACT_EXIT) count.  Returns a mask with bit i set if R hits
+/// triangle i, and stores the parameter of each hit into T.
+inline unsigned tri_block_test(const tri_block &block, const tri_ray &r,
+                               float t_lo, float t_hi, int want_type,
+                               std::array<float, tri_block_width> *t) {
+#if defined(__SSE__)
+  // A triangle whose vertices wind counterclockwise, seen from where the ray
+  // comes from, has a positive determinant, and faces the ray.
+  bool want_into = want_type & CONTACT_INTO;
+  bool want_exit = want_type & CONTACT_EXIT;
+
+  __m128 ox = _mm_set1_ps(r.point[r.kx]);
+  __m128 oy = _mm_set1_ps(r.point[r.ky]);
+  __m128 oz = _mm_set1_ps(r.point[r.kz]);
+  __m128 sx = _mm_set1_ps(r.sx);
+  __m128 sy = _mm_set1_ps(r.sy);
+
+  // Each vertex, relative to the ray's point, sheared into the ray's frame.
+  auto transform = [&](const std::array<std::array<float, 4>, 3> &vert,
+                       __m128 *x, __m128 *y, __m128 *z) {
+    *z = _mm_sub_ps(_mm_load_ps(vert[r.kz].data()), oz);
+    *x = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(vert[r.kx].data()), ox),
+                    _mm_mul_ps(sx, *z));
+    *y = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(vert[r.ky].data()), oy),
+                    _mm_mul_ps(sy, *z));
+  };
 
-  double tri_s = (f.vv * iprod(f.u, w) - iprod(f.v, w) * f.uv) * f.recip_denom;
-  double tri_t = (f.uu * iprod(f.v, w) - iprod(f.u, w) * f.uv) * f.recip_denom;
+  __m128 ax, ay, az, bx, by, bz, cx, cy, cz;
+  transform(block.v0, &ax, &ay, &az);
+  transform(block.v1, &bx, &by, &bz);
+  transform(block.v2, &cx, &cy, &cz);
+
+  // Twice the signed areas of the triangles that each edge makes with the
+  // ray.
+  __m128 eu = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+  __m128 ev = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+  __m128 ew = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+  __m128 zero = _mm_setzero_ps();
+  __m128 all_positive = _mm_and_ps(
+      _mm_and_ps(_mm_cmpge_ps(eu, zero), _mm_cmpge_ps(ev, zero)),
+      _mm_cmpge_ps(ew, zero));
+  __m128 all_negative = _mm_and_ps(
+      _mm_and_ps(_mm_cmple_ps(eu, zero), _mm_cmple_ps(ev, zero)),
+      _mm_cmple_ps(ew, zero));
+
+  __m128 det = _mm_add_ps(_mm_add_ps(eu, ev), ew);
+  __m128 hit_t = _mm_mul_ps(
+      _mm_set1_ps(r.sz),
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(eu, az), _mm_mul_ps(ev, bz)),
+                 _mm_mul_ps(ew, cz)));
+  hit_t = _mm_div_ps(hit_t, det);
+
+  __m128 facing = zero;
+  if (want_into) facing = _mm_or_ps(facing, _mm_cmpgt_ps(det, zero));
+  if (want_exit) facing = _mm_or_ps(facing, _mm_cmplt_ps(det, zero));
+
+  __m128 hit = _mm_and_ps(_mm_or_ps(all_positive, all_negative), facing);
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(hit_t, _mm_set1_ps(t_lo)));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(hit_t, _mm_set1_ps(t_hi)));
+
+  _mm_storeu_ps(t->data(), hit_t);
+  return unsigned(_mm_movemask_ps(hit));
+#else
+  return tri_block_test_scalar(block, r, t_lo, t_hi, want_type, t);
+#endif
+}
 
-  if (contains({0.0, 1.0}, tri_s) && contains({0.0, 1.0}, tri_t) &&
-      contains({0.0, 1.0}, (tri_s + tri_t))) {
-    contact_type |= CONTACT_HIT;
+/// Find the contact, among the blocks [SRC, LIM) of MESH, that is nearest
+/// along QUERY and whose type is in WANT_TYPE.
+///
+/// Blocks are tested in float.  Each hit is then placed exactly, in double,
+/// on the plane of its face, and hits that land outside QUERY's segment are
+/// dropped.  Returns a contact of type 0 if there is none.
+inline tri_contact tri_blocks_contact(const ray_segment &query,
+                                      const tri_ray &r,
+                                      const tri_mesh_view &mesh,
+                                      std::uint32_t src, std::uint32_t lim,
+                                      int want_type) {
+  tri_contact result;
+  result.type = 0;
+
+  span<double> segment = query.the_segment;
+  float t_lo = float_round_down(segment.lo);
+
+  for (std::uint32_t b = src; b < lim; ++b) {
+    const tri_block &block = mesh.blocks[b];
+
+    std::array<float, tri_block_width> t;
+    unsigned hits = tri_block_test(block, r, t_lo,
+                                   float_round_up(segment.hi), want_type, &t);
+
+    // Nearest first, until one holds up.
+    while (hits != 0) {
+      size_t lane = tri_block_width;
+      for (size_t i = 0; i < tri_block_width; ++i) {
+        if ((hits & (1u << i)) && (lane == tri_block_width || t[i] < t[lane])) {
+          lane = i;
+        }
+      }
+      hits &= ~(1u << lane);
+
+      tri_face_verts v = load_face_v(mesh, block.face[lane]);
+      fixvec<double, 3> n = get_face_normal(v);
+      double cosine = iprod(n, query.the_ray.slope);
+      double ray_t = -iprod(n, query.the_ray.point - v.v0) / cosine;
+
+      int contact_type = cosine < 0.0 ? CONTACT_INTO : CONTACT_EXIT;
+      if ((contact_type & want_type) && contains(segment, ray_t)) {
+        result = {contact_type | CONTACT_HIT, ray_t,
+                  eval_ray(query.the_ray, ray_t), n};
+        segment.hi = ray_t;
+        break;
+      }
+    }
   }
 
-  return {contact_type, ray_t, tri_s, tri_t, p, f.n};
+  return result;
 }
 
-ballistae::contact tri_mesh_contact(
-    ballistae::ray_segment r,
-    const ballistae::kd_tree<tri_face_crunched> &mesh_kd_tree,
-    const int want_type) {
+/// Find the nearest contact of R with a face of the mesh whose type is in
+/// WANT_TYPE.
+///
+/// If HIT_TYPE is not null, the contact's type (CONTACT_INTO or CONTACT_EXIT)
+/// is stored into it.
+ballistae::contact tri_mesh_contact(ballistae::ray_segment r,
+                                    const tri_mesh_view &mesh,
+                                    const int want_type,
+                                    int *hit_type = nullptr) {
   tri_contact least_contact;
-  least_contact.ray_t = std::numeric_limits<double>::infinity();
+  least_contact.type = 0;
 
-  // The kd_tree uses selector to drive the search.
-  auto selector = [&](const aabox &box) -> bool {
-    using std::isnan;
-    auto t = ray_test(r, box);
-    return !isnan(t);
-  };
+  tri_ray prepared = make_tri_ray(r.the_ray);
 
-  // When any stored object is indicated suspected to be relevant,
-  // the kd_tree will call computor on it.
-  auto computor = [&](const tri_face_crunched &face) -> void {
-    tri_contact c = tri_face_contact(r, face, want_type);
-    if ((c.type & CONTACT_HIT) && contains(r.the_segment, c.ray_t)) {
+  // When a leaf is suspected to be relevant, the kd_tree will call computor
+  // on its faces.
+  auto computor = [&](std::uint32_t src, std::uint32_t count) -> void {
+    if (count == 0) return;
+
+    std::uint32_t block_src = mesh.leaf_blocks[src];
+    std::uint32_t block_lim =
+        block_src + (count + tri_block_width - 1) / tri_block_width;
+    tri_contact c =
+        tri_blocks_contact(r, prepared, mesh, block_src, block_lim, want_type);
+    if (c.type & CONTACT_HIT) {
       r.the_segment.hi = c.ray_t;
       least_contact = c;
     }
   };
 
-  mesh_kd_tree.query(selector, computor);
+  if (mesh.wide_nodes.size != 0) {
+    kd_wide_ray_query_leaves(mesh.wide_nodes.data, &r, computor);
+  }
 
   contact result;
-  if (least_contact.ray_t == std::numeric_limits<double>::infinity()) {
+  if (!(least_contact.type & CONTACT_HIT)) {
     // If we didn't hit any triangles, we can bail now.
     result.t = std::numeric_limits<double>::quiet_NaN();
     return result;
   }
 
+  if (hit_type != nullptr) {
+    *hit_type = least_contact.type & (CONTACT_INTO | CONTACT_EXIT);
+  }
+
   result.t = least_contact.ray_t;
   result.r = r.the_ray;
   result.p = least_contact.p;
@@ -238,35 +553,47 @@ ballistae::contact tri_mesh_contact(
   return result;
 }
 
+/// Whether R meets any face of the mesh within its segment.
+bool tri_mesh_occluded(const ballistae::ray_segment &r,
+                       const tri_mesh_view &mesh) {
+  if (mesh.wide_nodes.size == 0) return false;
+
+  tri_ray prepared = make_tri_ray(r.the_ray);
+  return kd_wide_ray_query_any_leaves(
+      mesh.wide_nodes.data, r,
+      [&](std::uint32_t src, std::uint32_t count) -> bool {
+        if (count == 0) return false;
+
+        std::uint32_t block_src = mesh.leaf_blocks[src];
+        std::uint32_t block_lim =
+            block_src + (count + tri_block_width - 1) / tri_block_width;
+        tri_contact c =
+            tri_blocks_contact(r, prepared, mesh, block_src, block_lim,
+                               CONTACT_INTO | CONTACT_EXIT);
+        return c.type & CONTACT_HIT;
+      });
+}
+
+/// Whether every index of THE_MESH is in range, and every attribute is
+/// either present for every face or absent.
 bool tri_mesh_sanity_check(const tri_mesh &the_mesh) {
-  bool normal_found_invalid_idx = false;
-  bool normal_found_valid_idx = false;
-  bool texcoord_found_invalid_idx = false;
-  bool texcoord_found_valid_idx = false;
-  for (const tri_face_idx &idx : the_mesh.f) {
-    for (size_t i = 0; i < 3; ++i) {
-      if (idx.vi[i] >= the_mesh.v.size()) return false;
-
-      if (idx.ni[i] < the_mesh.n.size())
-        normal_found_valid_idx = true;
-      else if (idx.ni[i] == std::numeric_limits<size_t>::max())
-        normal_found_invalid_idx = true;
-      else
-        return false;
-
-      if (idx.mi[i] < the_mesh.m.size())
-        texcoord_found_valid_idx = true;
-      else if (idx.mi[i] == std::numeric_limits<size_t>::max())
-        texcoord_found_invalid_idx = true;
-      else
-        return false;
+  auto indices_valid = [](const std::vector<tri_face_idx> &faces,
+                          std::size_t attribute_size) {
+    for (const tri_face_idx &idx : faces) {
+      for (std::uint32_t i : idx) {
+        if (i >= attribute_size) return false;
+      }
     }
-  }
+    return true;
+  };
 
-  if (normal_found_valid_idx && normal_found_invalid_idx) return false;
-  if (texcoord_found_valid_idx && texcoord_found_invalid_idx) return false;
+  std::size_t face_count = the_mesh.fv.size();
+  if (!the_mesh.fn.empty() && the_mesh.fn.size() != face_count) return false;
+  if (!the_mesh.fm.empty() && the_mesh.fm.size() != face_count) return false;
 
-  return true;
+  return indices_valid(the_mesh.fv, the_mesh.v.size()) &&
+         indices_valid(the_mesh.fn, the_mesh.n.size()) &&
+         indices_valid(the_mesh.fm, the_mesh.m.size());
 }
 
 }  // namespace ballistae
@@ -3,19 +3,322 @@
 
 #include <algorithm>
 #include <array>
-#include <cassert>
 #include <climits>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 #include "libballistae/aabox.hh"
+#include "libballistae/ray.hh"
 #include "libballistae/span.hh"
+#include "libballistae/thread_pool.hh"
 
 namespace ballistae {
 
-/// The LINK field is an index into the kd tree's NODES field, and points to a
-/// the source of a two-node block holding the children of this node.
+/// A node of a kd_tree, packed into 32 bytes.
+///
+/// Nodes are stored depth-first in a single array.  The low child of an
+/// interior node immediately follows it, and LINK holds the index of the high
+/// child.  For a leaf, LINK holds the index of the leaf's first element in the
+/// tree's finite elements, and COUNT holds the number of elements.
+///
+/// Bounds are rounded outward to float, so they always contain the elements
+/// below the node.
+struct kd_node {
+  std::array<float, 3> lo;
+  std::array<float, 3> hi;
+
+  std::uint32_t link;
+  std::uint32_t count;
+
+  /// The COUNT of every interior node.
+  static constexpr std::uint32_t interior = UINT32_MAX;
+
+  bool is_leaf() const { return count != interior; }
+
+  aabox bounds() const;
+};
+
+static_assert(sizeof(kd_node) == 32, "kd_node should be 32 bytes");
+
+inline aabox kd_node::bounds() const {
+  aabox result;
+  for (size_t i = 0; i < 3; ++i) {
+    result.spans[i] = {this->lo[i], this->hi[i]};
+  }
+  return result;
+}
+
+/// Round X to a float that is no greater than X.
+inline float float_round_down(double x) {
+  float result = float(x);
+  if (double(result) > x) {
+    result = std::nextafter(result, -std::numeric_limits<float>::infinity());
+  }
+  return result;
+}
+
+/// Round X to a float that is no less than X.
+inline float float_round_up(double x) {
+  float result = float(x);
+  if (double(result) < x) {
+    result = std::nextafter(result, std::numeric_limits<float>::infinity());
+  }
+  return result;
+}
+
+inline kd_node make_kd_node(const aabox &bounds, std::uint32_t link,
+                            std::uint32_t count) {
+  kd_node result;
+  for (size_t i = 0; i < 3; ++i) {
+    result.lo[i] = float_round_down(bounds.spans[i].lo);
+    result.hi[i] = float_round_up(bounds.spans[i].hi);
+  }
+  result.link = link;
+  result.count = count;
+  return result;
+}
+
+/// The number of children of a kd_wide_node.
+constexpr size_t kd_wide_node_width = 4;
+
+/// A node of a kd_tree's wide tree, which collapses the binary tree so that
+/// each node holds up to four children.
+///
+/// Bounds are stored axis by axis, so that the same bound of every child can
+/// be loaded into one SIMD register.  Each child's LINK and COUNT work as in
+/// kd_node, except that an interior child's LINK is the index of its wide
+/// node.  Unused slots are empty leaves with empty bounds.
+struct alignas(16) kd_wide_node {
+  std::array<std::array<float, kd_wide_node_width>, 3> lo;
+  std::array<std::array<float, kd_wide_node_width>, 3> hi;
+
+  std::array<std::uint32_t, kd_wide_node_width> link;
+  std::array<std::uint32_t, kd_wide_node_width> count;
+};
+
+/// A ray, prepared for testing against kd_wide_node bounds.
+///
+/// POINT is the point of the ray nearest the origin, rather than the ray's
+/// own point, so that rounding it to float costs no more than rounding the
+/// tree's bounds did, however far away the ray starts.  Parameters along a
+/// kd_ray are measured from there, T_ORIGIN past the ray's own point.
+struct kd_ray {
+  std::array<float, 3> point;
+  std::array<float, 3> inv_slope;
+
+  /// Whether the ray travels toward decreasing values along each axis.
+  std::array<bool, 3> negative;
+
+  double t_origin;
+};
+
+inline kd_ray make_kd_ray(const ray &r) {
+  kd_ray result;
+  result.t_origin = -iprod(r.point, r.slope) / iprod(r.slope, r.slope);
+  fixvec<double, 3> point = eval_ray(r, result.t_origin);
+  for (size_t i = 0; i < 3; ++i) {
+    result.point[i] = float(point(i));
+    result.inv_slope[i] = float(1.0 / r.slope(i));
+    result.negative[i] = std::signbit(r.slope(i));
+  }
+  return result;
+}
+
+/// The range of parameters along R that SEGMENT covers, rounded outward.
+inline std::pair<float, float> kd_ray_segment(const kd_ray &r,
+                                              const span<double> &segment) {
+  return {float_round_down(segment.lo - r.t_origin),
+          float_round_up(segment.hi - r.t_origin)};
+}
+
+/// kd_wide_node_test, one child at a time.
+///
+/// Used where SSE is not available, and to check the SSE version.
+inline unsigned kd_wide_node_test_scalar(
+    const kd_wide_node &node, const kd_ray &r, float t_lo, float t_hi,
+    std::array<float, kd_wide_node_width> *t_entry) {
+  unsigned result = 0;
+  for (size_t i = 0; i < kd_wide_node_width; ++i) {
+    float near_t = t_lo;
+    float far_t = t_hi;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      float near_bound =
+          r.negative[axis] ? node.hi[axis][i] : node.lo[axis][i];
+      float far_bound = r.negative[axis] ? node.lo[axis][i] : node.hi[axis][i];
+
+      float axis_near = (near_bound - r.point[axis]) * r.inv_slope[axis];
+      float axis_far = (far_bound - r.point[axis]) * r.inv_slope[axis];
+
+      // Comparisons with NaN are false, which ignores the axis.
+      near_t = axis_near > near_t ? axis_near : near_t;
+      far_t = axis_far < far_t ? axis_far : far_t;
+    }
+
+    (*t_entry)[i] = near_t;
+    if (near_t <= far_t) {
+      result |= 1u << i;
+    }
+  }
+  return result;
+}
+
+/// Test R over [T_LO, T_HI] against every child of NODE at once.
+///
+/// Returns a mask with bit i set if R passes through child i, and stores the
+/// parameter at which R enters each child into T_ENTRY.
+inline unsigned kd_wide_node_test(
+    const kd_wide_node &node, const kd_ray &r, float t_lo, float t_hi,
+    std::array<float, kd_wide_node_width> *t_entry) {
+#if defined(__SSE__)
+  __m128 near_t = _mm_set1_ps(t_lo);
+  __m128 far_t = _mm_set1_ps(t_hi);
+  for (size_t axis = 0; axis < 3; ++axis) {
+    const float *near_bound =
+        r.negative[axis] ? node.hi[axis].data() : node.lo[axis].data();
+    const float *far_bound =
+        r.negative[axis] ? node.lo[axis].data() : node.hi[axis].data();
+
+    __m128 point = _mm_set1_ps(r.point[axis]);
+    __m128 inv_slope = _mm_set1_ps(r.inv_slope[axis]);
+    __m128 axis_near =
+        _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_bound), point), inv_slope);
+    __m128 axis_far =
+        _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_bound), point), inv_slope);
+
+    // A ray lying in a bounding plane gives NaN.  _mm_max_ps and _mm_min_ps
+    // return their second operand in that case, which ignores the axis.
+    near_t = _mm_max_ps(axis_near, near_t);
+    far_t = _mm_min_ps(axis_far, far_t);
+  }
+
+  _mm_storeu_ps(t_entry->data(), near_t);
+  return unsigned(_mm_movemask_ps(_mm_cmple_ps(near_t, far_t)));
+#else
+  return kd_wide_node_test_scalar(node, r, t_lo, t_hi, t_entry);
+#endif
+}
+
+/// Collapse the binary tree NODES into wide nodes.
+///
+/// Each wide node takes the children of a binary node, then repeatedly opens
+/// up its interior child with the largest surface area, until it has four
+/// children or only leaves.
+inline std::vector<kd_wide_node> kd_tree_widen(
+    const std::vector<kd_node> &nodes) {
+  std::vector<kd_wide_node> result;
+  if (nodes.empty()) {
+    return result;
+  }
+
+  // Rays are tested in float, so their points are rounded.  Pad the bounds
+  // by a margin in proportion to the size of the scene to cover that.  A ray
+  // that can meet the scene at all passes within that size of the origin,
+  // where make_kd_ray places its point.
+  double scene_size = 0;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    scene_size = std::max({scene_size, std::abs(double(nodes[0].lo[axis])),
+                           std::abs(double(nodes[0].hi[axis]))});
+  }
+  double pad = std::ldexp(scene_size, -20);
+
+  // Each entry holds a binary node to place as a wide node, and the wide
+  // node and slot that should link to it, if any.
+  struct pending {
+    std::uint32_t binary;
+    size_t parent;
+    size_t slot;
+  };
+  constexpr size_t no_parent = std::numeric_limits<size_t>::max();
+  std::vector<pending> work_stack;
+  work_stack.push_back({0, no_parent, 0});
+
+  while (!work_stack.empty()) {
+    pending cur = work_stack.back();
+    work_stack.pop_back();
+
+    size_t index = result.size();
+    if (cur.parent != no_parent) {
+      result[cur.parent].link[cur.slot] = std::uint32_t(index);
+    }
+
+    std::array<std::uint32_t, kd_wide_node_width> children;
+    size_t child_count = 0;
+    if (nodes[cur.binary].is_leaf()) {
+      children[child_count++] = cur.binary;
+    } else {
+      children[child_count++] = cur.binary + 1;
+      children[child_count++] = nodes[cur.binary].link;
+    }
+
+    while (child_count < kd_wide_node_width) {
+      size_t widest = child_count;
+      double widest_area = -1;
+      for (size_t i = 0; i < child_count; ++i) {
+        const kd_node &child = nodes[children[i]];
+        if (!child.is_leaf() && surface_area(child.bounds()) > widest_area) {
+          widest = i;
+          widest_area = surface_area(child.bounds());
+        }
+      }
+      if (widest == child_count) break;
+
+      // Replace the child with its own children, keeping them in order.
+      std::uint32_t opened = children[widest];
+      std::copy_backward(children.begin() + widest + 1,
+                         children.begin() + child_count,
+                         children.begin() + child_count + 1);
+      children[widest] = opened + 1;
+      children[widest + 1] = nodes[opened].link;
+      ++child_count;
+    }
+
+    kd_wide_node wide;
+    for (size_t i = 0; i < kd_wide_node_width; ++i) {
+      for (size_t axis = 0; axis < 3; ++axis) {
+        wide.lo[axis][i] = std::numeric_limits<float>::infinity();
+        wide.hi[axis][i] = -std::numeric_limits<float>::infinity();
+      }
+      wide.link[i] = 0;
+      wide.count[i] = 0;
+    }
+
+    for (size_t i = 0; i < child_count; ++i) {
+      const kd_node &child = nodes[children[i]];
+      for (size_t axis = 0; axis < 3; ++axis) {
+        wide.lo[axis][i] = float_round_down(child.lo[axis] - pad);
+        wide.hi[axis][i] = float_round_up(child.hi[axis] + pad);
+      }
+      wide.link[i] = child.link;
+      wide.count[i] = child.count;
+    }
+    result.push_back(wide);
+
+    // Push in reverse, so that the first interior child is placed next.
+    for (size_t i = child_count; i-- > 0;) {
+      if (!nodes[children[i]].is_leaf()) {
+        work_stack.push_back({children[i], index, i});
+      }
+    }
+  }
+
+  return result;
+}
+
+/// A node of the pointer-based tree that kd_tree_refine_sah builds before
+/// flattening it into kd_nodes.
 template <typename Stored>
 struct aanode {
   aabox bounds;
@@ -27,12 +330,109 @@ struct aanode {
   std::unique_ptr<aanode<Stored>> hi_child;
 };
 
+/// Tuning for kd_tree_refine_sah.
+struct kd_tree_build_options {
+  /// The number of bins along each axis that candidate splits are drawn from.
+  size_t bin_count = 32;
+
+  /// Nodes holding this many elements or fewer are never split.
+  size_t leaf_size = 4;
+
+  /// The cost of visiting a node, relative to the cost of testing one element.
+  double traversal_cost = 1.0;
+
+  /// Nodes holding at least this many elements are built on the shared
+  /// thread_pool.  Their bins are filled in parallel, in chunks of
+  /// parallel_grain elements, and each of their children is refined as a
+  /// separate task.
+  size_t parallel_threshold = 16384;
+  size_t parallel_grain = 4096;
+
+  /// Whether to also build the wide tree that ray_query uses.
+  bool wide_nodes = true;
+};
+
+/// The bounds of every element in [SRC, LIM).
+///
+/// Large ranges are gathered in parallel chunks, as described by OPTIONS.
+template <typename It, typename StoredToAABox>
+aabox kd_tree_bounds(It src, It lim, StoredToAABox get_aabox,
+                     const kd_tree_build_options &options) {
+  size_t element_count = lim - src;
+  size_t grain = element_count >= options.parallel_threshold
+                     ? options.parallel_grain
+                     : element_count;
+  if (grain == 0) {
+    return aabox::accum_zero();
+  }
+
+  std::vector<aabox> chunk_bounds((element_count + grain - 1) / grain,
+                                  aabox::accum_zero());
+  parallel_for(&thread_pool::shared(), element_count, grain,
+               [&](size_t chunk_src, size_t chunk_lim) {
+                 chunk_bounds[chunk_src / grain] = std::accumulate(
+                     src + chunk_src, src + chunk_lim, aabox::accum_zero(),
+                     [&](auto a, auto b) {
+                       return min_containing(a, get_aabox(b));
+                     });
+               });
+
+  aabox result = aabox::accum_zero();
+  for (const aabox &box : chunk_bounds) {
+    result = min_containing(result, box);
+  }
+  return result;
+}
+
+/// The stack of nodes still to visit in a tree traversal.
+///
+/// The first N entries are held in place, which covers any reasonably
+/// balanced tree without touching the heap.  Deeper trees spill into
+/// SPILLED, so that no node is ever dropped.
+template <typename T, size_t N>
+struct kd_work_stack {
+  std::array<T, N> entries;
+  std::vector<T> spilled;
+  size_t size = 0;
+
+  bool empty() const { return size == 0; }
+
+  void push(const T &x) {
+    if (size < N) {
+      entries[size] = x;
+    } else {
+      spilled.push_back(x);
+    }
+    ++size;
+  }
+
+  T pop() {
+    --size;
+    if (size < N) {
+      return entries[size];
+    }
+    T result = spilled.back();
+    spilled.pop_back();
+    return result;
+  }
+};
+
 /// A balanced, bounded-volume
 template <typename Stored>
 struct kd_tree final {
   std::vector<Stored> infinite_elements;
   std::vector<Stored> finite_elements;
-  std::unique_ptr<aanode<Stored>> root;
+
+  /// The bounds of all finite elements.
+  aabox bounds;
+
+  /// The tree over finite_elements, in depth-first order.  Node 0 is the
+  /// root.
+  std::vector<kd_node> nodes;
+
+  /// NODES collapsed into four-wide nodes, for ray_query.  Node 0 is the
+  /// root.  Empty if the wide tree hasn't been built.
+  std::vector<kd_wide_node> wide_nodes;
 
   kd_tree() = default;
 
@@ -42,9 +442,47 @@ struct kd_tree final {
   template <typename StoredToAABox>
   kd_tree(std::vector<Stored> &&storage_in, StoredToAABox get_aabox);
 
+  /// Call LEAF_COMPUTOR(src, count) on the finite elements [src, src + count)
+  /// of every leaf whose bounds SELECTOR accepts, until it returns true.
+  template <typename Selector, typename LeafComputor>
+  void query_leaves(Selector selector, LeafComputor leaf_computor) const;
+
   template <typename Selector, typename Computor>
   void query(Selector selector, Computor computor) const;
 
+  /// Call LEAF_COMPUTOR(src, count) on the finite elements [src, src + count)
+  /// of every leaf whose bounds QUERY passes through.
+  ///
+  /// Leaves are visited front to back.  LEAF_COMPUTOR may shorten QUERY's
+  /// segment as it finds hits, and leaves beyond the shortened segment are
+  /// skipped.  Infinite elements are not visited.
+  template <typename LeafComputor>
+  void ray_query_leaves(const ray_segment *query,
+                        LeafComputor leaf_computor) const;
+
+  /// Call COMPUTOR on every element whose bounds QUERY passes through.
+  ///
+  /// Nodes are visited front to back.  COMPUTOR may shorten QUERY's segment
+  /// as it finds hits, and nodes beyond the shortened segment are skipped.
+  template <typename Computor>
+  void ray_query(const ray_segment *query, Computor computor) const;
+
+  /// Call LEAF_PREDICATE(src, count) on leaves whose bounds QUERY passes
+  /// through, in no particular order, until it returns true.  Infinite
+  /// elements are not visited.
+  ///
+  /// Returns whether LEAF_PREDICATE returned true for any leaf.
+  template <typename LeafPredicate>
+  bool ray_query_any_leaves(const ray_segment &query,
+                            LeafPredicate leaf_predicate) const;
+
+  /// Call PREDICATE on elements whose bounds QUERY passes through, in no
+  /// particular order, until it returns true.
+  ///
+  /// Returns whether PREDICATE returned true for any element.
+  template <typename Predicate>
+  bool ray_query_any(const ray_segment &query, Predicate predicate) const;
+
   kd_tree<Stored> &operator=(const kd_tree<Stored> &other) = delete;
   kd_tree<Stored> &operator=(kd_tree<Stored> &&other) = default;
 };
@@ -67,28 +505,255 @@ kd_tree<Stored>::kd_tree(std::vector<Stored> &&storage,
   infinite_elements = std::vector<Stored>(make_move_iterator(finite_lim),
                                           make_move_iterator(end(storage)));
 
-  aabox max_box = std::accumulate(
-      std::begin(finite_elements), std::end(finite_elements),
-      aabox::accum_zero(),
-      [&](auto a, auto b) { return min_containing(a, get_aabox(b)); });
+  // Node links and counts are 32 bits.
+  if (finite_elements.size() >= kd_node::interior) {
+    throw std::runtime_error("too many elements for a kd_tree: " +
+                             std::to_string(finite_elements.size()));
+  }
+
+  bounds = kd_tree_bounds(begin(finite_elements), end(finite_elements),
+                          get_aabox, kd_tree_build_options());
 
-  // Root node encompasses all finite boxes.
-  root = std::make_unique<aanode<Stored>>();
-  *root = {max_box, begin(finite_elements), end(finite_elements), nullptr,
-           nullptr};
+  // Until it is refined, the tree is a single leaf holding every finite
+  // element.
+  nodes = {make_kd_node(bounds, 0, std::uint32_t(finite_elements.size()))};
 }
 
-template <typename Stored, typename StoredToAABox>
-void kd_tree_refine_sah(aanode<Stored> *cur, StoredToAABox get_aabox,
-                        double split_cost, double threshold) {
-  using std::begin;
-  using std::end;
+/// Lay out the tree below ROOT as kd_nodes, depth-first.
+template <typename Stored>
+std::vector<kd_node> kd_tree_flatten(
+    const aanode<Stored> &root,
+    typename std::vector<Stored>::iterator elements_base) {
+  std::vector<kd_node> result;
 
-  using std::make_move_iterator;
+  // Each entry holds a node to place, and the index of the node whose link
+  // should point to it, if any.
+  constexpr size_t no_parent = std::numeric_limits<size_t>::max();
+  std::vector<std::pair<const aanode<Stored> *, size_t>> work_stack;
+  work_stack.push_back({&root, no_parent});
+
+  while (!work_stack.empty()) {
+    const aanode<Stored> *cur;
+    size_t parent;
+    std::tie(cur, parent) = work_stack.back();
+    work_stack.pop_back();
+
+    size_t index = result.size();
+    if (parent != no_parent) {
+      result[parent].link = std::uint32_t(index);
+    }
+
+    if (cur->lo_child != nullptr && cur->hi_child != nullptr) {
+      result.push_back(make_kd_node(cur->bounds, 0, kd_node::interior));
 
+      // The low child is placed next, right after this node.
+      work_stack.push_back({cur->hi_child.get(), index});
+      work_stack.push_back({cur->lo_child.get(), no_parent});
+    } else {
+      result.push_back(make_kd_node(
+          cur->bounds, std::uint32_t(cur->elements_src - elements_base),
+          std::uint32_t(cur->elements_lim - cur->elements_src)));
+    }
+  }
+
+  return result;
+}
+
+/// A split chosen by split_sah.
+///
+/// Elements are binned by the centroids of their bounds along AXIS, and those
+/// that land in bins up to and including BIN go to the low child.
+struct kd_split {
+  bool should_cut;
+  size_t axis;
+  size_t bin;
+
+  double centroid_lo;
+  double bin_scale;
+  size_t bin_count;
+
+  aabox lo_bounds;
+  aabox hi_bounds;
+
+  size_t bin_of(const aabox &box) const;
+};
+
+inline double centroid(const aabox &box, size_t axis) {
+  return (box.spans[axis].lo + box.spans[axis].hi) / 2;
+}
+
+inline size_t kd_split::bin_of(const aabox &box) const {
+  double offset = (centroid(box, this->axis) - this->centroid_lo);
+  return std::min(size_t(offset * this->bin_scale), this->bin_count - 1);
+}
+
+/// Find the split of CUR with the least surface area heuristic cost.
+///
+/// Candidate splits lie on the boundaries between equal-width centroid bins.
+/// Each element is read once per call, and the costs of every candidate are
+/// found with a sweep over the bins from each end.
+template <typename Stored, typename StoredToAABox>
+kd_split split_sah(const aanode<Stored> &cur, StoredToAABox get_aabox,
+                   const kd_tree_build_options &options) {
   using std::distance;
 
-  std::mt19937 rng;
+  kd_split result;
+  result.should_cut = false;
+  result.bin_count = std::max<size_t>(options.bin_count, 2);
+
+  size_t element_count = distance(cur.elements_src, cur.elements_lim);
+  if (element_count <= std::max<size_t>(options.leaf_size, 1)) {
+    return result;
+  }
+
+  // Large nodes are binned in parallel chunks.  Bounds and counts merge
+  // exactly, so the result doesn't depend on how the chunks are scheduled.
+  size_t grain = element_count >= options.parallel_threshold
+                     ? options.parallel_grain
+                     : element_count;
+  size_t chunk_count = (element_count + grain - 1) / grain;
+  auto for_each_chunk = [&](auto fn) {
+    parallel_for(&thread_pool::shared(), element_count, grain,
+                 [&](size_t src, size_t lim) {
+                   fn(src / grain, cur.elements_src + src,
+                      cur.elements_src + lim);
+                 });
+  };
+
+  std::vector<aabox> chunk_centroid_bounds(chunk_count, aabox::accum_zero());
+  for_each_chunk([&](size_t chunk, auto src, auto lim) {
+    aabox &accum = chunk_centroid_bounds[chunk];
+    for (auto it = src; it != lim; ++it) {
+      aabox box = get_aabox(*it);
+      for (size_t axis = 0; axis < 3; ++axis) {
+        accum[axis] = min_containing(accum[axis], centroid(box, axis));
+      }
+    }
+  });
+
+  aabox centroid_bounds = aabox::accum_zero();
+  for (const aabox &chunk_bounds : chunk_centroid_bounds) {
+    centroid_bounds = min_containing(centroid_bounds, chunk_bounds);
+  }
+
+  struct bin {
+    aabox bounds;
+    size_t count;
+  };
+
+  size_t bin_count = result.bin_count;
+
+  std::array<double, 3> bin_scale;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    double extent = measure(centroid_bounds[axis]);
+    bin_scale[axis] = extent > 0 ? bin_count / extent : 0;
+  }
+
+  std::vector<bin> chunk_bins(chunk_count * 3 * bin_count,
+                              bin{aabox::accum_zero(), 0});
+  for_each_chunk([&](size_t chunk, auto src, auto lim) {
+    bin *bins = &chunk_bins[chunk * 3 * bin_count];
+    for (auto it = src; it != lim; ++it) {
+      aabox box = get_aabox(*it);
+      for (size_t axis = 0; axis < 3; ++axis) {
+        double offset = centroid(box, axis) - centroid_bounds[axis].lo;
+        size_t b = std::min(size_t(offset * bin_scale[axis]), bin_count - 1);
+        bin &cur_bin = bins[axis * bin_count + b];
+        cur_bin.bounds = min_containing(cur_bin.bounds, box);
+        ++cur_bin.count;
+      }
+    }
+  });
+
+  std::vector<bin> bins(chunk_bins.begin(), chunk_bins.begin() + 3 * bin_count);
+  for (size_t chunk = 1; chunk < chunk_count; ++chunk) {
+    for (size_t i = 0; i < 3 * bin_count; ++i) {
+      const bin &chunk_bin = chunk_bins[chunk * 3 * bin_count + i];
+      bins[i].bounds = min_containing(bins[i].bounds, chunk_bin.bounds);
+      bins[i].count += chunk_bin.count;
+    }
+  }
+
+  // Costs are left multiplied through by the area of CUR.  Splitting has to
+  // beat leaving every element in a leaf.
+  double best_cost = element_count * surface_area(cur.bounds);
+
+  std::vector<bin> suffix(bin_count);
+  for (size_t axis = 0; axis < 3; ++axis) {
+    // Every centroid is in the same place along this axis.
+    if (bin_scale[axis] == 0) continue;
+
+    const bin *axis_bins = &bins[axis * bin_count];
+
+    bin accum = {aabox::accum_zero(), 0};
+    for (size_t i = bin_count; i-- > 0;) {
+      accum.bounds = min_containing(accum.bounds, axis_bins[i].bounds);
+      accum.count += axis_bins[i].count;
+      suffix[i] = accum;
+    }
+
+    accum = {aabox::accum_zero(), 0};
+    for (size_t i = 0; i + 1 < bin_count; ++i) {
+      accum.bounds = min_containing(accum.bounds, axis_bins[i].bounds);
+      accum.count += axis_bins[i].count;
+
+      const bin &hi = suffix[i + 1];
+      if (accum.count == 0 || hi.count == 0) continue;
+
+      double cost = options.traversal_cost * surface_area(cur.bounds) +
+                    accum.count * surface_area(accum.bounds) +
+                    hi.count * surface_area(hi.bounds);
+      if (cost < best_cost) {
+        best_cost = cost;
+        result.should_cut = true;
+        result.axis = axis;
+        result.bin = i;
+        result.centroid_lo = centroid_bounds[axis].lo;
+        result.bin_scale = bin_scale[axis];
+        result.lo_bounds = accum.bounds;
+        result.hi_bounds = hi.bounds;
+      }
+    }
+  }
+
+  return result;
+}
+
+/// Split CUR into two children, if the surface area heuristic says that it
+/// is worth it.
+///
+/// Returns false if CUR is left as a leaf.
+template <typename Stored, typename StoredToAABox>
+bool kd_tree_split_node(aanode<Stored> *cur, StoredToAABox get_aabox,
+                        const kd_tree_build_options &options) {
+  kd_split split = split_sah(*cur, get_aabox, options);
+  if (!split.should_cut) return false;
+
+  auto split_lim =
+      std::partition(cur->elements_src, cur->elements_lim, [&](auto &a) {
+        return split.bin_of(get_aabox(a)) <= split.bin;
+      });
+
+  cur->lo_child = std::make_unique<aanode<Stored>>();
+  *(cur->lo_child) = {split.lo_bounds, cur->elements_src, split_lim, nullptr,
+                      nullptr};
+
+  cur->hi_child = std::make_unique<aanode<Stored>>();
+  *(cur->hi_child) = {split.hi_bounds, split_lim, cur->elements_lim, nullptr,
+                      nullptr};
+
+  return true;
+}
+
+/// Refine the subtree below CUR.
+///
+/// Children large enough to be worth it are handed to the shared thread_pool.
+/// Subtrees cover disjoint ranges of elements, so they never interfere, and
+/// the shape of the tree doesn't depend on how the tasks are scheduled.
+template <typename Stored, typename StoredToAABox>
+void kd_tree_refine_subtree(aanode<Stored> *cur, StoredToAABox get_aabox,
+                            const kd_tree_build_options &options) {
+  task_group tasks(&thread_pool::shared());
 
   std::vector<aanode<Stored> *> work_stack;
   work_stack.push_back(cur);
@@ -97,162 +762,268 @@ void kd_tree_refine_sah(aanode<Stored> *cur, StoredToAABox get_aabox,
     cur = work_stack.back();
     work_stack.pop_back();
 
-    if (distance(cur->elements_src, cur->elements_lim) < 2) return;
+    if (!kd_tree_split_node(cur, get_aabox, options)) continue;
 
-    bool should_cut;
-    size_t cut_axis;
-    double cut;
-    std::tie(should_cut, cut_axis, cut) =
-        split_sah(*(cur), get_aabox, split_cost, threshold, rng);
+    for (aanode<Stored> *child : {cur->lo_child.get(), cur->hi_child.get()}) {
+      size_t child_size = child->elements_lim - child->elements_src;
+      if (child_size >= options.parallel_threshold) {
+        tasks.run([child, get_aabox, &options]() {
+          kd_tree_refine_subtree(child, get_aabox, options);
+        });
+      } else {
+        work_stack.push_back(child);
+      }
+    }
+  }
 
-    // Terminate recursion if indicated.
-    if (!should_cut) continue;
+  tasks.wait();
+}
 
-    // Place elements that strictly precede the cut into the low child of the
-    // current node.
-    auto precede_src = cur->elements_src;
-    auto precede_lim =
-        std::partition(cur->elements_src, cur->elements_lim, [&](auto &a) {
-          return strictly_precedes(get_aabox(a).spans[cut_axis], cut);
-        });
+/// Build TREE's nodes with a binned surface area heuristic.
+///
+/// The result depends only on the elements and OPTIONS.
+template <typename Stored, typename StoredToAABox>
+void kd_tree_refine_sah(
+    kd_tree<Stored> &tree, StoredToAABox get_aabox,
+    const kd_tree_build_options &options = kd_tree_build_options()) {
+  using std::begin;
+  using std::end;
 
-    if (distance(precede_src, precede_lim) != 0) {
-      aabox lo_bounds = std::accumulate(
-          precede_src, precede_lim, aabox::accum_zero(),
-          [&](auto a, auto b) { return min_containing(a, get_aabox(b)); });
+  aanode<Stored> root = {tree.bounds, begin(tree.finite_elements),
+                         end(tree.finite_elements), nullptr, nullptr};
 
-      cur->lo_child = std::make_unique<aanode<Stored>>();
-      *(cur->lo_child) = {lo_bounds, precede_src, precede_lim, nullptr,
-                          nullptr};
+  kd_tree_refine_subtree(&root, get_aabox, options);
 
-      work_stack.push_back(cur->lo_child.get());
-    }
+  tree.nodes = kd_tree_flatten(root, begin(tree.finite_elements));
 
-    // All remaining elements overlap or strictly succeed the cut, and are
-    // placed in the high child.
+  if (options.wide_nodes) {
+    tree.wide_nodes = kd_tree_widen(tree.nodes);
+  }
+}
 
-    auto succeed_src = precede_lim;
-    auto succeed_lim = cur->elements_lim;
+template <typename Stored>
+template <typename Selector, typename LeafComputor>
+void kd_tree<Stored>::query_leaves(Selector selector,
+                                   LeafComputor leaf_computor) const {
+  if (nodes.empty()) {
+    return;
+  }
 
-    if (distance(succeed_src, succeed_lim) != 0) {
-      aabox hi_bounds = std::accumulate(
-          succeed_src, succeed_lim, aabox::accum_zero(),
-          [&](auto a, auto b) { return min_containing(a, get_aabox(b)); });
+  kd_work_stack<std::uint32_t, 2048> work_stack;
+  work_stack.push(0);
 
-      cur->hi_child = std::make_unique<aanode<Stored>>();
-      *(cur->hi_child) = {hi_bounds, succeed_src, succeed_lim, nullptr,
-                          nullptr};
+  while (!work_stack.empty()) {
+    std::uint32_t index = work_stack.pop();
+    const kd_node &cur = nodes[index];
 
-      work_stack.push_back(cur->hi_child.get());
+    if (selector(cur.bounds())) {
+      if (cur.is_leaf()) {
+        if (leaf_computor(cur.link, cur.count)) {
+          return;
+        }
+      } else {
+        work_stack.push(index + 1);
+        work_stack.push(cur.link);
+      }
     }
   }
 }
 
-template <typename Stored, typename StoredToAABox>
-std::tuple<bool, size_t, double> split_sah(aanode<Stored> &cur,
-                                           StoredToAABox get_aabox,
-                                           double split_cost,
-                                           double termination_threshold,
-                                           std::mt19937 &rng) {
+template <typename Stored>
+template <typename Selector, typename Computor>
+void kd_tree<Stored>::query(Selector selector, Computor computor) const {
   using std::begin;
   using std::end;
 
-  using std::distance;
+  this->query_leaves(selector, [&](std::uint32_t src, std::uint32_t count) {
+    auto elements_src = begin(finite_elements) + src;
+    std::for_each(elements_src, elements_src + count, computor);
+    return false;
+  });
 
-  double parent_objective =
-      distance(cur.elements_src, cur.elements_lim) * surface_area(cur.bounds);
+  // Infinite elements are checked after the tree, so that a computor looking
+  // for the nearest contact has already cut the segment short.  Most of them
+  // can then be turned away on their distance alone.
+  std::for_each(begin(infinite_elements), end(infinite_elements), computor);
+}
 
-  size_t piv_axis = 0;
-  double piv_cut;
-  double piv_objective = std::numeric_limits<double>::infinity();
+/// Call LEAF_COMPUTOR(link, count) on every leaf of the wide tree WIDE_NODES
+/// whose bounds QUERY passes through, front to back.
+///
+/// This is kd_tree::ray_query_leaves, for wide trees stored outside a
+/// kd_tree.
+template <typename LeafComputor>
+void kd_wide_ray_query_leaves(const kd_wide_node *wide_nodes,
+                              const ray_segment *query,
+                              LeafComputor leaf_computor) {
+  kd_ray r = make_kd_ray(query->the_ray);
 
-  std::uniform_int_distribution<std::size_t> element_picker(
-      0, std::distance(cur.elements_src, cur.elements_lim));
-  for (size_t axis = 0; axis < 3; ++axis) {
-    // Check five random elements from this axis
-    for (std::size_t cur_check = 0; cur_check < 5; cur_check++) {
-      auto it = cur.elements_src + element_picker(rng);
-
-      auto split =
-          std::partition(cur.elements_src, cur.elements_lim, [&](auto &e) {
-            return strictly_precedes(get_aabox(e).spans[axis],
-                                     get_aabox(*it).spans[axis].hi);
-          });
-
-      auto precede_src = cur.elements_src;
-      auto precede_lim = split;
-
-      auto succeed_src = split;
-      auto succeed_lim = cur.elements_lim;
-
-      aabox lo_box = std::accumulate(
-          precede_src, precede_lim, aabox::accum_zero(),
-          [&](auto a, auto b) { return min_containing(a, get_aabox(b)); });
-
-      aabox hi_box = std::accumulate(
-          succeed_src, succeed_lim, aabox::accum_zero(),
-          [&](auto a, auto b) { return min_containing(a, get_aabox(b)); });
-
-      double objective = double(0);
-      if (distance(precede_src, precede_lim) != 0)
-        objective += surface_area(lo_box) * distance(precede_src, precede_lim);
-      if (distance(succeed_src, succeed_lim) != 0)
-        objective += surface_area(hi_box) * distance(succeed_src, succeed_lim);
-
-      if (objective < piv_objective) {
-        piv_axis = axis;
-        piv_cut = get_aabox(*it).spans[axis].hi;
-        piv_objective = objective;
+  // Children are visited nearest first, and each stack entry remembers where
+  // the ray enters it, so that entries beyond the closest hit found since they
+  // were pushed can be dropped without another test.
+  struct stack_entry {
+    std::uint32_t link;
+    std::uint32_t count;
+    float t_entry;
+  };
+
+  kd_work_stack<stack_entry, 1024> work_stack;
+  work_stack.push(
+      {0, kd_node::interior, -std::numeric_limits<float>::infinity()});
+
+  while (!work_stack.empty()) {
+    stack_entry cur = work_stack.pop();
+
+    float t_lo;
+    float t_hi;
+    std::tie(t_lo, t_hi) = kd_ray_segment(r, query->the_segment);
+    if (cur.t_entry > t_hi) continue;
+
+    if (cur.count != kd_node::interior) {
+      leaf_computor(cur.link, cur.count);
+      continue;
+    }
+
+    const kd_wide_node &node = wide_nodes[cur.link];
+
+    std::array<float, kd_wide_node_width> t_entry;
+    unsigned hits = kd_wide_node_test(node, r, t_lo, t_hi, &t_entry);
+
+    // Sort the children that were hit by entry distance.
+    std::array<size_t, kd_wide_node_width> order;
+    size_t hit_count = 0;
+    for (size_t i = 0; i < kd_wide_node_width; ++i) {
+      if (!(hits & (1u << i))) continue;
+
+      size_t j = hit_count++;
+      for (; j > 0 && t_entry[order[j - 1]] > t_entry[i]; --j) {
+        order[j] = order[j - 1];
       }
+      order[j] = i;
+    }
+
+    // Push the farthest first, so that the nearest is popped next.
+    for (size_t j = hit_count; j-- > 0;) {
+      size_t i = order[j];
+      work_stack.push({node.link[i], node.count[i], t_entry[i]});
     }
   }
+}
 
-  // Now we have computed the optimal split.  We need to check if it is a good
-  // improvement over simply not splitting.
-  if (piv_objective + split_cost > termination_threshold * parent_objective) {
-    return std::make_tuple(false, 0, double(0));
-  } else {
-    return std::make_tuple(true, piv_axis, piv_cut);
+template <typename Stored>
+template <typename LeafComputor>
+void kd_tree<Stored>::ray_query_leaves(const ray_segment *query,
+                                       LeafComputor leaf_computor) const {
+  if (wide_nodes.empty()) {
+    auto selector = [&](const aabox &box) -> bool {
+      using std::isnan;
+      return !isnan(ray_test(*query, box));
+    };
+    this->query_leaves(selector, [&](std::uint32_t src, std::uint32_t count) {
+      leaf_computor(src, count);
+      return false;
+    });
+    return;
   }
+
+  kd_wide_ray_query_leaves(wide_nodes.data(), query, leaf_computor);
 }
 
 template <typename Stored>
-template <typename Selector, typename Computor>
-void kd_tree<Stored>::query(Selector selector, Computor computor) const {
+template <typename Computor>
+void kd_tree<Stored>::ray_query(const ray_segment *query,
+                                Computor computor) const {
   using std::begin;
   using std::end;
 
-  // Always check all infinite elements.
+  this->ray_query_leaves(query, [&](std::uint32_t src, std::uint32_t count) {
+    auto elements_src = begin(finite_elements) + src;
+    std::for_each(elements_src, elements_src + count, computor);
+  });
+
+  // As in query(), infinite elements come last, against the shortened
+  // segment.
   std::for_each(begin(infinite_elements), end(infinite_elements), computor);
+}
 
-  // We recurse to a fixed depth.
-  std::array<aanode<Stored> *, 2048> work_stack;
+/// Call LEAF_PREDICATE(link, count) on leaves of the wide tree WIDE_NODES
+/// whose bounds QUERY passes through, until it returns true.
+///
+/// This is kd_tree::ray_query_any_leaves, for wide trees stored outside a
+/// kd_tree.
+template <typename LeafPredicate>
+bool kd_wide_ray_query_any_leaves(const kd_wide_node *wide_nodes,
+                                  const ray_segment &query,
+                                  LeafPredicate leaf_predicate) {
+  kd_ray r = make_kd_ray(query.the_ray);
+  float t_lo;
+  float t_hi;
+  std::tie(t_lo, t_hi) = kd_ray_segment(r, query.the_segment);
 
-  auto top = begin(work_stack);
-  auto base = begin(work_stack);
+  kd_work_stack<std::uint32_t, 1024> work_stack;
+  work_stack.push(0);
 
-  *top = root.get();
-  ++top;
+  while (!work_stack.empty()) {
+    const kd_wide_node &cur = wide_nodes[work_stack.pop()];
 
-  while (top != base) {
-    --top;
-    auto p_cur = *top;
+    std::array<float, kd_wide_node_width> t_entry;
+    unsigned hits = kd_wide_node_test(cur, r, t_lo, t_hi, &t_entry);
 
-    if (selector(p_cur->bounds)) {
-      if (p_cur->lo_child == nullptr && p_cur->hi_child == nullptr) {
-        std::for_each(p_cur->elements_src, p_cur->elements_lim, computor);
-      } else if (static_cast<size_t>(top - base) < work_stack.size() - 2) {
-        if (p_cur->lo_child != nullptr) {
-          *top = p_cur->lo_child.get();
-          ++top;
-        }
-        if (p_cur->hi_child != nullptr) {
-          *top = p_cur->hi_child.get();
-          ++top;
+    for (size_t i = 0; i < kd_wide_node_width; ++i) {
+      if (!(hits & (1u << i))) continue;
+
+      if (cur.count[i] != kd_node::interior) {
+        if (leaf_predicate(cur.link[i], cur.count[i])) {
+          return true;
         }
+      } else {
+        work_stack.push(cur.link[i]);
       }
     }
   }
+
+  return false;
+}
+
+template <typename Stored>
+template <typename LeafPredicate>
+bool kd_tree<Stored>::ray_query_any_leaves(
+    const ray_segment &query, LeafPredicate leaf_predicate) const {
+  if (wide_nodes.empty()) {
+    // Without wide nodes, shut off the search once a blocker is found.
+    bool found = false;
+    auto selector = [&](const aabox &box) -> bool {
+      using std::isnan;
+      return !isnan(ray_test(query, box));
+    };
+    this->query_leaves(selector, [&](std::uint32_t src, std::uint32_t count) {
+      found = leaf_predicate(src, count);
+      return found;
+    });
+    return found;
+  }
+
+  return kd_wide_ray_query_any_leaves(wide_nodes.data(), query,
+                                      leaf_predicate);
+}
+
+template <typename Stored>
+template <typename Predicate>
+bool kd_tree<Stored>::ray_query_any(const ray_segment &query,
+                                    Predicate predicate) const {
+  using std::begin;
+  using std::end;
+
+  if (std::any_of(begin(infinite_elements), end(infinite_elements),
+                  predicate)) {
+    return true;
+  }
+
+  return this->ray_query_any_leaves(
+      query, [&](std::uint32_t src, std::uint32_t count) {
+        auto elements_src = begin(finite_elements) + src;
+        return std::any_of(elements_src, elements_src + count, predicate);
+      });
 }
 
 }  // namespace ballistae
@@ -0,0 +1,537 @@
+#include "libballistae/kd_tree.hh"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "libballistae/test_geometry.hh"
+
+namespace ballistae {
+namespace {
+
+constexpr float inf = std::numeric_limits<float>::infinity();
+
+// A wide node of random boxes in [-1, 1]^3, with the last EMPTY slots unused.
+kd_wide_node random_wide_node(std::mt19937 *gen, size_t empty) {
+  std::uniform_real_distribution<float> coord(-1.0f, 1.0f);
+
+  kd_wide_node node;
+  for (size_t i = 0; i < kd_wide_node_width; ++i) {
+    for (size_t axis = 0; axis < 3; ++axis) {
+      float a = coord(*gen);
+      float b = coord(*gen);
+      node.lo[axis][i] = std::min(a, b);
+      node.hi[axis][i] = std::max(a, b);
+      if (i + empty >= kd_wide_node_width) {
+        node.lo[axis][i] = inf;
+        node.hi[axis][i] = -inf;
+      }
+    }
+    node.link[i] = 0;
+    node.count[i] = 0;
+  }
+  return node;
+}
+
+// A random ray, some of which start exactly on a bound of NODE and run
+// parallel to it, so that the slab test meets 0 * inf.
+ray random_node_ray(std::mt19937 *gen, const kd_wide_node &node) {
+  std::uniform_int_distribution<int> choice(0, 5);
+
+  // Rays along the y axis have nothing left to run in once flattened.
+  ray result = random_ray(gen);
+  if (choice(*gen) == 0 && std::abs(result.slope(1)) < 1.0) {
+    result.slope(1) = 0.0;
+    result.point(1) = node.lo[1][0];
+    result.slope = normalise(result.slope);
+  }
+  return result;
+}
+
+bool same_float(float a, float b) {
+  return std::memcmp(&a, &b, sizeof(a)) == 0 ||
+         (std::isnan(a) && std::isnan(b));
+}
+
+TEST(KdWideNodeTest, MatchesScalar) {
+  std::mt19937 gen(1);
+  for (int trial = 0; trial < 20000; ++trial) {
+    kd_wide_node node = random_wide_node(&gen, trial % 3);
+    kd_ray r = make_kd_ray(random_node_ray(&gen, node));
+    float t_lo = (trial % 2) ? 0.0f : -inf;
+    float t_hi = (trial % 5) ? inf : 1.0f;
+
+    std::array<float, kd_wide_node_width> simd_t;
+    std::array<float, kd_wide_node_width> scalar_t;
+    unsigned simd = kd_wide_node_test(node, r, t_lo, t_hi, &simd_t);
+    unsigned scalar = kd_wide_node_test_scalar(node, r, t_lo, t_hi, &scalar_t);
+
+    ASSERT_EQ(simd, scalar) << "trial " << trial;
+    for (size_t i = 0; i < kd_wide_node_width; ++i) {
+      ASSERT_TRUE(same_float(simd_t[i], scalar_t[i]))
+          << "trial " << trial << " lane " << i;
+    }
+  }
+}
+
+TEST(KdWideNodeTest, MatchesSlabReference) {
+  std::mt19937 gen(2);
+  int checked = 0;
+  for (int trial = 0; trial < 20000; ++trial) {
+    kd_wide_node node = random_wide_node(&gen, trial % 3);
+    ray the_ray = random_node_ray(&gen, node);
+    kd_ray r = make_kd_ray(the_ray);
+
+    float t_lo;
+    float t_hi;
+    std::tie(t_lo, t_hi) = kd_ray_segment(r, span<double>::pos_half());
+
+    std::array<float, kd_wide_node_width> t_entry;
+    unsigned hits = kd_wide_node_test(node, r, t_lo, t_hi, &t_entry);
+
+    for (size_t i = 0; i < kd_wide_node_width; ++i) {
+      bool hit = hits & (1u << i);
+      if (node.lo[0][i] > node.hi[0][i]) {
+        EXPECT_FALSE(hit) << "trial " << trial << " hit an unused slot";
+        continue;
+      }
+
+      // The same test, in double, with rays in a bounding plane left out.
+      double near_t = 0.0;
+      double far_t = std::numeric_limits<double>::infinity();
+      bool borderline = false;
+      for (size_t axis = 0; axis < 3; ++axis) {
+        double p = the_ray.point(axis);
+        double s = the_ray.slope(axis);
+        double lo = node.lo[axis][i];
+        double hi = node.hi[axis][i];
+        if (s == 0.0) {
+          if (p == lo || p == hi) borderline = true;
+          if (p < lo || p > hi) far_t = -1.0;
+          continue;
+        }
+        double t0 = (lo - p) / s;
+        double t1 = (hi - p) / s;
+        near_t = std::max(near_t, std::min(t0, t1));
+        far_t = std::min(far_t, std::max(t0, t1));
+      }
+      if (borderline || std::abs(near_t - far_t) < 1e-4) continue;
+
+      ++checked;
+      EXPECT_EQ(hit, near_t <= far_t) << "trial " << trial << " lane " << i;
+      if (hit) {
+        EXPECT_NEAR(t_entry[i] + r.t_origin, near_t, 1e-4)
+            << "trial " << trial;
+      }
+    }
+  }
+  EXPECT_GT(checked, 40000);
+}
+
+// COUNT small random boxes in [-1, 1]^3.
+std::vector<aabox> random_boxes(std::mt19937 *gen, size_t count) {
+  std::uniform_real_distribution<double> coord(-1.0, 1.0);
+  std::uniform_real_distribution<double> size(0.0, 0.1);
+
+  std::vector<aabox> result(count);
+  for (aabox &box : result) {
+    for (size_t axis = 0; axis < 3; ++axis) {
+      double lo = coord(*gen);
+      box[axis] = {lo, lo + size(*gen)};
+    }
+  }
+  return result;
+}
+
+aabox box_bounds(const aabox &box) { return box; }
+
+kd_tree<aabox> build_tree(std::vector<aabox> boxes,
+                          const kd_tree_build_options &options) {
+  kd_tree<aabox> tree(std::move(boxes), box_bounds);
+  kd_tree_refine_sah(tree, box_bounds, options);
+  return tree;
+}
+
+bool overlaps(const aabox &a, const aabox &b) {
+  for (size_t axis = 0; axis < 3; ++axis) {
+    if (!overlaps(a[axis], b[axis])) return false;
+  }
+  return true;
+}
+
+TEST(KdTreeTest, FlattenIsDepthFirst) {
+  std::vector<aabox> elements(5, aabox::accum_zero());
+  auto base = elements.begin();
+  aabox bounds;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    bounds[axis] = {-0.1, 0.1};
+  }
+
+  // A root whose low child is a leaf, and whose high child has two leaves.
+  aanode<aabox> root = {bounds, base, base + 5, nullptr, nullptr};
+  root.lo_child.reset(new aanode<aabox>{bounds, base, base + 2, nullptr,
+                                        nullptr});
+  root.hi_child.reset(new aanode<aabox>{bounds, base + 2, base + 5, nullptr,
+                                        nullptr});
+  root.hi_child->lo_child.reset(new aanode<aabox>{bounds, base + 2, base + 3,
+                                                  nullptr, nullptr});
+  root.hi_child->hi_child.reset(new aanode<aabox>{bounds, base + 3, base + 5,
+                                                  nullptr, nullptr});
+
+  std::vector<kd_node> nodes = kd_tree_flatten(root, base);
+  ASSERT_EQ(nodes.size(), 5u);
+
+  const std::uint32_t links[] = {2, 0, 4, 2, 3};
+  const std::uint32_t counts[] = {kd_node::interior, 2, kd_node::interior, 1,
+                                  2};
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    EXPECT_EQ(nodes[i].link, links[i]) << "node " << i;
+    EXPECT_EQ(nodes[i].count, counts[i]) << "node " << i;
+
+    // 0.1 isn't a float, so the bounds are rounded out.
+    for (size_t axis = 0; axis < 3; ++axis) {
+      EXPECT_LT(nodes[i].lo[axis], -0.1) << "node " << i;
+      EXPECT_GT(nodes[i].hi[axis], 0.1) << "node " << i;
+      EXPECT_EQ(nodes[i].lo[axis], float_round_down(-0.1)) << "node " << i;
+      EXPECT_EQ(nodes[i].hi[axis], float_round_up(0.1)) << "node " << i;
+    }
+  }
+}
+
+TEST(KdTreeTest, FlattenedLinksPointForward) {
+  std::mt19937 gen(3);
+  kd_tree_build_options options;
+  options.wide_nodes = false;
+  kd_tree<aabox> tree = build_tree(random_boxes(&gen, 1000), options);
+  ASSERT_GT(tree.nodes.size(), 1u);
+
+  // Leaves come in depth-first order, so their elements follow each other.
+  std::uint32_t next_element = 0;
+  for (size_t i = 0; i < tree.nodes.size(); ++i) {
+    const kd_node &node = tree.nodes[i];
+    if (node.is_leaf()) {
+      EXPECT_EQ(node.link, next_element) << "node " << i;
+      next_element += node.count;
+    } else {
+      EXPECT_GT(node.link, i + 1) << "node " << i;
+      EXPECT_LT(node.link, tree.nodes.size()) << "node " << i;
+    }
+  }
+  EXPECT_EQ(next_element, tree.finite_elements.size());
+}
+
+TEST(KdTreeTest, QueryLeavesVisitsSelectedLeaves) {
+  std::mt19937 gen(4);
+  kd_tree_build_options options;
+  options.wide_nodes = false;
+  kd_tree<aabox> tree = build_tree(random_boxes(&gen, 1000), options);
+
+  std::vector<aabox> queries = random_boxes(&gen, 200);
+  for (size_t q = 0; q < queries.size(); ++q) {
+    const aabox &query = queries[q];
+
+    std::vector<int> visits(tree.finite_elements.size(), 0);
+    tree.query_leaves(
+        [&](const aabox &box) { return overlaps(box, query); },
+        [&](std::uint32_t src, std::uint32_t count) {
+          for (std::uint32_t i = src; i < src + count; ++i) ++visits[i];
+          return false;
+        });
+
+    // No leaf is visited twice, and every element that meets the query is
+    // in a visited leaf.
+    for (size_t i = 0; i < visits.size(); ++i) {
+      EXPECT_LE(visits[i], 1) << "query " << q << " element " << i;
+      if (overlaps(tree.finite_elements[i], query)) {
+        EXPECT_EQ(visits[i], 1) << "query " << q << " element " << i;
+      }
+    }
+  }
+}
+
+TEST(KdTreeTest, QueryLeavesStopsWhenAsked) {
+  std::mt19937 gen(5);
+  kd_tree_build_options options;
+  options.wide_nodes = false;
+  kd_tree<aabox> tree = build_tree(random_boxes(&gen, 1000), options);
+
+  for (int stop_after : {1, 2, 7}) {
+    int calls = 0;
+    tree.query_leaves([](const aabox &) { return true; },
+                      [&](std::uint32_t, std::uint32_t) {
+                        return ++calls == stop_after;
+                      });
+    EXPECT_EQ(calls, stop_after);
+  }
+}
+
+bool contains(const kd_node &node, const aabox &box) {
+  for (size_t axis = 0; axis < 3; ++axis) {
+    if (box[axis].lo < node.lo[axis] || box[axis].hi > node.hi[axis]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Walk TREE from the root, and check that every finite element is reached
+// in exactly one leaf, and that each node's bounds contain the elements
+// below it.
+void expect_well_formed(const kd_tree<aabox> &tree) {
+  std::vector<int> reached(tree.finite_elements.size(), 0);
+
+  // Each entry holds a node, and the nodes above it.
+  std::vector<std::pair<std::uint32_t, std::vector<std::uint32_t>>> stack;
+  stack.push_back({0, {}});
+  while (!stack.empty()) {
+    std::uint32_t index = stack.back().first;
+    std::vector<std::uint32_t> path = std::move(stack.back().second);
+    stack.pop_back();
+    ASSERT_LT(index, tree.nodes.size());
+
+    const kd_node &node = tree.nodes[index];
+    path.push_back(index);
+    if (!node.is_leaf()) {
+      stack.push_back({index + 1, path});
+      stack.push_back({node.link, path});
+      continue;
+    }
+
+    ASSERT_LE(std::size_t(node.link) + node.count, reached.size());
+    for (std::uint32_t i = node.link; i < node.link + node.count; ++i) {
+      ++reached[i];
+      for (std::uint32_t above : path) {
+        EXPECT_TRUE(contains(tree.nodes[above], tree.finite_elements[i]))
+            << "node " << above << " element " << i;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < reached.size(); ++i) {
+    EXPECT_EQ(reached[i], 1) << "element " << i;
+  }
+}
+
+TEST(KdTreeTest, EveryElementInOneLeaf) {
+  std::mt19937 gen(6);
+  std::vector<aabox> boxes = random_boxes(&gen, 2000);
+
+  // Elements without finite bounds stay out of the tree.
+  aabox unbounded = boxes[0];
+  unbounded[1].hi = std::numeric_limits<double>::infinity();
+  boxes.push_back(unbounded);
+
+  kd_tree<aabox> tree = build_tree(boxes, kd_tree_build_options());
+  EXPECT_EQ(tree.finite_elements.size(), boxes.size() - 1);
+  EXPECT_EQ(tree.infinite_elements.size(), 1u);
+  EXPECT_GT(tree.nodes.size(), 1u);
+
+  for (size_t axis = 0; axis < 3; ++axis) {
+    EXPECT_EQ(tree.nodes[0].lo[axis], float_round_down(tree.bounds[axis].lo));
+    EXPECT_EQ(tree.nodes[0].hi[axis], float_round_up(tree.bounds[axis].hi));
+  }
+  expect_well_formed(tree);
+}
+
+TEST(KdTreeTest, IdenticalElementsStayInOneLeaf) {
+  std::mt19937 gen(7);
+  std::vector<aabox> boxes(100, random_boxes(&gen, 1)[0]);
+
+  // No split separates them, so splitting never pays off.
+  kd_tree<aabox> tree = build_tree(boxes, kd_tree_build_options());
+  ASSERT_EQ(tree.nodes.size(), 1u);
+  EXPECT_EQ(tree.nodes[0].count, 100u);
+  expect_well_formed(tree);
+}
+
+template <class T>
+bool same_bytes(const std::vector<T> &a, const std::vector<T> &b) {
+  if (a.size() != b.size()) return false;
+  return a.empty() ||
+         std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+TEST(KdTreeTest, ParallelBuildMatchesSerial) {
+  std::mt19937 gen(8);
+  std::vector<aabox> boxes = random_boxes(&gen, 5000);
+
+  kd_tree_build_options serial;
+  serial.parallel_threshold = std::numeric_limits<size_t>::max();
+  kd_tree<aabox> expected = build_tree(boxes, serial);
+
+  // Small enough that most nodes are binned in chunks and refined as tasks.
+  kd_tree_build_options parallel;
+  parallel.parallel_threshold = 64;
+  parallel.parallel_grain = 16;
+  for (int trial = 0; trial < 4; ++trial) {
+    kd_tree<aabox> tree = build_tree(boxes, parallel);
+    EXPECT_TRUE(same_bytes(tree.nodes, expected.nodes)) << "trial " << trial;
+    EXPECT_TRUE(same_bytes(tree.finite_elements, expected.finite_elements))
+        << "trial " << trial;
+    EXPECT_TRUE(same_bytes(tree.wide_nodes, expected.wide_nodes))
+        << "trial " << trial;
+  }
+  expect_well_formed(expected);
+}
+
+// A wide node whose slots are all unused.
+kd_wide_node empty_wide_node() {
+  kd_wide_node node;
+  for (size_t i = 0; i < kd_wide_node_width; ++i) {
+    for (size_t axis = 0; axis < 3; ++axis) {
+      node.lo[axis][i] = inf;
+      node.hi[axis][i] = -inf;
+    }
+    node.link[i] = 0;
+    node.count[i] = 0;
+  }
+  return node;
+}
+
+void set_slot(kd_wide_node *node, size_t slot, float x_lo, std::uint32_t link,
+              std::uint32_t count) {
+  for (size_t axis = 0; axis < 3; ++axis) {
+    node->lo[axis][slot] = axis == 0 ? x_lo : -1.0f;
+    node->hi[axis][slot] = 1.0f;
+  }
+  node->link[slot] = link;
+  node->count[slot] = count;
+}
+
+// A chain of DEPTH wide nodes, each of whose last slots leads to the next.
+// The other slots lead to an empty node, and the ray along +x from
+// (-2, 0, 0) enters them after the next link of the chain, so they pile up
+// on the traversal stack.  The last node of the chain holds one leaf.
+std::vector<kd_wide_node> deep_wide_tree(std::uint32_t depth) {
+  std::uint32_t dead_end = depth;
+  std::vector<kd_wide_node> nodes(depth + 1, empty_wide_node());
+  for (std::uint32_t i = 0; i < depth; ++i) {
+    for (size_t slot = 0; slot + 1 < kd_wide_node_width; ++slot) {
+      set_slot(&nodes[i], slot, 0.5f, dead_end, kd_node::interior);
+    }
+    if (i + 1 < depth) {
+      set_slot(&nodes[i], kd_wide_node_width - 1, -1.0f, i + 1,
+               kd_node::interior);
+    } else {
+      set_slot(&nodes[i], kd_wide_node_width - 1, -1.0f, 7, 1);
+    }
+  }
+  return nodes;
+}
+
+ray_segment along_x() {
+  ray_segment result;
+  result.the_ray.point = {-2.0, 0.0, 0.0};
+  result.the_ray.slope = {1.0, 0.0, 0.0};
+  result.the_ray.patch_area = 0.0;
+  result.the_segment = span<double>::pos_half();
+  return result;
+}
+
+TEST(KdTreeTest, DeepWideTreesKeepEveryChild) {
+  std::vector<kd_wide_node> nodes = deep_wide_tree(3000);
+  ray_segment query = along_x();
+
+  int leaves = 0;
+  kd_wide_ray_query_leaves(nodes.data(), &query,
+                           [&](std::uint32_t link, std::uint32_t count) {
+                             EXPECT_EQ(link, 7u);
+                             EXPECT_EQ(count, 1u);
+                             ++leaves;
+                           });
+  EXPECT_EQ(leaves, 1);
+
+  EXPECT_TRUE(kd_wide_ray_query_any_leaves(
+      nodes.data(), query,
+      [&](std::uint32_t link, std::uint32_t) { return link == 7; }));
+}
+
+TEST(KdTreeTest, DeepTreesKeepEveryChild) {
+  // A chain of interior nodes, each with a leaf as its low child, so that
+  // the leaves pile up on the traversal stack.
+  constexpr std::uint32_t depth = 5000;
+  kd_tree<aabox> tree;
+  aabox bounds;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    bounds[axis] = {-1.0, 1.0};
+  }
+  for (std::uint32_t i = 0; i < depth; ++i) {
+    tree.nodes.push_back(make_kd_node(bounds, 2 * i + 2, kd_node::interior));
+    tree.nodes.push_back(make_kd_node(bounds, i, 1));
+  }
+  tree.nodes.push_back(make_kd_node(bounds, depth, 1));
+
+  std::vector<int> visits(depth + 1, 0);
+  tree.query_leaves([](const aabox &) { return true; },
+                    [&](std::uint32_t src, std::uint32_t count) {
+                      EXPECT_EQ(count, 1u);
+                      ++visits[src];
+                      return false;
+                    });
+  for (std::uint32_t i = 0; i <= depth; ++i) {
+    EXPECT_EQ(visits[i], 1) << "leaf " << i;
+  }
+}
+
+TEST(KdTreeTest, FarRaysFindThinBoxes) {
+  std::mt19937 gen(9);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  std::uniform_int_distribution<int> axis_choice(0, 2);
+
+  // Small boxes, each flat along one axis, as the bounds of axis-aligned
+  // triangles are.
+  std::vector<aabox> boxes = random_boxes(&gen, 2000);
+  for (aabox &box : boxes) {
+    for (size_t axis = 0; axis < 3; ++axis) {
+      box[axis].hi = box[axis].lo + 0.001;
+    }
+    int flat = axis_choice(gen);
+    box[flat].hi = box[flat].lo;
+  }
+  kd_tree<aabox> tree = build_tree(boxes, kd_tree_build_options());
+  ASSERT_FALSE(tree.wide_nodes.empty());
+
+  std::uniform_int_distribution<size_t> box_choice(0, boxes.size() - 1);
+  for (int trial = 0; trial < 4000; ++trial) {
+    // Aim at a point well inside a box, from up to 10^5 scene sizes away.
+    const aabox &target_box = boxes[box_choice(gen)];
+    fixvec<double, 3> target;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      const span<double> &s = target_box[axis];
+      target(axis) = s.lo + (0.05 + 0.9 * unit(gen)) * (s.hi - s.lo);
+    }
+    fixvec<double, 3> slope = normalise(fixvec<double, 3>{
+        unit(gen) - 0.5, unit(gen) - 0.5, unit(gen) - 0.5});
+    double distance = std::pow(10.0, 5 * unit(gen));
+
+    ray_segment query;
+    query.the_ray.point = target - distance * slope;
+    query.the_ray.slope = slope;
+    query.the_ray.patch_area = 0.0;
+    query.the_segment = span<double>::pos_half();
+
+    std::vector<bool> visited(tree.finite_elements.size(), false);
+    tree.ray_query_leaves(&query, [&](std::uint32_t src, std::uint32_t count) {
+      std::fill(visited.begin() + src, visited.begin() + src + count, true);
+    });
+
+    // Every box that the ray meets, by the double-precision test.
+    for (size_t i = 0; i < visited.size(); ++i) {
+      if (!std::isnan(ray_test(query, tree.finite_elements[i]).lo)) {
+        EXPECT_TRUE(visited[i])
+            << "trial " << trial << " distance " << distance << " box " << i;
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace ballistae
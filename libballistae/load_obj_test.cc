@@ -0,0 +1,165 @@
+#include "libballistae/geometry/load_obj.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+
+#include "gtest/gtest.h"
+
+namespace ballistae {
+namespace {
+
+// Small enough that even short files are cut into several chunks.
+constexpr std::size_t tiny_chunk_size = 64;
+
+std::tuple<int, size_t, tri_mesh> parse(const std::string &text,
+                                        std::size_t chunk_size) {
+  return parse_obj(text.data(), text.data() + text.size(), false, chunk_size);
+}
+
+// Replace every "\n" in TEXT with "\r\n".
+std::string crlf(const std::string &text) {
+  std::string result;
+  for (char c : text) {
+    if (c == '\n') result += '\r';
+    result += c;
+  }
+  return result;
+}
+
+void expect_same_mesh(const tri_mesh &a, const tri_mesh &b) {
+  EXPECT_EQ(a.v, b.v);
+  EXPECT_EQ(a.n, b.n);
+  EXPECT_EQ(a.m, b.m);
+  EXPECT_EQ(a.fv, b.fv);
+  EXPECT_EQ(a.fn, b.fn);
+  EXPECT_EQ(a.fm, b.fm);
+}
+
+// A strip of quads, each added as four vertices, texture coordinates, and
+// normals followed by two faces that name them with negative indices.  Odd
+// quads name their positions with absolute indices instead.
+std::string relative_strip(int quads) {
+  std::string text = "# a strip\ng strip\n";
+  for (int i = 0; i < quads; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      std::string x = std::to_string(i + (j & 1));
+      std::string y = std::to_string(j >> 1);
+      text += "v " + x + " " + y + " 0\n";
+      text += "vt " + x + " " + y + "\n";
+      text += "vn 0 0 1\n";
+    }
+    if (i % 2 == 0) {
+      text += "f -4/-4/-4 -3/-3/-3 -1/-1/-1\n";
+      text += "f -4/-4/-4 -1/-1/-1 -2/-2/-2\n";
+    } else {
+      int base = 4 * i + 1;
+      std::string a = std::to_string(base);
+      std::string b = std::to_string(base + 1);
+      std::string c = std::to_string(base + 2);
+      std::string d = std::to_string(base + 3);
+      text += "f " + a + "/-4/-4 " + b + "/-3/-3 " + d + "/-1/-1\n";
+      text += "f " + a + "/-4/-4 " + d + "/-1/-1 " + c + "/-2/-2\n";
+    }
+  }
+  return text;
+}
+
+TEST(LoadObj, RelativeIndicesAcrossChunks) {
+  constexpr int quads = 100;
+  std::string text = relative_strip(quads);
+
+  for (std::size_t chunk_size : {tiny_chunk_size, std::size_t(1) << 20}) {
+    int errc;
+    size_t lines;
+    tri_mesh mesh;
+    std::tie(errc, lines, mesh) = parse(text, chunk_size);
+    ASSERT_EQ(errc, OBJ_ERRC_NONE) << "chunk size " << chunk_size;
+    EXPECT_EQ(lines, std::size_t(2 + 14 * quads));
+
+    ASSERT_EQ(mesh.v.size(), std::size_t(4 * quads));
+    ASSERT_EQ(mesh.fv.size(), std::size_t(2 * quads));
+    for (int i = 0; i < quads; ++i) {
+      std::uint32_t base = 4 * i;
+      tri_face_idx first = {base, base + 1, base + 3};
+      tri_face_idx second = {base, base + 3, base + 2};
+      EXPECT_EQ(mesh.fv[2 * i], first) << "quad " << i;
+      EXPECT_EQ(mesh.fv[2 * i + 1], second) << "quad " << i;
+      EXPECT_EQ(mesh.fm[2 * i], first) << "quad " << i;
+      EXPECT_EQ(mesh.fn[2 * i + 1], second) << "quad " << i;
+    }
+  }
+}
+
+TEST(LoadObj, Crlf) {
+  std::string text = relative_strip(40);
+  tri_mesh expected = std::get<2>(parse(text, std::size_t(1) << 20));
+
+  for (std::size_t chunk_size : {tiny_chunk_size, std::size_t(1) << 20}) {
+    int errc;
+    size_t lines;
+    tri_mesh mesh;
+    std::tie(errc, lines, mesh) = parse(crlf(text), chunk_size);
+    ASSERT_EQ(errc, OBJ_ERRC_NONE) << "chunk size " << chunk_size;
+    EXPECT_EQ(lines, std::size_t(2 + 14 * 40));
+    expect_same_mesh(mesh, expected);
+  }
+}
+
+TEST(LoadObj, NoFinalNewline) {
+  std::string text = relative_strip(20);
+  for (int i = 0; i < 3; ++i) {
+    text += "v 9 9 " + std::to_string(i) + "\nvt 0 0\nvn 0 0 1\n";
+  }
+  text += "f -3/-3/-3 -2/-2/-2 -1/-1/-1";
+
+  for (std::size_t chunk_size : {tiny_chunk_size, std::size_t(1) << 20}) {
+    for (const std::string &file : {text, crlf(text)}) {
+      int errc;
+      size_t lines;
+      tri_mesh mesh;
+      std::tie(errc, lines, mesh) = parse(file, chunk_size);
+      ASSERT_EQ(errc, OBJ_ERRC_NONE) << "chunk size " << chunk_size;
+      EXPECT_EQ(lines, std::size_t(2 + 14 * 20 + 10));
+      ASSERT_EQ(mesh.v.size(), std::size_t(4 * 20 + 3));
+      ASSERT_EQ(mesh.fv.size(), std::size_t(2 * 20 + 1));
+      tri_face_idx last = {80, 81, 82};
+      EXPECT_EQ(mesh.fv.back(), last);
+    }
+  }
+}
+
+TEST(LoadObj, ErrorLineInLaterChunk) {
+  std::string good = relative_strip(30);
+  std::size_t good_lines = 2 + 14 * 30;
+
+  for (std::string bad : {"v 1 2\n", "f 1 2\n", "x\n", "vt 1 q\n"}) {
+    std::string text = good + bad + relative_strip(5);
+    for (std::size_t chunk_size : {tiny_chunk_size, std::size_t(1) << 20}) {
+      for (const std::string &file : {text, crlf(text)}) {
+        int errc;
+        size_t lines;
+        tri_mesh mesh;
+        std::tie(errc, lines, mesh) = parse(file, chunk_size);
+        EXPECT_EQ(errc, OBJ_ERRC_PARSE_ERROR) << bad;
+        EXPECT_EQ(lines, good_lines + 1)
+            << bad << " chunk size " << chunk_size;
+      }
+    }
+  }
+}
+
+TEST(LoadObj, OutOfRangeIndex) {
+  std::string text = relative_strip(10) + "f 1/1/1 2/2/2 41/3/3\n";
+  EXPECT_EQ(std::get<0>(parse(text, tiny_chunk_size)), OBJ_ERRC_INSANE);
+  EXPECT_EQ(std::get<0>(parse(relative_strip(11), tiny_chunk_size)),
+            OBJ_ERRC_NONE);
+
+  // Counting back past the first vertex.
+  text = relative_strip(10) + "f -1/-1/-1 -2/-2/-2 -41/-3/-3\n";
+  EXPECT_EQ(std::get<0>(parse(text, tiny_chunk_size)), OBJ_ERRC_INSANE);
+}
+
+}  // namespace
+}  // namespace ballistae
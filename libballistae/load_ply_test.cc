@@ -0,0 +1,353 @@
+#include "libballistae/geometry/load_ply.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace ballistae {
+namespace {
+
+// The body of a binary PLY file, built up value by value.
+struct ply_data {
+  std::string bytes;
+
+  template <class T>
+  ply_data &put(T value) {
+    bytes.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    return *this;
+  }
+};
+
+// A binary little-endian PLY file with the header lines ELEMENTS.
+std::string ply_file(const std::string &elements, const ply_data &data) {
+  return "ply\nformat binary_little_endian 1.0\ncomment made by a test\n" +
+         elements + "end_header\n" + data.bytes;
+}
+
+std::tuple<int, std::size_t, tri_mesh> parse(const std::string &file,
+                                             bool swapyz = false) {
+  return parse_ply(file.data(), file.data() + file.size(), swapyz);
+}
+
+const std::vector<fixvec<float, 3>> square = {
+    {0.0f, 0.0f, 0.0f}, {1.0f, 0.0f, 0.5f}, {1.0f, 1.0f, 1.0f},
+    {0.0f, 1.0f, 1.5f}};
+
+constexpr char float_xyz[] =
+    "property float x\nproperty float y\nproperty float z\n";
+
+// The two triangles of the square, as a list of uchar counts and int
+// indices.
+constexpr char int_faces[] =
+    "element face 2\nproperty list uchar int vertex_indices\n";
+
+void put_int_faces(ply_data *data) {
+  data->put<std::uint8_t>(3).put<std::int32_t>(0).put<std::int32_t>(1)
+      .put<std::int32_t>(2);
+  data->put<std::uint8_t>(3).put<std::int32_t>(0).put<std::int32_t>(2)
+      .put<std::int32_t>(3);
+}
+
+const std::vector<tri_face_idx> square_faces = {{0, 1, 2}, {0, 2, 3}};
+
+TEST(LoadPly, WholeElementCopy) {
+  ply_data data;
+  for (const fixvec<float, 3> &p : square) {
+    data.put(p(0)).put(p(1)).put(p(2));
+  }
+  put_int_faces(&data);
+  std::string file =
+      ply_file("element vertex 4\n" + std::string(float_xyz) + int_faces,
+               data);
+
+  int errc;
+  std::size_t lines;
+  tri_mesh mesh;
+  std::tie(errc, lines, mesh) = parse(file);
+  ASSERT_EQ(errc, PLY_ERRC_NONE);
+  EXPECT_EQ(lines, std::size_t(10));
+  EXPECT_EQ(mesh.v, square);
+  EXPECT_EQ(mesh.fv, square_faces);
+  EXPECT_TRUE(mesh.n.empty());
+  EXPECT_TRUE(mesh.fn.empty());
+  EXPECT_TRUE(mesh.m.empty());
+  EXPECT_TRUE(mesh.fm.empty());
+}
+
+TEST(LoadPly, PackedRecords) {
+  // Positions and normals are runs of floats, but not the whole record.
+  ply_data data;
+  for (const fixvec<float, 3> &p : square) {
+    data.put(0.25f).put(p(0)).put(p(1)).put(p(2));
+    data.put(p(2)).put(p(1)).put(p(0)).put<std::uint8_t>(200);
+  }
+  put_int_faces(&data);
+  std::string file = ply_file(
+      "element vertex 4\nproperty float confidence\n" +
+          std::string(float_xyz) +
+          "property float nx\nproperty float ny\nproperty float nz\n"
+          "property uchar red\n" +
+          int_faces,
+      data);
+
+  int errc;
+  std::size_t lines;
+  tri_mesh mesh;
+  std::tie(errc, lines, mesh) = parse(file);
+  ASSERT_EQ(errc, PLY_ERRC_NONE);
+  EXPECT_EQ(mesh.v, square);
+  ASSERT_EQ(mesh.n.size(), square.size());
+  for (std::size_t i = 0; i < square.size(); ++i) {
+    fixvec<float, 3> reversed = {square[i](2), square[i](1), square[i](0)};
+    EXPECT_EQ(mesh.n[i], reversed) << "vertex " << i;
+  }
+  EXPECT_EQ(mesh.fv, square_faces);
+  EXPECT_EQ(mesh.fn, square_faces);
+}
+
+TEST(LoadPly, ConvertedValues) {
+  // Out of order, and not all float.
+  ply_data data;
+  for (const fixvec<float, 3> &p : square) {
+    data.put(double(p(2))).put(std::int16_t(p(0))).put(p(1));
+    data.put(double(p(0)) / 2).put(float(p(1)) / 2);
+  }
+  put_int_faces(&data);
+  std::string file = ply_file(
+      "element vertex 4\nproperty double z\nproperty short x\n"
+      "property float y\nproperty double s\nproperty float t\n" +
+          std::string(int_faces),
+      data);
+
+  int errc;
+  std::size_t lines;
+  tri_mesh mesh;
+  std::tie(errc, lines, mesh) = parse(file);
+  ASSERT_EQ(errc, PLY_ERRC_NONE);
+  EXPECT_EQ(mesh.v, square);
+  ASSERT_EQ(mesh.m.size(), square.size());
+  for (std::size_t i = 0; i < square.size(); ++i) {
+    fixvec<float, 2> st = {square[i](0) / 2, square[i](1) / 2};
+    EXPECT_EQ(mesh.m[i], st) << "vertex " << i;
+  }
+  EXPECT_EQ(mesh.fm, square_faces);
+}
+
+TEST(LoadPly, FanSplitting) {
+  // A quad, a pentagon, and a triangle, with short indices and a trailing
+  // property, so that no face can be copied as it is.
+  ply_data data;
+  for (int i = 0; i < 6; ++i) {
+    data.put(float(i)).put(float(i * i)).put(float(-i));
+  }
+  data.put<std::uint16_t>(4);
+  for (std::uint16_t k : {0, 1, 2, 3}) data.put(k);
+  data.put<std::uint8_t>(1);
+  data.put<std::uint16_t>(5);
+  for (std::uint16_t k : {5, 4, 3, 2, 1}) data.put(k);
+  data.put<std::uint8_t>(2);
+  data.put<std::uint16_t>(3);
+  for (std::uint16_t k : {1, 3, 5}) data.put(k);
+  data.put<std::uint8_t>(3);
+  std::string file = ply_file(
+      "element vertex 6\n" + std::string(float_xyz) +
+          "element face 3\nproperty list ushort ushort vertex_index\n"
+          "property uchar flags\n",
+      data);
+
+  int errc;
+  std::size_t lines;
+  tri_mesh mesh;
+  std::tie(errc, lines, mesh) = parse(file);
+  ASSERT_EQ(errc, PLY_ERRC_NONE);
+  std::vector<tri_face_idx> expected = {{0, 1, 2}, {0, 2, 3}, {5, 4, 3},
+                                        {5, 3, 2}, {5, 2, 1}, {1, 3, 5}};
+  EXPECT_EQ(mesh.fv, expected);
+
+  // Swapping y and z reverses the winding.
+  std::tie(errc, lines, mesh) = parse(file, true);
+  ASSERT_EQ(errc, PLY_ERRC_NONE);
+  EXPECT_EQ(mesh.fv[0], (tri_face_idx{0, 2, 1}));
+  EXPECT_EQ(mesh.v[2], (fixvec<float, 3>{2.0f, -2.0f, 4.0f}));
+}
+
+TEST(LoadPly, MixedPackedFaces) {
+  // Bare int lists copied as they are, mixed with a quad that isn't.
+  ply_data data;
+  for (const fixvec<float, 3> &p : square) {
+    data.put(p(0)).put(p(1)).put(p(2));
+  }
+  put_int_faces(&data);
+  data.put<std::uint8_t>(4);
+  for (std::int32_t k : {3, 2, 1, 0}) data.put(k);
+  std::string file = ply_file(
+      "element vertex 4\n" + std::string(float_xyz) +
+          "element face 3\nproperty list uchar int vertex_indices\n",
+      data);
+
+  int errc;
+  std::size_t lines;
+  tri_mesh mesh;
+  std::tie(errc, lines, mesh) = parse(file);
+  ASSERT_EQ(errc, PLY_ERRC_NONE);
+  std::vector<tri_face_idx> expected = {
+      {0, 1, 2}, {0, 2, 3}, {3, 2, 1}, {3, 1, 0}};
+  EXPECT_EQ(mesh.fv, expected);
+}
+
+TEST(LoadPly, SkipsOtherElements) {
+  ply_data data;
+  data.put(1.0f).put(2.0f);
+  for (const fixvec<float, 3> &p : square) {
+    data.put(p(0)).put(p(1)).put(p(2));
+  }
+  put_int_faces(&data);
+  data.put<std::uint8_t>(2).put<std::int32_t>(0).put<std::int32_t>(1);
+  std::string file = ply_file(
+      "element camera 2\nproperty float focus\n"
+      "element vertex 4\n" +
+          std::string(float_xyz) + int_faces +
+          "element edge 1\nproperty list uchar int vertex_indices\n",
+      data);
+
+  int errc;
+  std::size_t lines;
+  tri_mesh mesh;
+  std::tie(errc, lines, mesh) = parse(file);
+  ASSERT_EQ(errc, PLY_ERRC_NONE);
+  EXPECT_EQ(mesh.v, square);
+  EXPECT_EQ(mesh.fv, square_faces);
+}
+
+TEST(LoadPly, Truncated) {
+  // Both a file whose faces can be copied as they are, and one whose faces
+  // can't.
+  for (bool packed : {true, false}) {
+    ply_data data;
+    for (const fixvec<float, 3> &p : square) {
+      data.put(p(0)).put(p(1)).put(p(2));
+    }
+    std::size_t vertex_size = data.bytes.size();
+    for (int i = 0; i < 2; ++i) {
+      data.put<std::uint8_t>(3).put<std::int32_t>(0);
+      data.put<std::int32_t>(1 + i).put<std::int32_t>(2 + i);
+      if (!packed) data.put<std::uint8_t>(0);
+    }
+    std::string elements =
+        "element vertex 4\n" + std::string(float_xyz) + int_faces +
+        (packed ? "" : "property uchar flags\n");
+
+    ASSERT_EQ(std::get<0>(parse(ply_file(elements, data))), PLY_ERRC_NONE);
+
+    // Every strict prefix of the data is short of what the header promises.
+    std::string full = data.bytes;
+    for (std::size_t size = 0; size < full.size(); ++size) {
+      data.bytes = full.substr(0, size);
+      int errc;
+      std::size_t lines;
+      tri_mesh mesh;
+      std::tie(errc, lines, mesh) = parse(ply_file(elements, data));
+      EXPECT_EQ(errc, PLY_ERRC_PARSE_ERROR)
+          << (size < vertex_size ? "vertex" : "face") << " data cut to "
+          << size << " bytes, packed " << packed;
+    }
+  }
+}
+
+TEST(LoadPly, RejectsOtherFormats) {
+  for (const char *format : {"ascii", "binary_big_endian"}) {
+    std::string file = std::string("ply\nformat ") + format +
+                       " 1.0\nelement vertex 0\n" + float_xyz +
+                       "end_header\n";
+    int errc;
+    std::size_t lines;
+    tri_mesh mesh;
+    std::tie(errc, lines, mesh) = parse(file);
+    EXPECT_EQ(errc, PLY_ERRC_FILE_NOT_LOADABLE) << format;
+    EXPECT_EQ(lines, std::size_t(2)) << format;
+  }
+}
+
+TEST(LoadPly, HeaderErrorLines) {
+  struct header_case {
+    std::string header;
+    std::size_t line;
+  };
+  const std::string format = "format binary_little_endian 1.0\n";
+  const header_case cases[] = {
+      {"PLY\n" + format + "end_header\n", 1},
+      {"ply\nformat binary_little_endian\nend_header\n", 2},
+      {"ply\n" + format + "element vertex\nend_header\n", 3},
+      {"ply\n" + format + "property float x\nend_header\n", 3},
+      {"ply\n" + format + "comment\nelement vertex 1\nproperty half x\n", 5},
+      {"ply\n" + format + "element face 1\n" +
+           "property list float int vertex_indices\nend_header\n",
+       4},
+      {"ply\n" + format + "element vertex 1\nproperty float\nend_header\n",
+       4},
+      {"ply\n" + format + "element vertex 1\nbogus\nend_header\n", 4},
+      {"ply\nelement vertex 1\nproperty float x\nend_header\n", 4},
+      {"ply\n" + format + "element vertex 1\nproperty float x\n", 5},
+      {"ply\n" + format + "end_header", 3},
+  };
+
+  for (const header_case &c : cases) {
+    int errc;
+    std::size_t lines;
+    tri_mesh mesh;
+    std::tie(errc, lines, mesh) = parse(c.header);
+    EXPECT_EQ(errc, PLY_ERRC_PARSE_ERROR) << c.header;
+    EXPECT_EQ(lines, c.line) << c.header;
+  }
+}
+
+TEST(LoadPly, MissingProperties) {
+  // No z.
+  ply_data data;
+  data.put(0.0f).put(0.0f);
+  std::string file = ply_file(
+      "element vertex 1\nproperty float x\nproperty float y\n", data);
+  EXPECT_EQ(std::get<0>(parse(file)), PLY_ERRC_PARSE_ERROR);
+
+  // Faces without indices.
+  data = ply_data();
+  data.put(0.0f).put(0.0f).put(0.0f).put<std::uint8_t>(0);
+  file = ply_file("element vertex 1\n" + std::string(float_xyz) +
+                      "element face 1\nproperty list uchar int corners\n",
+                  data);
+  EXPECT_EQ(std::get<0>(parse(file)), PLY_ERRC_PARSE_ERROR);
+}
+
+TEST(LoadPly, RejectsBadFaces) {
+  // An index past the last vertex.
+  ply_data data;
+  for (const fixvec<float, 3> &p : square) {
+    data.put(p(0)).put(p(1)).put(p(2));
+  }
+  data.put<std::uint8_t>(3).put<std::int32_t>(0).put<std::int32_t>(1)
+      .put<std::int32_t>(4);
+  std::string file = ply_file(
+      "element vertex 4\n" + std::string(float_xyz) +
+          "element face 1\nproperty list uchar int vertex_indices\n",
+      data);
+  EXPECT_EQ(std::get<0>(parse(file)), PLY_ERRC_INSANE);
+
+  // A face with two corners.
+  data = ply_data();
+  for (const fixvec<float, 3> &p : square) {
+    data.put(p(0)).put(p(1)).put(p(2));
+  }
+  data.put<std::uint8_t>(2).put<std::int32_t>(0).put<std::int32_t>(1);
+  file = ply_file("element vertex 4\n" + std::string(float_xyz) +
+                      "element face 1\nproperty list uchar int "
+                      "vertex_indices\n",
+                  data);
+  EXPECT_EQ(std::get<0>(parse(file)), PLY_ERRC_INSANE);
+}
+
+}  // namespace
+}  // namespace ballistae
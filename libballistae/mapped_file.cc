@@ -0,0 +1,49 @@
+#include "libballistae/mapped_file.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ballistae {
+
+mapped_file::mapped_file(const char *data_in, std::size_t size_in)
+    : data(data_in), size(size_in) {}
+
+mapped_file::~mapped_file() {
+  if (this->data != nullptr) {
+    munmap(const_cast<char *>(this->data), this->size);
+  }
+}
+
+std::unique_ptr<mapped_file> map_file(const std::string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  std::size_t size = std::size_t(info.st_size);
+  if (size == 0) {
+    close(fd);
+    return std::make_unique<mapped_file>(nullptr, 0);
+  }
+
+  void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+  // The mapping holds its own reference to the file.
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  return std::make_unique<mapped_file>(static_cast<const char *>(data), size);
+}
+
+}  // namespace ballistae
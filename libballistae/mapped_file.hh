@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace ballistae {
+
+/// A file mapped read-only into memory.
+///
+/// Pages are read from the file as they are first touched, and are shared
+/// with every other process that maps the same file.
+struct mapped_file {
+  const char *data;
+  std::size_t size;
+
+ public:
+  mapped_file(const char *data_in, std::size_t size_in);
+  ~mapped_file();
+
+  mapped_file(const mapped_file &other) = delete;
+  mapped_file &operator=(const mapped_file &other) = delete;
+};
+
+/// Map the whole of FILENAME.
+///
+/// Returns null if the file can't be opened or mapped.  An empty file maps to
+/// a null DATA with zero SIZE.
+std::unique_ptr<mapped_file> map_file(const std::string &filename);
+
+}  // namespace ballistae
@@ -9,13 +9,22 @@
 
 #include "libballistae/contact.hh"
 #include "libballistae/ray.hh"
+#include "libballistae/sample_rng.hh"
+#include "libballistae/wavelength_packet.hh"
 
 namespace ballistae {
 
+/// The result of shading one contact, with one lane per wavelength in the
+/// packet being shaded.
 struct shade_info {
-  float propagation_k;
-  float emitted_power;
+  packet_values propagation_k;
+  packet_values emitted_power;
   ray incident_ray;
+
+  /// Set when only the hero wavelength can follow incident_ray, for example
+  /// because the material disperses light.  The path then continues for the
+  /// hero alone.
+  bool hero_only = false;
 };
 
 class material {
@@ -24,8 +33,47 @@ class material {
 
   virtual void crush(double time) = 0;
 
-  virtual shade_info shade(const contact &glb_contact, float lambda,
-                           std::mt19937 &thread_rng) const = 0;
+  virtual shade_info shade(const contact &glb_contact,
+                           const wavelength_packet &wavelengths,
+                           sample_rng &rng) const = 0;
+
+  /// Whether the material gives off light.  Scene elements with emissive
+  /// materials are sampled directly as lights.
+  virtual bool emissive() const { return false; }
+
+  /// The power emitted from GLB_CONTACT back along its ray.
+  virtual packet_values emitted(const contact &glb_contact,
+                                const wavelength_packet &wavelengths) const {
+    return packet_fill(wavelengths, 0.0f);
+  }
+
+  /// Whether shade() is the only description of how the material scatters
+  /// light, as for a perfectly specular surface.  Direct lighting is skipped
+  /// at such materials.
+  ///
+  /// Materials that override this to return false must override eval() and
+  /// pdf().
+  virtual bool is_delta() const { return true; }
+
+  /// The BSDF times the cosine of INCIDENT with the surface normal.
+  ///
+  /// Light arrives along INCIDENT, which points away from the surface, and
+  /// leaves back along GLB_CONTACT's ray.  Where pdf() is positive, eval() /
+  /// pdf() must equal the propagation_k that shade() gives to INCIDENT.
+  virtual packet_values eval(const contact &glb_contact,
+                             const fixvec<double, 3> &incident,
+                             const wavelength_packet &wavelengths) const {
+    return packet_fill(wavelengths, 0.0f);
+  }
+
+  /// The density, per steradian, with which shade() picks INCIDENT.
+  ///
+  /// Lane i holds the density that applies when wavelength i is the hero.
+  virtual packet_values pdf(const contact &glb_contact,
+                            const fixvec<double, 3> &incident,
+                            const wavelength_packet &wavelengths) const {
+    return packet_fill(wavelengths, 0.0f);
+  }
 };
 
 }  // namespace ballistae
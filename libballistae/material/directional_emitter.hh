@@ -25,7 +25,7 @@ class directional_emitter : public material {
   virtual void crush(double time) {}
 
   virtual shade_info shade(const contact &glb_contact, float lambda_cur,
-                           std::mt19937 &rng) const {
+                           sample_rng &rng) const {
     using std::max;
 
     const auto &r = glb_contact.r.slope;
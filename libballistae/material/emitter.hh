@@ -26,17 +26,27 @@ class emitter : public material {
 
   virtual void crush(double time) {}
 
-  virtual shade_info shade(const contact &glb_contact, float lambda,
-                           std::mt19937 &rng) const {
-    const auto &mtl2 = glb_contact.mtl2;
-    const auto &mtl3 = glb_contact.mtl3;
-
+  virtual shade_info shade(const contact &glb_contact,
+                           const wavelength_packet &wavelengths,
+                           sample_rng &rng) const {
     shade_info result;
-    result.propagation_k = 0.0f;
-    result.emitted_power = emissivity({mtl2, mtl3, lambda});
+    result.propagation_k = packet_fill(wavelengths, 0.0f);
+    result.emitted_power = emitted(glb_contact, wavelengths);
 
     return result;
   }
+
+  virtual bool emissive() const { return true; }
+
+  virtual packet_values emitted(const contact &glb_contact,
+                                const wavelength_packet &wavelengths) const {
+    const auto &mtl2 = glb_contact.mtl2;
+    const auto &mtl3 = glb_contact.mtl3;
+
+    return packet_map(wavelengths, [&](float lambda) {
+      return float(emissivity({mtl2, mtl3, lambda}));
+    });
+  }
 };
 
 template <class EmissivityFn>
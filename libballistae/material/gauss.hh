@@ -1,7 +1,8 @@
 #ifndef BALLISTAE_MATERIAL_GAUSS_HH
 #define BALLISTAE_MATERIAL_GAUSS_HH
 
-#include <random>
+#include <array>
+#include <cmath>
 
 #include "frustum/indicial/fixed.hh"
 #include "libballistae/dense_signal.hh"
@@ -13,54 +14,100 @@ namespace ballistae {
 
 namespace materials {
 
-template <class Field, size_t D>
-struct gaussian_dist {
-  uniform_unitv_distribution<Field, D> backing_dist;
-  fixvec<Field, D> normal;
-  Field mid;
-  /// Rejection distribution.
-  std::uniform_real_distribution<Field> rejection_dist;
-
-  gaussian_dist(const fixvec<Field, D> normal_in, const Field &mid_in)
-      : normal(normal_in), mid(mid_in), rejection_dist(0, 1) {}
-
-  template <class Gen>
-  fixvec<Field, D> operator()(Gen &g) {
-    using std::exp;
-
-    // By cutting the case variance == 0 from the rejection testing, we
-    // ensure that the loop below will terminate, since the result of exp
-    // will never be NaN.
-
-    // The loop could, however, take a very long time indeed for small
-    // variance values, since the pdf evaluates to zero for larger and
-    // larger fractions of the rejection test interval as v gets larger.
-
-    // In general, for double precision arithmetic, truly problematic values
-    // will start as v gets smaller than ~(1/1400).
-
-    fixvec<Field, D> candidate;
-    Field pdf_val;
-    do {
-      candidate = backing_dist(g);
-      Field cosine = iprod(normal, candidate);
-
-      if (cosine < Field(0)) {
-        candidate = -candidate;
-        cosine = -cosine;
-      }
+/// The GGX (Trowbridge-Reitz) distribution of microfacet normals about a
+/// surface normal, with isotropic roughness ALPHA.
+///
+/// Directions are passed in the local frame, with the surface normal along
+/// +z.  Facets are drawn from the distribution of normals visible from the
+/// outgoing direction (Heitz, "Sampling the GGX Distribution of Visible
+/// Normals", 2018), so that no drawn facet faces away from the viewer.
+template <class Field>
+struct ggx_dist {
+  Field alpha;
+
+  explicit ggx_dist(Field alpha_in) : alpha(alpha_in) {}
+
+  /// The density of facet normals M, per steradian of projected area.
+  Field facet_density(const fixvec<Field, 3> &m) const {
+    Field a2 = alpha * alpha;
+    Field t = m(2) * m(2) * (a2 - 1) + 1;
+    return a2 / (Field(M_PI) * t * t);
+  }
 
-      // PDF is a triangle with peak at `cosine == mid`.
-      if (cosine < mid)
-        pdf_val = cosine / mid;
-      else
-        pdf_val = -(cosine - mid) / (1 - mid) + 1;
-    } while (rejection_dist(g) < pdf_val);
+  /// Smith's auxiliary function for the direction W.
+  Field smith_lambda(const fixvec<Field, 3> &w) const {
+    using std::sqrt;
+    Field cos2 = w(2) * w(2);
+    Field tan2 = (1 - cos2) / cos2;
+    return (sqrt(1 + alpha * alpha * tan2) - 1) / 2;
+  }
+
+  /// The fraction of facets visible from W.
+  Field masking(const fixvec<Field, 3> &w) const {
+    return 1 / (1 + smith_lambda(w));
+  }
+
+  /// The fraction of facets visible from both WO and WI, with masking and
+  /// shadowing correlated through the height of the facet.
+  Field masking_shadowing(const fixvec<Field, 3> &wo,
+                          const fixvec<Field, 3> &wi) const {
+    return 1 / (1 + smith_lambda(wo) + smith_lambda(wi));
+  }
+
+  /// The density, per steradian, with which reflecting WO about a facet drawn
+  /// by visible_facet() gives WI.
+  Field reflection_pdf(const fixvec<Field, 3> &wo,
+                       const fixvec<Field, 3> &wi) const {
+    // D_wo(m) = G1(wo) |wo.m| D(m) / wo.z, and reflection stretches solid
+    // angle by 4 |wo.m|.
+    fixvec<Field, 3> m = normalise(wo + wi);
+    return masking(wo) * facet_density(m) / (4 * wo(2));
+  }
 
-    return candidate;
+  /// Draw a facet normal visible from WO, which must be above the surface.
+  fixvec<Field, 3> visible_facet(const fixvec<Field, 3> &wo,
+                                 const std::array<double, 2> &u) const {
+    using std::cos;
+    using std::max;
+    using std::sin;
+    using std::sqrt;
+
+    // Stretch the view direction onto the hemisphere configuration, where the
+    // visible normals are a projected disk.
+    fixvec<Field, 3> vh = normalise(fixvec<Field, 3>{alpha * wo(0),
+                                                     alpha * wo(1), wo(2)});
+
+    Field len2 = vh(0) * vh(0) + vh(1) * vh(1);
+    fixvec<Field, 3> t1 = len2 > 0 ? fixvec<Field, 3>{-vh(1), vh(0), 0} /
+                                         sqrt(len2)
+                                   : fixvec<Field, 3>{1, 0, 0};
+    fixvec<Field, 3> t2 = cprod(vh, t1);
+
+    Field r = sqrt(u[0]);
+    Field phi = 2 * M_PI * u[1];
+    Field p1 = r * cos(phi);
+    Field p2 = r * sin(phi);
+    Field s = (1 + vh(2)) / 2;
+    p2 = (1 - s) * sqrt(max(Field(0), 1 - p1 * p1)) + s * p2;
+
+    fixvec<Field, 3> nh =
+        p1 * t1 + p2 * t2 +
+        sqrt(max(Field(0), 1 - p1 * p1 - p2 * p2)) * vh;
+
+    // Unstretch.
+    return normalise(fixvec<Field, 3>{alpha * nh(0), alpha * nh(1),
+                                      max(Field(0), nh(2))});
   }
 };
 
+/// A rough reflector, with GGX microfacets.
+///
+/// The roughness comes from VARIANCE, the variance of the facet slopes at each
+/// point and wavelength.  GGX's alpha is taken as sqrt(2 variance), which
+/// matches the slope variance of a Beckmann surface of the same alpha.  Each
+/// facet reflects 0.8 of the light that reaches it.
+///
+/// The surface is two-sided: it reflects on whichever side the ray arrives.
 template <class VarianceFn>
 struct gauss : public material {
   VarianceFn variance;
@@ -71,32 +118,120 @@ struct gauss : public material {
 
   virtual void crush(double time) {}
 
-  virtual shade_info shade(const contact &glb_contact, float lambda,
-                           std::mt19937 &rng) const {
-    const auto &geom_p = glb_contact.p;
-    const auto &refl_s = glb_contact.r.slope;
-    const auto &geom_n = glb_contact.n;
-    const auto &mtl2 = glb_contact.mtl2;
-    const auto &mtl3 = glb_contact.mtl3;
+  /// The facet distribution at the wavelength LAMBDA.
+  ggx_dist<double> facets(const contact &glb_contact, float lambda) const {
+    using std::max;
+    using std::sqrt;
+
+    double v = variance({glb_contact.mtl2, glb_contact.mtl3, lambda});
+    return ggx_dist<double>(max(1e-3, sqrt(2.0 * max(0.0, v))));
+  }
 
-    gaussian_dist<double, 3> facet_n_dist(geom_n,
-                                          variance({mtl2, mtl3, lambda}));
+  /// The outgoing and incident directions at GLB_CONTACT, in a local frame
+  /// whose normal is on the side that the ray arrived from.  Returns false if
+  /// either is below the surface, where nothing is reflected.
+  static bool local_directions(const contact &glb_contact,
+                               const fixvec<double, 3> &incident,
+                               fixvec<double, 3> *wo, fixvec<double, 3> *wi) {
+    fixvec<double, 3> t, b, n;
+    local_frame(glb_contact, &t, &b, &n);
 
-    fixvec<double, 3> facet_n = facet_n_dist(rng);
+    const auto &refl_s = glb_contact.r.slope;
+    *wo = {-iprod(refl_s, t), -iprod(refl_s, b), -iprod(refl_s, n)};
+    *wi = {iprod(incident, t), iprod(incident, b), iprod(incident, n)};
+    return (*wo)(2) > 0.0 && (*wi)(2) > 0.0;
+  }
 
-    // Performance hack.
-    if (iprod(facet_n, refl_s) < 0.0) {
-      facet_n = reflect(facet_n, glb_contact.n);
+  static void local_frame(const contact &glb_contact, fixvec<double, 3> *t,
+                          fixvec<double, 3> *b, fixvec<double, 3> *n) {
+    *n = glb_contact.n;
+    if (iprod(*n, glb_contact.r.slope) > 0.0) {
+      *n = -*n;
     }
+    orthonormal_basis(*n, t, b);
+  }
+
+  virtual shade_info shade(const contact &glb_contact,
+                           const wavelength_packet &wavelengths,
+                           sample_rng &rng) const {
+    fixvec<double, 3> t, b, n;
+    local_frame(glb_contact, &t, &b, &n);
+
+    const auto &refl_s = glb_contact.r.slope;
+    fixvec<double, 3> wo = {-iprod(refl_s, t), -iprod(refl_s, b),
+                            -iprod(refl_s, n)};
 
     shade_info result;
-    result.emitted_power = 0.0f;
-    result.propagation_k = 0.8f;
-    result.incident_ray.point = geom_p;
-    result.incident_ray.slope = reflect(refl_s, facet_n);
+    result.emitted_power = packet_fill(wavelengths, 0.0f);
+    result.propagation_k = packet_fill(wavelengths, 0.0f);
+    result.incident_ray.point = glb_contact.p;
+    result.incident_ray.slope = n;
+
+    // The facet is drawn for the hero wavelength.
+    ggx_dist<double> hero =
+        facets(glb_contact, wavelengths.lambda[wavelengths.hero]);
+    std::array<double, 2> u = uniform_2d(rng);
+    if (!(wo(2) > 0.0)) {
+      return result;
+    }
+
+    fixvec<double, 3> m = hero.visible_facet(wo, u);
+    fixvec<double, 3> wi = 2.0 * iprod(wo, m) * m - wo;
+    result.incident_ray.slope = wi(0) * t + wi(1) * b + wi(2) * n;
+    if (!(wi(2) > 0.0)) {
+      // Reflected into the surface.
+      return result;
+    }
+
+    // Of the facets visible along wo, the fraction G2 / G1 is also visible
+    // along wi.
+    result.propagation_k = packet_fill(
+        wavelengths,
+        float(0.8 * hero.masking_shadowing(wo, wi) / hero.masking(wo)));
+
+    // If the roughness depends on wavelength, the other lanes can't follow
+    // the hero's facet.
+    for (std::size_t i = 0; i < wavelengths.size; ++i) {
+      if (facets(glb_contact, wavelengths.lambda[i]).alpha != hero.alpha) {
+        result.hero_only = true;
+        break;
+      }
+    }
 
     return result;
   }
+
+  virtual bool is_delta() const { return false; }
+
+  virtual packet_values eval(const contact &glb_contact,
+                             const fixvec<double, 3> &incident,
+                             const wavelength_packet &wavelengths) const {
+    fixvec<double, 3> wo, wi;
+    if (!local_directions(glb_contact, incident, &wo, &wi)) {
+      return packet_fill(wavelengths, 0.0f);
+    }
+
+    // F D G2 / (4 cos_o cos_i), times cos_i.
+    fixvec<double, 3> m = normalise(wo + wi);
+    return packet_map(wavelengths, [&](float lambda) {
+      ggx_dist<double> lane = facets(glb_contact, lambda);
+      return float(0.8 * lane.facet_density(m) *
+                   lane.masking_shadowing(wo, wi) / (4.0 * wo(2)));
+    });
+  }
+
+  virtual packet_values pdf(const contact &glb_contact,
+                            const fixvec<double, 3> &incident,
+                            const wavelength_packet &wavelengths) const {
+    fixvec<double, 3> wo, wi;
+    if (!local_directions(glb_contact, incident, &wo, &wi)) {
+      return packet_fill(wavelengths, 0.0f);
+    }
+
+    return packet_map(wavelengths, [&](float lambda) {
+      return float(facets(glb_contact, lambda).reflection_pdf(wo, wi));
+    });
+  }
 };
 
 template <class VarianceFn>
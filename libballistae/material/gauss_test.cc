@@ -0,0 +1,91 @@
+#include "libballistae/material/gauss.hh"
+
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "libballistae/test_directions.hh"
+
+namespace ballistae {
+namespace {
+
+// The hemisphere above the plane z = 0.
+constexpr direction_bins hemisphere = {10, 16, 0.0};
+
+// A contact on the plane z = 0, seen from WO.
+contact contact_from(const fixvec<double, 3> &wo) {
+  contact result;
+  result.t = 1.0;
+  result.r.point = wo;
+  result.r.slope = -wo;
+  result.r.patch_area = 0.0;
+  result.p = {0.0, 0.0, 0.0};
+  result.n = {0.0, 0.0, 1.0};
+  result.mtl2 = {0.0, 0.0};
+  result.mtl3 = {0.0, 0.0, 0.0};
+  return result;
+}
+
+class GgxTest : public ::testing::TestWithParam<std::tuple<double, double>> {};
+
+TEST_P(GgxTest, ReflectionPdfMatchesSamples) {
+  double alpha = std::get<0>(GetParam());
+  double theta_o = std::get<1>(GetParam());
+  materials::ggx_dist<double> dist(alpha);
+  fixvec<double, 3> wo = {std::sin(theta_o), 0.0, std::cos(theta_o)};
+
+  constexpr int total = 400000;
+  std::vector<int> counts(hemisphere.size(), 0);
+  for (int i = 0; i < total; ++i) {
+    sample_rng rng = make_sample_rng(0, 0, 0, i);
+    fixvec<double, 3> m = dist.visible_facet(wo, rng.next_2d());
+    fixvec<double, 3> wi = 2.0 * iprod(wo, m) * m - wo;
+    if (wi(2) > 0.0) ++counts[hemisphere.bin_of(wi)];
+  }
+
+  expect_matching_histogram(
+      hemisphere.integrate([&](const fixvec<double, 3> &wi) {
+        return dist.reflection_pdf(wo, wi);
+      }),
+      counts, total);
+}
+
+INSTANTIATE_TEST_SUITE_P(Roughness, GgxTest,
+                         ::testing::Combine(::testing::Values(0.3, 0.7),
+                                            ::testing::Values(0.2, 1.1)));
+
+TEST(Gauss, PdfMatchesShade) {
+  auto mtl = materials::make_gauss(material_map::make_constant_scalar(0.1f));
+  double theta_o = 0.6;
+  contact glb_contact =
+      contact_from({std::sin(theta_o), 0.0, std::cos(theta_o)});
+  wavelength_packet wavelengths = {{500.0f, 600.0f, 0.0f, 0.0f}, 2, 0};
+
+  constexpr int total = 200000;
+  std::vector<int> counts(hemisphere.size(), 0);
+  for (int i = 0; i < total; ++i) {
+    sample_rng rng = make_sample_rng(1, 2, 3, i);
+    shade_info info = mtl.shade(glb_contact, wavelengths, rng);
+    const fixvec<double, 3> &wi = info.incident_ray.slope;
+    if (info.propagation_k[0] == 0.0f) continue;
+    ++counts[hemisphere.bin_of(wi)];
+
+    // The weight of a sample is eval / pdf.
+    if (i % 1000 == 0) {
+      float f = mtl.eval(glb_contact, wi, wavelengths)[0];
+      float pdf = mtl.pdf(glb_contact, wi, wavelengths)[0];
+      EXPECT_NEAR(info.propagation_k[0], f / pdf, 1e-4) << "sample " << i;
+    }
+  }
+
+  expect_matching_histogram(
+      hemisphere.integrate([&](const fixvec<double, 3> &wi) {
+        return mtl.pdf(glb_contact, wi, wavelengths)[0];
+      }),
+      counts, total);
+}
+
+}  // namespace
+}  // namespace ballistae
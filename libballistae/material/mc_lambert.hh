@@ -1,6 +1,7 @@
 #ifndef BALLISTAE_MATERIAL_MC_LAMBERT_HH
 #define BALLISTAE_MATERIAL_MC_LAMBERT_HH
 
+#include <cmath>
 #include <random>
 
 #include "frustum/indicial/fixed.hh"
@@ -24,24 +25,50 @@ class mc_lambert : public material {
 
   virtual void crush(double time) {}
 
-  virtual shade_info shade(const contact &glb_contact, float lambda,
-                           std::mt19937 &rng) const {
-
+  virtual shade_info shade(const contact &glb_contact,
+                           const wavelength_packet &wavelengths,
+                           sample_rng &rng) const {
     shade_info result;
 
-    hemisphere_unitv_distribution<double, 3> dist(glb_contact.n);
+    cosine_unitv_distribution<double, 3> dist(glb_contact.n);
     auto dir = dist(rng);
 
     result.incident_ray.point = glb_contact.p;
     result.incident_ray.slope = dir;
 
-    float r = reflectance({glb_contact.mtl2, glb_contact.mtl3, lambda});
-    result.propagation_k = float(iprod(glb_contact.n, dir)) * r;
+    // The BRDF is reflectance / pi, and the direction was drawn with density
+    // cos / pi, so only the reflectance is left.
+    result.propagation_k = packet_map(wavelengths, [&](float lambda) {
+      return float(reflectance({glb_contact.mtl2, glb_contact.mtl3, lambda}));
+    });
 
-    result.emitted_power = 0.0f;
+    result.emitted_power = packet_fill(wavelengths, 0.0f);
 
     return result;
   }
+
+  virtual bool is_delta() const { return false; }
+
+  virtual packet_values eval(const contact &glb_contact,
+                             const fixvec<double, 3> &incident,
+                             const wavelength_packet &wavelengths) const {
+    double cosine = iprod(glb_contact.n, incident);
+    if (!(cosine > 0)) {
+      return packet_fill(wavelengths, 0.0f);
+    }
+
+    float weight = float(cosine / M_PI);
+    return packet_map(wavelengths, [&](float lambda) {
+      return weight * reflectance({glb_contact.mtl2, glb_contact.mtl3, lambda});
+    });
+  }
+
+  virtual packet_values pdf(const contact &glb_contact,
+                            const fixvec<double, 3> &incident,
+                            const wavelength_packet &wavelengths) const {
+    cosine_unitv_distribution<double, 3> dist(glb_contact.n);
+    return packet_fill(wavelengths, float(dist.pdf(incident)));
+  }
 };
 
 template <class ReflectanceFn>
@@ -27,8 +27,9 @@ class nc_smooth : public material {
 
   virtual void crush(double time) {}
 
-  virtual shade_info shade(const contact &glb_contact, float lambda,
-                           std::mt19937 &rng) const {
+  virtual shade_info shade(const contact &glb_contact,
+                           const wavelength_packet &wavelengths,
+                           sample_rng &rng) const {
     using std::pow;
     using std::sqrt;
     using std::swap;
@@ -39,10 +40,30 @@ class nc_smooth : public material {
 
     double a_cos = iprod(refl, n);
 
-    double n_a =
-        n_exterior(material_coords{glb_contact.mtl2, glb_contact.mtl3, lambda});
-    double n_b =
-        n_interior(material_coords{glb_contact.mtl2, glb_contact.mtl3, lambda});
+    packet_values lane_n_a = packet_map(wavelengths, [&](float lambda) {
+      return n_exterior(
+          material_coords{glb_contact.mtl2, glb_contact.mtl3, lambda});
+    });
+    packet_values lane_n_b = packet_map(wavelengths, [&](float lambda) {
+      return n_interior(
+          material_coords{glb_contact.mtl2, glb_contact.mtl3, lambda});
+    });
+
+    // Refraction is traced for the hero wavelength.  If the material is
+    // dispersive, the other lanes would refract in other directions, so the
+    // packet collapses onto the hero.
+    double n_a = lane_n_a[wavelengths.hero];
+    double n_b = lane_n_b[wavelengths.hero];
+
+    shade_info result;
+    result.emitted_power = packet_fill(wavelengths, 0.0f);
+    result.propagation_k = packet_fill(wavelengths, 1.0f);
+    for (std::size_t i = 0; i < wavelengths.size; ++i) {
+      if (lane_n_a[i] != n_a || lane_n_b[i] != n_b) {
+        result.hero_only = true;
+        break;
+      }
+    }
 
     if (a_cos > 0.0) {
       swap(n_a, n_b);
@@ -65,10 +86,6 @@ class nc_smooth : public material {
     if (snell < 0.0) {
       // All power was contributed by the reflected ray (total internal
       // reflection).
-
-      shade_info result;
-      result.emitted_power = 0.0f;
-      result.propagation_k = 1.0f;
       result.incident_ray.point = p;
       result.incident_ray.slope = reflect(refl, n);
       return result;
@@ -85,17 +102,11 @@ class nc_smooth : public material {
     double coeff_refl = pow((1 - ab) / (1 + ab), 2);
     double coeff_tran = ab_i * pow(2 / (1 + ab_i), 2);
 
-    std::uniform_real_distribution<> dist(0, coeff_refl + coeff_tran);
-
-    shade_info result;
-    result.emitted_power = 0.0f;
-    if (dist(rng) < coeff_refl) {
+    if (uniform_1d(rng) * (coeff_refl + coeff_tran) < coeff_refl) {
       // Give the ray that contributed by reflection.
-      result.propagation_k = 1.0f;
       result.incident_ray.slope = reflect(refl, n);
     } else {
       // Give the ray that contributed by refraction.
-      result.propagation_k = 1.0f;
       result.incident_ray.slope = (b_cos - n_r * a_cos) * n + n_r * refl;
     }
 
@@ -25,7 +25,7 @@ class normal_highlighter : public material {
   virtual void crush(double time) {}
 
   virtual shade_info<double> shade(const contact<double> &glb_contact,
-                                   float lambda, std::mt19937 &rng) const {
+                                   float lambda, sample_rng &rng) const {
     shade_info<double> result;
     result.emitted_power =
         float(iprod(highlight_direction, glb_contact.n)) *
@@ -20,12 +20,14 @@ class pc_smooth : public material {
 
   virtual void crush(double time) {}
 
-  virtual shade_info shade(const contact &glb_contact, float lambda,
-                           std::mt19937 &rng) const {
+  virtual shade_info shade(const contact &glb_contact,
+                           const wavelength_packet &wavelengths,
+                           sample_rng &rng) const {
     shade_info result;
-    result.emitted_power = 0.0f;
-    result.propagation_k =
-        float(reflectance({glb_contact.mtl2, glb_contact.mtl3, lambda}));
+    result.emitted_power = packet_fill(wavelengths, 0.0f);
+    result.propagation_k = packet_map(wavelengths, [&](float lambda) {
+      return float(reflectance({glb_contact.mtl2, glb_contact.mtl3, lambda}));
+    });
     result.incident_ray.point = glb_contact.p;
     result.incident_ray.slope = reflect(glb_contact.r.slope, glb_contact.n);
 
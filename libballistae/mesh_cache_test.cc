@@ -0,0 +1,301 @@
+#include "libballistae/geometry/mesh_cache.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "libballistae/test_geometry.hh"
+
+namespace ballistae {
+namespace {
+
+std::string read_bytes(const std::string &filename) {
+  std::ifstream in(filename, std::ifstream::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+void write_bytes(const std::string &filename, const std::string &bytes) {
+  std::ofstream out(filename, std::ofstream::binary | std::ofstream::trunc);
+  out.write(bytes.data(), std::streamsize(bytes.size()));
+}
+
+mesh_cache_header get_header(const std::string &bytes) {
+  mesh_cache_header header;
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  return header;
+}
+
+// Store HEADER into BYTES, with a header CRC to match.
+void put_header(mesh_cache_header header, std::string *bytes) {
+  header.header_crc = mesh_cache_header_crc(header);
+  std::memcpy(&(*bytes)[0], &header, sizeof(header));
+}
+
+// The message of the error that reading FILENAME throws, or "" if it reads.
+std::string read_error(const std::string &filename, bool verify_payload) {
+  try {
+    read_mesh_cache(filename, verify_payload);
+  } catch (const std::runtime_error &e) {
+    return e.what();
+  }
+  return "";
+}
+
+template <class T>
+bool same_array(const array_ref<T> &a, const array_ref<T> &b) {
+  return a.size == b.size &&
+         (a.size == 0 || std::memcmp(a.data, b.data, a.size * sizeof(T)) == 0);
+}
+
+class MeshCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    std::mt19937 gen(1);
+    mesh = random_mesh(&gen, 37);
+    crunched = crunch(mesh);
+    view = make_tri_mesh_view(mesh, crunched);
+    filename = ::testing::TempDir() + "mesh_cache_test.bin";
+    write_mesh_cache(filename, view);
+  }
+
+  tri_mesh mesh;
+  tri_mesh_crunched crunched;
+  tri_mesh_view view;
+  std::string filename;
+};
+
+TEST_F(MeshCacheTest, RoundTrip) {
+  for (bool verify_payload : {false, true}) {
+    mesh_cache cache = read_mesh_cache(filename, verify_payload);
+
+    EXPECT_TRUE(same_array(cache.view.v, view.v));
+    EXPECT_TRUE(same_array(cache.view.fv, view.fv));
+    EXPECT_TRUE(same_array(cache.view.wide_nodes, view.wide_nodes));
+    EXPECT_TRUE(same_array(cache.view.blocks, view.blocks));
+    EXPECT_TRUE(same_array(cache.view.leaf_blocks, view.leaf_blocks));
+    for (std::size_t axis = 0; axis < 3; ++axis) {
+      EXPECT_EQ(cache.view.bounds.spans[axis].lo, view.bounds.spans[axis].lo);
+      EXPECT_EQ(cache.view.bounds.spans[axis].hi, view.bounds.spans[axis].hi);
+    }
+    EXPECT_EQ(get_footprint(cache.view).total(), get_footprint(view).total());
+
+    // The mapped mesh is hit exactly where the original is.
+    std::mt19937 gen(2);
+    int hits = 0;
+    for (int trial = 0; trial < 2000; ++trial) {
+      ray_segment query;
+      fixvec<float, 3> p = random_point(&gen, 2.0f);
+      fixvec<float, 3> s = random_point(&gen, 1.0f);
+      query.the_ray.point = {p(0), p(1), p(2)};
+      query.the_ray.slope = normalise(fixvec<double, 3>{
+          -p(0) + 0.5 * s(0), -p(1) + 0.5 * s(1), -p(2) + 0.5 * s(2)});
+      query.the_ray.patch_area = 0.0;
+      query.the_segment = span<double>::pos_half();
+
+      int want = CONTACT_INTO | CONTACT_EXIT;
+      contact expected = tri_mesh_contact(query, view, want);
+      contact actual = tri_mesh_contact(query, cache.view, want);
+      if (std::isnan(expected.t)) {
+        EXPECT_TRUE(std::isnan(actual.t)) << "trial " << trial;
+      } else {
+        ++hits;
+        EXPECT_EQ(actual.t, expected.t) << "trial " << trial;
+        EXPECT_EQ(actual.n, expected.n) << "trial " << trial;
+      }
+      EXPECT_EQ(tri_mesh_occluded(query, cache.view),
+                tri_mesh_occluded(query, view))
+          << "trial " << trial;
+    }
+    EXPECT_GT(hits, 100);
+  }
+}
+
+TEST_F(MeshCacheTest, RejectsTruncated) {
+  std::string bytes = read_bytes(filename);
+  for (std::size_t size :
+       {std::size_t(0), std::size_t(10), sizeof(mesh_cache_header) - 1,
+        sizeof(mesh_cache_header), bytes.size() - 1}) {
+    write_bytes(filename, bytes.substr(0, size));
+    EXPECT_NE(read_error(filename, false), "") << "size " << size;
+  }
+}
+
+TEST_F(MeshCacheTest, RejectsWrongMagic) {
+  std::string bytes = read_bytes(filename);
+  bytes[0] = 'X';
+  write_bytes(filename, bytes);
+  EXPECT_EQ(read_error(filename, false), "not a mesh cache: " + filename);
+}
+
+TEST_F(MeshCacheTest, RejectsCorruptHeader) {
+  std::string bytes = read_bytes(filename);
+  mesh_cache_header header = get_header(bytes);
+  header.bounds[0] += 1.0;
+  std::memcpy(&bytes[0], &header, sizeof(header));
+  write_bytes(filename, bytes);
+  EXPECT_EQ(read_error(filename, false),
+            "mesh cache header is corrupt: " + filename);
+}
+
+TEST_F(MeshCacheTest, RejectsWrongVersion) {
+  std::string bytes = read_bytes(filename);
+  mesh_cache_header header = get_header(bytes);
+  header.version = mesh_cache_version + 1;
+  put_header(header, &bytes);
+  write_bytes(filename, bytes);
+  EXPECT_EQ(read_error(filename, false),
+            "mesh cache was written by an incompatible version: " + filename);
+}
+
+TEST_F(MeshCacheTest, RejectsWrongTypeSize) {
+  std::string bytes = read_bytes(filename);
+  mesh_cache_header header = get_header(bytes);
+  header.block_size += 16;
+  put_header(header, &bytes);
+  write_bytes(filename, bytes);
+  EXPECT_EQ(read_error(filename, false),
+            "mesh cache was written by an incompatible version: " + filename);
+}
+
+TEST_F(MeshCacheTest, RejectsCorruptPayload) {
+  std::string bytes = read_bytes(filename);
+  mesh_cache_header header = get_header(bytes);
+
+  // A vertex moved, which only the payload's CRC can catch.
+  bytes[header.vertices.offset] ^= 1;
+  write_bytes(filename, bytes);
+  EXPECT_EQ(read_error(filename, false), "");
+  EXPECT_EQ(read_error(filename, true), "mesh cache is corrupt: " + filename);
+}
+
+// Write a copy of the cache in which PATCH has changed the arrays, and
+// return the error that reading it without the payload check throws.
+template <class Patch>
+std::string read_patched(const std::string &filename, Patch patch) {
+  std::string bytes = read_bytes(filename);
+  mesh_cache_header header = get_header(bytes);
+  patch(header, &bytes[0]);
+  write_bytes(filename, bytes);
+  return read_error(filename, false);
+}
+
+TEST_F(MeshCacheTest, RejectsOutOfRangeLinks) {
+  std::string original = read_bytes(filename);
+  std::string corrupt = "mesh cache is corrupt: " + filename;
+
+  auto wide_node = [](const mesh_cache_header &h, char *data, std::size_t i) {
+    return reinterpret_cast<kd_wide_node *>(data + h.wide_nodes.offset) + i;
+  };
+
+  // An interior child of the root, and a leaf child that holds faces, if
+  // there is one.
+  const kd_wide_node &root = view.wide_nodes[0];
+  std::size_t interior_slot = kd_wide_node_width;
+  std::size_t leaf_slot = kd_wide_node_width;
+  for (std::size_t slot = 0; slot < kd_wide_node_width; ++slot) {
+    if (root.count[slot] == kd_node::interior) {
+      interior_slot = slot;
+    } else if (root.count[slot] != 0) {
+      leaf_slot = slot;
+    }
+  }
+  ASSERT_LT(interior_slot, kd_wide_node_width);
+
+  // An interior link past the end, and one back to the root.
+  for (std::uint32_t link :
+       {std::uint32_t(view.wide_nodes.size), std::uint32_t(0)}) {
+    write_bytes(filename, original);
+    EXPECT_EQ(read_patched(filename,
+                           [&](const mesh_cache_header &h, char *data) {
+                             wide_node(h, data, 0)->link[interior_slot] = link;
+                           }),
+              corrupt)
+        << "link " << link;
+  }
+
+  // A leaf that runs past the end of the leaf blocks.
+  if (leaf_slot < kd_wide_node_width) {
+    write_bytes(filename, original);
+    EXPECT_EQ(read_patched(filename,
+                           [&](const mesh_cache_header &h, char *data) {
+                             wide_node(h, data, 0)->link[leaf_slot] =
+                                 std::uint32_t(view.leaf_blocks.size);
+                           }),
+              corrupt);
+  }
+
+  // Every leaf's first block past the end of the blocks.
+  write_bytes(filename, original);
+  EXPECT_EQ(read_patched(filename,
+                         [&](const mesh_cache_header &h, char *data) {
+                           auto *first = reinterpret_cast<std::uint32_t *>(
+                               data + h.leaf_blocks.offset);
+                           std::fill(first, first + h.leaf_blocks.count,
+                                     std::uint32_t(h.blocks.count));
+                         }),
+            corrupt);
+
+  // A block lane naming a face past the end.
+  write_bytes(filename, original);
+  EXPECT_EQ(read_patched(filename,
+                         [&](const mesh_cache_header &h, char *data) {
+                           auto *blocks = reinterpret_cast<tri_block *>(
+                               data + h.blocks.offset);
+                           blocks[0].face[0] = std::uint32_t(h.faces.count);
+                         }),
+            corrupt);
+
+  // A used lane marked unused, which would be hit and then looked up.
+  write_bytes(filename, original);
+  EXPECT_EQ(read_patched(filename,
+                         [&](const mesh_cache_header &h, char *data) {
+                           auto *blocks = reinterpret_cast<tri_block *>(
+                               data + h.blocks.offset);
+                           blocks[0].face[0] = UINT32_MAX;
+                         }),
+            corrupt);
+
+  // An unused lane with one finite coordinate.
+  std::size_t unused_block = view.blocks.size;
+  std::size_t unused_lane = 0;
+  for (std::size_t i = 0; i < view.blocks.size; ++i) {
+    for (std::size_t lane = 0; lane < tri_block_width; ++lane) {
+      if (view.blocks[i].face[lane] == UINT32_MAX) {
+        unused_block = i;
+        unused_lane = lane;
+      }
+    }
+  }
+  ASSERT_LT(unused_block, view.blocks.size);
+  write_bytes(filename, original);
+  EXPECT_EQ(read_patched(filename,
+                         [&](const mesh_cache_header &h, char *data) {
+                           auto *blocks = reinterpret_cast<tri_block *>(
+                               data + h.blocks.offset);
+                           blocks[unused_block].v2[1][unused_lane] = 0.5f;
+                         }),
+            corrupt);
+
+  // A face naming a vertex past the end.
+  write_bytes(filename, original);
+  EXPECT_EQ(read_patched(filename,
+                         [&](const mesh_cache_header &h, char *data) {
+                           auto *faces = reinterpret_cast<tri_face_idx *>(
+                               data + h.faces.offset);
+                           faces[5][1] = std::uint32_t(h.vertices.count);
+                         }),
+            corrupt);
+}
+
+}  // namespace
+}  // namespace ballistae
@@ -1,59 +1,292 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <fstream>
-#include <future>
-#include <thread>
+#include <limits>
+#include <mutex>
 
 #include "libballistae/render_scene.hh"
 #include "libballistae/spectral_image.hh"
+#include "libballistae/thread_pool.hh"
 
 namespace ballistae {
 
-shade_info shade_ray(const scene &the_scene, const ray &reflected_ray,
-                     float lambda_cur, std::mt19937 &rng) {
-  ray_segment refl_query = {
-      reflected_ray,
-      {epsilon<double>(), std::numeric_limits<double>::infinity()}};
+/// The multiple importance sampling weight of a sample drawn with density
+/// PDF, when the other strategy would have drawn it with density OTHER_PDF.
+float mis_weight(mis_heuristic heuristic, double pdf, double other_pdf) {
+  if (!(pdf > 0)) {
+    return 0.0f;
+  }
 
-  contact glb_contact;
-  const crushed_scene_element *hit_element;
-  std::tie(glb_contact, hit_element) =
-      scene_ray_intersect(the_scene, refl_query);
+  // Written in terms of the ratio, so that infinite densities (from a light
+  // seen edge-on) don't overflow.
+  double ratio = other_pdf / pdf;
+  if (heuristic == mis_heuristic::power) {
+    ratio *= ratio;
+  }
+  return float(1.0 / (1.0 + ratio));
+}
 
-  if (hit_element != nullptr) {
-    auto shade_result =
-        hit_element->the_material->shade(glb_contact, lambda_cur, rng);
+/// Estimate the power arriving at GLB_CONTACT straight from a point on one of
+/// the scene's lights, and leaving back along GLB_CONTACT's ray.
+///
+/// The estimate is weighted against the paths that THE_MATERIAL's own
+/// sampling would find on the same lights.
+packet_values sample_direct(const scene &the_scene, const contact &glb_contact,
+                            const material &the_material,
+                            const wavelength_packet &wavelengths,
+                            mis_heuristic heuristic, sample_rng &rng) {
+  using std::abs;
+
+  light_sample light = scene_sample_light(the_scene, rng);
+
+  fixvec<double, 3> to_light = light.point.p - glb_contact.p;
+  double dist = norm(to_light);
+  if (!(dist > 0)) {
+    return packet_fill(wavelengths, 0.0f);
+  }
+  fixvec<double, 3> dir = to_light / dist;
 
-    return shade_result;
-  } else {
-    return shade_info{0.0, 0, {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}}};
+  double light_cosine = abs(iprod(light.point.n, dir));
+  packet_values bsdf = the_material.eval(glb_contact, dir, wavelengths);
+  bool reflects = false;
+  for (std::size_t j = 0; j < wavelengths.size; ++j) {
+    reflects = reflects || bsdf[j] != 0.0f;
   }
+  if (!(light_cosine > 0) || !reflects) {
+    return packet_fill(wavelengths, 0.0f);
+  }
+
+  // Stop short of the light itself.
+  ray_segment shadow_query = {{glb_contact.p, dir},
+                              {epsilon<double>(), dist * (1.0 - 1e-6)}};
+  if (scene_ray_occluded(the_scene, shadow_query)) {
+    return packet_fill(wavelengths, 0.0f);
+  }
+
+  light.point.t = dist;
+  light.point.r = shadow_query.the_ray;
+  packet_values emitted =
+      light.element->the_material->emitted(light.point, wavelengths);
+
+  // Convert the density from area to solid angle at GLB_CONTACT.
+  double light_pdf = light.pdf_area * dist * dist / light_cosine;
+  packet_values bsdf_pdf = the_material.pdf(glb_contact, dir, wavelengths);
+
+  packet_values result = {};
+  for (std::size_t j = 0; j < wavelengths.size; ++j) {
+    float weight = mis_weight(heuristic, light_pdf, bsdf_pdf[j]);
+    result[j] = bsdf[j] * emitted[j] * float(weight / light_pdf);
+  }
+  return result;
 }
 
-float sample_ray(const ray &initial_query, const scene &the_scene,
-                 float lambda_cur, std::mt19937 &rng, size_t depth_lim) {
-  float accum_power = 0.0;
-  float cur_k = 1.0;
+packet_values sample_ray(const ray &initial_query, const scene &the_scene,
+                         const wavelength_packet &wavelengths,
+                         const options &the_options, sample_rng &rng) {
+  using std::abs;
+  using std::max;
+  using std::min;
+
+  size_t depth_lim = the_options.maxdepth;
+  mis_heuristic heuristic = the_options.heuristic;
+
+  packet_values accum_power = {};
+  packet_values cur_k = packet_fill(wavelengths, 1.0f);
+  bool collapsed = false;
   ray cur_ray = initial_query;
 
-  for (size_t i = 0; i < depth_lim && cur_k != 0.0; ++i) {
-    shade_info shading = shade_ray(the_scene, cur_ray, lambda_cur, rng);
+  // Whether the previous vertex also sampled the scene's lights directly.  If
+  // so, light that the path finds on them is weighted against those samples,
+  // using the density with which the previous vertex picked cur_ray.
+  bool lights_sampled = false;
+  packet_values cur_ray_pdf = {};
+
+  bool direct_lighting =
+      the_options.direct_lighting && !the_scene.lights.empty();
+
+  auto carries_power = [&]() {
+    for (std::size_t i = 0; i < wavelengths.size; ++i) {
+      if (cur_k[i] != 0.0f) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  for (size_t i = 0; i < depth_lim && carries_power(); ++i) {
+    ray_segment query = {
+        cur_ray, {epsilon<double>(), std::numeric_limits<double>::infinity()}};
+
+    contact glb_contact;
+    const crushed_scene_element *hit_element;
+    std::tie(glb_contact, hit_element) = scene_ray_intersect(the_scene, query);
+    if (hit_element == nullptr) {
+      break;
+    }
+
+    const material &hit_material = *(hit_element->the_material);
+    shade_info shading = hit_material.shade(glb_contact, wavelengths, rng);
+
+    if (lights_sampled && hit_element->is_light) {
+      double dist = norm(glb_contact.p - cur_ray.point);
+      double light_cosine = abs(iprod(glb_contact.n, cur_ray.slope));
+      double light_pdf =
+          scene_light_pdf_area(the_scene, *hit_element, glb_contact.n) * dist *
+          dist / light_cosine;
+      for (std::size_t j = 0; j < wavelengths.size; ++j) {
+        float weight = mis_weight(heuristic, cur_ray_pdf[j], light_pdf);
+        accum_power[j] += cur_k[j] * shading.emitted_power[j] * weight;
+      }
+    } else {
+      for (std::size_t j = 0; j < wavelengths.size; ++j) {
+        accum_power[j] += cur_k[j] * shading.emitted_power[j];
+      }
+    }
+
+    // Only look for lights that the unidirectional path could still reach
+    // within the depth limit.
+    lights_sampled = direct_lighting && i + 1 < depth_lim &&
+                     !hit_material.is_delta();
+    if (lights_sampled) {
+      packet_values direct =
+          sample_direct(the_scene, glb_contact, hit_material, wavelengths,
+                        heuristic, rng);
+      for (std::size_t j = 0; j < wavelengths.size; ++j) {
+        accum_power[j] += cur_k[j] * direct[j];
+      }
 
-    accum_power += cur_k * shading.emitted_power;
-    cur_k = shading.propagation_k;
+      cur_ray_pdf = hit_material.pdf(
+          glb_contact, shading.incident_ray.slope, wavelengths);
+    }
+
+    for (std::size_t j = 0; j < wavelengths.size; ++j) {
+      cur_k[j] *= shading.propagation_k[j];
+    }
     cur_ray = shading.incident_ray;
+
+    // The packet collapses at most once; after that, only the hero lane is
+    // carrying power.
+    if (shading.hero_only && !collapsed) {
+      collapse_to_hero(wavelengths, &cur_k);
+      collapsed = true;
+    }
+
+    // Russian roulette: past the minimum depth, the path survives with
+    // probability equal to its largest throughput, and survivors are scaled
+    // up to make up for the paths that were dropped.
+    if (i + 1 >= the_options.roulette_depth && i + 1 < depth_lim) {
+      float largest_k = 0.0f;
+      for (std::size_t j = 0; j < wavelengths.size; ++j) {
+        largest_k = max(largest_k, cur_k[j]);
+      }
+
+      float survival = min(largest_k, 1.0f);
+      if (survival < 1.0f) {
+        if (!(uniform_1d(rng) < survival)) {
+          break;
+        }
+        for (std::size_t j = 0; j < wavelengths.size; ++j) {
+          cur_k[j] /= survival;
+        }
+      }
+    }
   }
 
   return accum_power;
 }
 
-struct chunk_worker {
-  spectral_image sample_db;
+// Adaptive sampling sorts bins into buckets by their relative error, with
+// four buckets per doubling.  Bucket 0 holds errors below 2^-32.
+constexpr std::size_t error_bucket_count = 256;
+
+std::size_t error_bucket(float error) {
+  using std::log2;
+
+  if (!(error < std::numeric_limits<float>::infinity())) {
+    return error_bucket_count - 1;
+  }
+  if (error <= 0.0f) {
+    return 0;
+  }
+
+  float bucket = 4.0f * (log2(error) + 32.0f);
+  if (bucket < 0.0f) {
+    return 0;
+  }
+  return std::min(std::size_t(bucket), error_bucket_count - 1);
+}
+
+/// Take up to WANT samples from BUDGET, returning the number taken.
+std::size_t claim_budget(std::atomic<std::size_t> *budget, std::size_t want) {
+  std::size_t available = budget->load();
+  std::size_t taken;
+  do {
+    taken = std::min(available, want);
+  } while (!budget->compare_exchange_weak(available, available - taken));
+  return taken;
+}
+
+/// Shared state that tells every worker when the render should stop.
+struct render_limits {
+  std::chrono::steady_clock::time_point deadline;
+  const cancellation_token *cancel;
+
+  /// The number of samples that may still be recorded.
+  std::atomic<std::size_t> budget;
+
+  std::atomic<bool> stopped;
+
+  bool should_stop();
+};
+
+bool render_limits::should_stop() {
+  if (this->stopped.load()) {
+    return true;
+  }
+
+  if ((this->cancel != nullptr && this->cancel->is_cancelled()) ||
+      std::chrono::steady_clock::now() >= this->deadline) {
+    this->stopped.store(true);
+    return true;
+  }
 
-  std::mt19937 rng;
+  return false;
+}
+
+/// Take up to PACKETS packets of LANES samples each from BUDGET, returning
+/// the number of packets taken.
+std::size_t claim_packets(std::atomic<std::size_t> *budget, std::size_t packets,
+                          std::size_t lanes) {
+  std::size_t claimed = claim_budget(budget, packets * lanes);
+
+  // Hand back any partial packet.
+  std::size_t taken = claimed / lanes;
+  if (claimed != taken * lanes) {
+    budget->fetch_add(claimed - taken * lanes);
+  }
+  return taken;
+}
+
+struct chunk_worker {
+  spectral_image_view sample_db;
 
   std::function<void(std::size_t)> progress_function;
 
-  std::size_t maxdepth;
-  std::size_t target_samples;
+  render_limits *limits;
+
+  const options *the_options;
+
+  /// Wavelength bins are traced in packets.  Packet g holds bins g, g +
+  /// packet_count, g + 2 * packet_count, and so on, spreading each packet
+  /// across the spectrum.
+  std::size_t packet_count;
+
+  float adaptive_threshold;
+  std::size_t adaptive_round_samples;
+  std::size_t adaptive_max_subsamples;
 
   std::size_t img_rows;
   std::size_t img_cols;
@@ -67,40 +300,182 @@ struct chunk_worker {
   camera const *the_camera;
   scene const *the_scene;
 
-  void render();
+  void render(std::size_t target_samples);
+
+  bool adaptive_candidate(const spectral_image::sample &samp) const;
+
+  /// Find the noisiest bin of packet G that adaptive sampling should refine.
+  ///
+  /// Returns false if there is none.
+  bool adaptive_packet(std::size_t r, std::size_t c, std::size_t g,
+                       spectral_image::sample *worst);
+
+  void count_adaptive_candidates(
+      std::array<std::size_t, error_bucket_count> *histogram);
+
+  void render_adaptive(std::size_t min_bucket,
+                       std::atomic<std::size_t> *budget);
+
+  std::size_t packet_lanes(std::size_t g) const;
+
+  std::size_t sample_packet(std::size_t r, std::size_t c, std::size_t g,
+                            std::size_t samples_to_add);
 };
 
-void chunk_worker::render() {
+std::size_t chunk_worker::packet_lanes(std::size_t g) const {
+  std::size_t w = this->sample_db.wavelength_size();
+  return (w - g + this->packet_count - 1) / this->packet_count;
+}
+
+std::size_t chunk_worker::sample_packet(std::size_t r, std::size_t c,
+                                        std::size_t g,
+                                        std::size_t samples_to_add) {
+  std::size_t lanes = this->packet_lanes(g);
+
+  std::size_t wanted = samples_to_add;
+  samples_to_add = claim_packets(&this->limits->budget, wanted, lanes);
+  if (samples_to_add < wanted) {
+    this->limits->stopped.store(true);
+  }
+
+  std::size_t cr = r + this->row_src;
+  std::size_t cc = c + this->col_src;
+
+  wavelength_packet wavelengths;
+  wavelengths.lambda.fill(0.0f);
+  wavelengths.size = lanes;
+  for (std::size_t i = 0; i < lanes; ++i) {
+    wavelengths.lambda[i] =
+        this->sample_db.wavelength_bin(g + i * this->packet_count).lo;
+  }
+
+  // Samples are numbered by how many the packet's first bin already holds, so
+  // each one draws the same random numbers however the render is scheduled,
+  // split up, or resumed.
+  std::size_t sample_src =
+      std::size_t(this->sample_db.read_sample(r, c, g).power_density_count);
+
+  for (std::size_t cs = 0; cs < samples_to_add; ++cs) {
+    sample_rng rng = make_sample_rng(cr, cc, g, sample_src + cs);
+
+    wavelengths.hero =
+        std::min(std::size_t(uniform_1d(rng) * lanes), lanes - 1);
+
+    ray cur_query = this->the_camera->image_to_ray(cr, this->img_rows, cc,
+                                                   this->img_cols, rng);
+
+    // We get a power density sample, in W / m^2, for each wavelength.
+    packet_values sampled_power = sample_ray(
+        cur_query, *(this->the_scene), wavelengths, *(this->the_options), rng);
+
+    for (std::size_t i = 0; i < lanes; ++i) {
+      this->sample_db.record_sample(r, c, g + i * this->packet_count,
+                                    sampled_power[i]);
+    }
+  }
+
+  return samples_to_add * lanes;
+}
+
+void chunk_worker::render(std::size_t target_samples) {
   std::size_t samples_collected = 0;
-  for (std::size_t cr = this->row_src; cr < this->row_lim; ++cr) {
-    for (std::size_t cc = this->col_src; cc < this->col_lim; ++cc) {
-      for (std::size_t cw = 0; cw < this->sample_db.wavelength_size; ++cw) {
-        std::size_t r = cr - this->row_src;
-        std::size_t c = cc - this->col_src;
-
-        spectral_image::sample samp = this->sample_db.read_sample(r, c, cw);
-        if (samp.power_density_count >= this->target_samples) {
+  for (std::size_t r = 0; r < this->sample_db.row_size(); ++r) {
+    for (std::size_t c = 0; c < this->sample_db.col_size(); ++c) {
+      if (this->limits->should_stop()) {
+        this->progress_function(samples_collected);
+        return;
+      }
+
+      for (std::size_t g = 0; g < this->packet_count; ++g) {
+        // Top up the least-sampled bin of the packet.
+        float least_count = std::numeric_limits<float>::infinity();
+        for (std::size_t cw = g; cw < this->sample_db.wavelength_size();
+             cw += this->packet_count) {
+          spectral_image::sample samp = this->sample_db.read_sample(r, c, cw);
+          least_count = std::min(least_count, samp.power_density_count);
+        }
+
+        if (least_count >= target_samples) {
           continue;
         }
-        std::size_t samples_to_add =
-            this->target_samples - samp.power_density_count;
+        std::size_t samples_to_add = target_samples - least_count;
 
-        for (std::size_t cs = 0; cs < samples_to_add; ++cs) {
-          float lambda_cur = this->sample_db.wavelength_bin(cw).lo;
+        samples_collected += this->sample_packet(r, c, g, samples_to_add);
+      }
+    }
 
-          ray cur_query = this->the_camera->image_to_ray(
-              cr, this->img_rows, cc, this->img_cols, this->rng);
+    this->progress_function(samples_collected);
+    samples_collected = 0;
+  }
+}
 
-          // We get a power density sample, in W / m^2
-          float sampled_power =
-              sample_ray(cur_query, *(this->the_scene), lambda_cur, this->rng,
-                         this->maxdepth);
+bool chunk_worker::adaptive_candidate(
+    const spectral_image::sample &samp) const {
+  return samp.power_density_count < this->adaptive_max_subsamples &&
+         relative_error(samp) > this->adaptive_threshold;
+}
 
-          this->sample_db.record_sample(r, c, cw, sampled_power);
-          samples_collected++;
+bool chunk_worker::adaptive_packet(std::size_t r, std::size_t c, std::size_t g,
+                                   spectral_image::sample *worst) {
+  bool found = false;
+  for (std::size_t cw = g; cw < this->sample_db.wavelength_size();
+       cw += this->packet_count) {
+    spectral_image::sample samp = this->sample_db.read_sample(r, c, cw);
+    if (this->adaptive_candidate(samp) &&
+        (!found || relative_error(samp) > relative_error(*worst))) {
+      *worst = samp;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void chunk_worker::count_adaptive_candidates(
+    std::array<std::size_t, error_bucket_count> *histogram) {
+  histogram->fill(0);
+  for (std::size_t r = 0; r < this->sample_db.row_size(); ++r) {
+    for (std::size_t c = 0; c < this->sample_db.col_size(); ++c) {
+      for (std::size_t g = 0; g < this->packet_count; ++g) {
+        spectral_image::sample worst;
+        if (this->adaptive_packet(r, c, g, &worst)) {
+          (*histogram)[error_bucket(relative_error(worst))] +=
+              this->adaptive_round_samples * this->packet_lanes(g);
         }
       }
     }
+  }
+}
+
+void chunk_worker::render_adaptive(std::size_t min_bucket,
+                                   std::atomic<std::size_t> *budget) {
+  using std::min;
+
+  std::size_t samples_collected = 0;
+  for (std::size_t r = 0; r < this->sample_db.row_size(); ++r) {
+    for (std::size_t c = 0; c < this->sample_db.col_size(); ++c) {
+      if (this->limits->should_stop()) {
+        this->progress_function(samples_collected);
+        return;
+      }
+
+      for (std::size_t g = 0; g < this->packet_count; ++g) {
+        spectral_image::sample worst;
+        if (!this->adaptive_packet(r, c, g, &worst) ||
+            error_bucket(relative_error(worst)) < min_bucket) {
+          continue;
+        }
+
+        std::size_t samples_to_add =
+            min(this->adaptive_round_samples,
+                this->adaptive_max_subsamples -
+                    std::size_t(worst.power_density_count));
+
+        samples_to_add =
+            claim_packets(budget, samples_to_add, this->packet_lanes(g));
+
+        samples_collected += this->sample_packet(r, c, g, samples_to_add);
+      }
+    }
 
     this->progress_function(samples_collected);
     samples_collected = 0;
@@ -130,48 +505,164 @@ void render_scene(options const &the_options, spectral_image *sample_db,
   if (want_samples > existing_samples) {
     total_samples = want_samples - existing_samples;
   }
+  if (the_options.sample_budget != 0 &&
+      (total_samples == 0 || the_options.sample_budget < total_samples)) {
+    total_samples = the_options.sample_budget;
+  }
 
-  auto processor_count = std::thread::hardware_concurrency();
-  if (processor_count == 0) {
-    processor_count = 1;
+  render_limits limits;
+  limits.deadline = the_options.deadline;
+  limits.cancel = the_options.cancel;
+  limits.budget = the_options.sample_budget == 0
+                      ? std::numeric_limits<std::size_t>::max()
+                      : the_options.sample_budget;
+  limits.stopped = false;
+
+  // Group the wavelength bins into as few packets as the packet size allows.
+  std::size_t packet_size =
+      std::clamp<std::size_t>(the_options.wavelength_packet_size, 1,
+                              wavelength_packet_capacity);
+  std::size_t packet_count =
+      (sample_db->wavelength_size + packet_size - 1) / packet_size;
+
+  std::size_t tile_size = the_options.tile_size;
+  if (tile_size == 0) {
+    tile_size = 1;
   }
 
-  // We chunk work by rows.
-  std::size_t work_unit = sample_db->row_size / processor_count;
+  // We chunk work into small square tiles, so that expensive regions of the
+  // image are spread across many tasks, and the pool's work stealing keeps
+  // every thread busy until the last tile is done.
+  std::vector<std::unique_ptr<chunk_worker>> workers;
+  for (std::size_t row_src = 0; row_src < sample_db->row_size;
+       row_src += tile_size) {
+    for (std::size_t col_src = 0; col_src < sample_db->col_size;
+         col_src += tile_size) {
+      auto worker = std::make_unique<chunk_worker>();
+      worker->progress_function = [&](std::size_t sub_progress) {
+        std::scoped_lock lock{progress_mutex};
+        cur_progress += sub_progress;
+        progress_function(cur_progress, total_samples);
+      };
+      worker->limits = &limits;
+      worker->the_options = &the_options;
+      worker->packet_count = packet_count;
+      worker->adaptive_threshold = the_options.adaptive_threshold;
+      worker->adaptive_round_samples =
+          std::max<std::size_t>(the_options.adaptive_round_samples, 1);
+      worker->adaptive_max_subsamples = the_options.adaptive_max_subsamples;
+      worker->img_rows = sample_db->row_size;
+      worker->img_cols = sample_db->col_size;
+      worker->row_src = row_src;
+      worker->row_lim = min(row_src + tile_size, sample_db->row_size);
+      worker->col_src = col_src;
+      worker->col_lim = min(col_src + tile_size, sample_db->col_size);
+      worker->the_camera = &the_camera;
+      worker->the_scene = &the_scene;
+      worker->sample_db = sample_db->view(worker->row_src, worker->row_lim,
+                                          worker->col_src, worker->col_lim);
+      workers.push_back(std::move(worker));
+    }
+  }
+
+  // Tiles are disjoint, so each task accumulates straight into sample_db
+  // without synchronizing with the others.
+  task_group tasks(&thread_pool::shared());
+  auto render_pass = [&](std::size_t target_samples) {
+    for (auto &worker : workers) {
+      chunk_worker *w = worker.get();
+      tasks.run([w, target_samples]() { w->render(target_samples); });
+    }
+    tasks.wait();
+  };
+
+  if (the_options.progressive) {
+    // Without any limit, an open-ended progressive render would never finish.
+    bool limited = the_options.deadline != options().deadline ||
+                   the_options.sample_budget != 0 ||
+                   the_options.cancel != nullptr;
+
+    std::size_t pass_lim = the_options.target_subsamples;
+    if (pass_lim == 0) {
+      pass_lim = limited ? std::numeric_limits<std::size_t>::max() : 0;
+    }
 
-  std::vector<std::future<std::unique_ptr<chunk_worker>>> tasks;
-  for (std::size_t i = 0; i < processor_count; ++i) {
-    auto worker = std::make_unique<chunk_worker>();
-    // TODO: Think about how to make this more repeatable.
-    worker->rng = std::mt19937(existing_samples);
-    worker->progress_function = [&](std::size_t sub_progress) {
+    // Bins that are already past a pass are skipped, so begin just above the
+    // least-sampled bin.
+    float least_count = std::numeric_limits<float>::infinity();
+    for (float count : sample_db->power_density_counts) {
+      least_count = std::min(least_count, count);
+    }
+
+    if (least_count < float(pass_lim)) {
+      for (std::size_t pass = std::size_t(least_count) + 1;
+           pass <= pass_lim && !limits.should_stop(); ++pass) {
+        render_pass(pass);
+      }
+    }
+  } else {
+    render_pass(the_options.target_subsamples);
+  }
+
+  if (the_options.adaptive_threshold <= 0.0f ||
+      !sample_db->tracks_variance || limits.should_stop()) {
+    return;
+  }
+
+  // Adaptive sampling.  Each round, we find the bins whose estimated relative
+  // error is above the threshold, and give more samples to as many of the
+  // noisiest ones as the remaining budget allows.
+  std::atomic<std::size_t> budget(the_options.adaptive_budget == 0
+                                      ? std::numeric_limits<std::size_t>::max()
+                                      : the_options.adaptive_budget);
+  while (budget.load() != 0 && !limits.should_stop()) {
+    std::vector<std::array<std::size_t, error_bucket_count>> histograms(
+        workers.size());
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+      chunk_worker *w = workers[i].get();
+      auto *histogram = &histograms[i];
+      tasks.run([w, histogram]() { w->count_adaptive_candidates(histogram); });
+    }
+    tasks.wait();
+
+    std::array<std::size_t, error_bucket_count> histogram;
+    histogram.fill(0);
+    for (const auto &h : histograms) {
+      for (std::size_t i = 0; i < error_bucket_count; ++i) {
+        histogram[i] += h[i];
+      }
+    }
+
+    // Walk down from the noisiest bucket until the candidates would overrun
+    // the budget.  We always take at least the noisiest bucket, so that each
+    // round makes progress.
+    std::size_t round_wanted = 0;
+    std::size_t min_bucket = error_bucket_count;
+    while (min_bucket != 0) {
+      std::size_t next = round_wanted + histogram[min_bucket - 1];
+      if (round_wanted != 0 && next > budget.load()) {
+        break;
+      }
+      round_wanted = next;
+      --min_bucket;
+    }
+
+    if (round_wanted == 0) {
+      break;
+    }
+
+    {
       std::scoped_lock lock{progress_mutex};
-      cur_progress += sub_progress;
-      progress_function(cur_progress, total_samples);
-    };
-    worker->maxdepth = the_options.maxdepth;
-    worker->target_samples = the_options.target_subsamples;
-    worker->img_rows = sample_db->row_size;
-    worker->img_cols = sample_db->col_size;
-    worker->row_src = i * work_unit;
-    worker->row_lim = min((i + 1) * work_unit, sample_db->row_size);
-    worker->col_src = 0;
-    worker->col_lim = sample_db->col_size;
-    worker->the_camera = &the_camera;
-    worker->the_scene = &the_scene;
-    sample_db->cut(&(worker->sample_db), worker->row_src, worker->row_lim, 0,
-                   sample_db->col_size);
-
-    auto fn = [](std::unique_ptr<chunk_worker> worker) {
-      worker->render();
-      return worker;
-    };
-    tasks.emplace_back(std::async(std::launch::async, fn, std::move(worker)));
-  }
-
-  for (auto &task : tasks) {
-    auto worker = task.get();
-    sample_db->paste(&(worker->sample_db), worker->row_src, 0);
+      total_samples += min(round_wanted, budget.load());
+    }
+
+    for (auto &worker : workers) {
+      chunk_worker *w = worker.get();
+      tasks.run([w, min_bucket, &budget]() {
+        w->render_adaptive(min_bucket, &budget);
+      });
+    }
+    tasks.wait();
   }
 }
 
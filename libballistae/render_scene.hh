@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <functional>
 
@@ -8,12 +10,85 @@
 #include "libballistae/scene.hh"
 #include "libballistae/span.hh"
 #include "libballistae/spectral_image.hh"
+#include "libballistae/wavelength_packet.hh"
 
 namespace ballistae {
 
+/// A flag that stops a render early when raised.
+///
+/// It may be raised from any thread, or from a signal handler.
+struct cancellation_token {
+  std::atomic<bool> cancelled{false};
+
+  void cancel() { cancelled.store(true); }
+
+  bool is_cancelled() const { return cancelled.load(); }
+};
+
+/// How light samples and BSDF samples that find the same light are weighted
+/// against each other (Veach's multiple importance sampling heuristics).
+enum class mis_heuristic {
+  balance,
+  power,
+};
+
 struct options {
   size_t maxdepth;
   size_t target_subsamples;
+
+  /// Russian roulette.  After roulette_depth bounces, each path continues
+  /// with probability equal to its largest per-wavelength throughput (capped
+  /// at one), and the paths that continue are weighted up to compensate.
+  /// Setting roulette_depth to maxdepth or more turns it off.
+  size_t roulette_depth = 3;
+
+  /// The edge length, in pixels, of the square tiles that the image is split
+  /// into for scheduling across threads.
+  size_t tile_size = 16;
+
+  /// The number of wavelength bins traced together along each path, up to
+  /// wavelength_packet_capacity.  Each path follows a hero wavelength chosen
+  /// at random from its packet.
+  size_t wavelength_packet_size = wavelength_packet_capacity;
+
+  /// Next-event estimation.  At each surface that can report its scattering
+  /// (see material::is_delta), a point is picked on the scene's lights and
+  /// its contribution added if nothing blocks it.  Light that the path itself
+  /// then finds on those lights is combined with it using HEURISTIC.
+  bool direct_lighting = true;
+  mis_heuristic heuristic = mis_heuristic::power;
+
+  /// Adaptive sampling.
+  ///
+  /// When adaptive_threshold is positive and the image tracks variance, the
+  /// render continues after every bin reaches target_subsamples.  In rounds,
+  /// each bin whose estimated relative error is above the threshold gets
+  /// adaptive_round_samples more samples, noisiest bins first, until no bin is
+  /// above the threshold, every noisy bin has adaptive_max_subsamples samples,
+  /// or adaptive_budget samples have been added to the image (zero means no
+  /// budget).
+  float adaptive_threshold = 0.0f;
+  size_t adaptive_round_samples = 4;
+  size_t adaptive_max_subsamples = 256;
+  size_t adaptive_budget = 0;
+
+  /// Progressive rendering.
+  ///
+  /// When progressive is set, the image is rendered in passes over the whole
+  /// image, with pass k bringing every bin up to k samples.  Whenever the
+  /// render stops, every bin is within one sample of every other.  Passes
+  /// continue up to target_subsamples, or until the render is stopped if
+  /// target_subsamples is zero.
+  bool progressive = false;
+
+  /// Limits on the render, in any mode.  The render stops, leaving what has
+  /// been accumulated so far in the image, once the deadline passes, once
+  /// sample_budget samples have been recorded (zero means no budget), or once
+  /// the cancellation token is raised.
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::time_point::max();
+  size_t sample_budget = 0;
+  const cancellation_token *cancel = nullptr;
 };
 
 void render_scene(const options &the_options, spectral_image *sample_db,
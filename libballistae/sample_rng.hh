@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <random>
+
+namespace ballistae {
+
+/// splitmix64's output function: a bijective mixing of the bits of Z.
+inline std::uint64_t sample_rng_mix(std::uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+inline std::uint32_t reverse_bits(std::uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+/// A random Owen scramble of the 32-bit fixed-point value X, chosen by SEED.
+///
+/// Each bit is flipped depending only on the bits above it, so that points in
+/// the same dyadic interval stay together (Burley, "Practical Hash-based Owen
+/// Scrambling", 2020).
+inline std::uint32_t owen_scramble(std::uint32_t x, std::uint32_t seed) {
+  x = reverse_bits(x);
+
+  // A hash in which each bit only affects the bits above it.
+  x ^= x * 0x3d20adeau;
+  x += seed;
+  x *= (seed >> 16) | 1u;
+  x ^= x * 0x05526c56u;
+  x ^= x * 0x53a22864u;
+
+  return reverse_bits(x);
+}
+
+/// The first two dimensions of point INDEX of the Sobol sequence, as 32-bit
+/// fixed-point fractions.
+inline std::array<std::uint32_t, 2> sobol_2d(std::uint32_t index) {
+  std::uint32_t y = 0;
+  std::uint32_t v = 1u << 31;
+  for (std::uint32_t bits = index; bits != 0; bits >>= 1, v ^= v >> 1) {
+    if (bits & 1u) {
+      y ^= v;
+    }
+  }
+  return {reverse_bits(index), y};
+}
+
+/// The random numbers for a single sample.
+///
+/// A sample is a point in a many-dimensional space, whose dimensions are used
+/// up in turn as the sample is traced: the camera jitter, the choice of hero
+/// wavelength, then the choices made at each bounce.  Everything is a fixed
+/// function of which sample it is, so a sample draws the same numbers no
+/// matter which thread takes it, or when.
+///
+/// next_1d() and next_2d() give stratified values.  The samples of one pixel
+/// and wavelength bin are successive points of a 2D Sobol sequence, with a
+/// different Owen scrambling for each pair of dimensions (and each pixel and
+/// bin).  Any prefix of the samples is then well spread over each pair.
+///
+/// The generator also satisfies UniformRandomBitGenerator, for the standard
+/// distributions and for choices that don't benefit from stratification.
+/// Those outputs are a hash of the sample and the dimension.
+struct sample_rng {
+  using result_type = std::uint64_t;
+
+  /// Identifies the pixel and wavelength bin.
+  std::uint64_t pattern_key;
+
+  /// Identifies the sample within the pattern.
+  std::uint64_t sample_key;
+
+  /// The sample's position in the Sobol sequence.
+  std::uint32_t index;
+
+  /// The next dimension to be drawn.
+  std::uint32_t dimension;
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+
+  result_type operator()() {
+    // The key is advanced by a Weyl sequence, as in splitmix64.
+    this->dimension += 1;
+    return sample_rng_mix(this->sample_key +
+                          this->dimension * 0x9e3779b97f4a7c15ULL);
+  }
+
+  /// A stratified value in [0, 1)^2.
+  std::array<double, 2> next_2d() {
+    this->dimension += 1;
+    std::uint64_t seeds = sample_rng_mix(
+        this->pattern_key + this->dimension * 0x9e3779b97f4a7c15ULL);
+
+    // Shuffle the order of the points, so that the pairs of dimensions are
+    // decorrelated from each other.
+    std::uint32_t shuffled = owen_scramble(this->index, std::uint32_t(seeds));
+    std::array<std::uint32_t, 2> point = sobol_2d(shuffled);
+
+    std::uint64_t point_seeds = sample_rng_mix(seeds);
+    constexpr double scale = 1.0 / 4294967296.0;
+    return {owen_scramble(point[0], std::uint32_t(point_seeds)) * scale,
+            owen_scramble(point[1], std::uint32_t(point_seeds >> 32)) * scale};
+  }
+
+  /// A stratified value in [0, 1).
+  double next_1d() { return this->next_2d()[0]; }
+};
+
+/// The generator for sample INDEX of wavelength bin BIN in the pixel at ROW
+/// and COL.
+inline sample_rng make_sample_rng(std::uint64_t row, std::uint64_t col,
+                                  std::uint64_t bin, std::uint64_t index) {
+  std::uint64_t key = sample_rng_mix(row);
+  key = sample_rng_mix(key ^ col);
+  key = sample_rng_mix(key ^ bin);
+  return sample_rng{key, sample_rng_mix(key ^ index), std::uint32_t(index), 0};
+}
+
+/// A uniform value in [0, 1).  Stratified when G is a sample_rng.
+template <class Gen>
+double uniform_1d(Gen &g) {
+  return std::uniform_real_distribution<double>(0.0, 1.0)(g);
+}
+
+inline double uniform_1d(sample_rng &g) { return g.next_1d(); }
+
+/// A uniform value in [0, 1)^2.  Stratified when G is a sample_rng.
+template <class Gen>
+std::array<double, 2> uniform_2d(Gen &g) {
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+  double u = dist(g);
+  return {u, dist(g)};
+}
+
+inline std::array<double, 2> uniform_2d(sample_rng &g) { return g.next_2d(); }
+
+}  // namespace ballistae
@@ -0,0 +1,126 @@
+#include "libballistae/sample_rng.hh"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace ballistae {
+namespace {
+
+// The points drawn by the first COUNT samples of a pixel and bin, for the
+// DIMENSION'th call to next_2d().
+std::vector<std::array<double, 2>> draw_points(std::uint64_t row,
+                                               std::uint64_t col,
+                                               std::uint64_t bin, int dimension,
+                                               std::uint32_t count) {
+  std::vector<std::array<double, 2>> points;
+  for (std::uint32_t index = 0; index < count; ++index) {
+    sample_rng rng = make_sample_rng(row, col, bin, index);
+    for (int i = 0; i < dimension; ++i) {
+      rng.next_2d();
+    }
+    points.push_back(rng.next_2d());
+  }
+  return points;
+}
+
+// Check that POINTS, of which there are 2^K, have one point in each
+// elementary interval of area 2^-K: each 2^A by 2^(K-A) grid of cells.
+void expect_net(const std::vector<std::array<double, 2>> &points, int k) {
+  ASSERT_EQ(points.size(), std::size_t(1) << k);
+  for (int a = 0; a <= k; ++a) {
+    std::uint32_t cols = 1u << a;
+    std::uint32_t rows = 1u << (k - a);
+    std::vector<int> cells(std::size_t(cols) * rows, 0);
+    for (const auto &p : points) {
+      ASSERT_GE(p[0], 0.0);
+      ASSERT_LT(p[0], 1.0);
+      ASSERT_GE(p[1], 0.0);
+      ASSERT_LT(p[1], 1.0);
+      std::uint32_t x = std::uint32_t(p[0] * cols);
+      std::uint32_t y = std::uint32_t(p[1] * rows);
+      ++cells[std::size_t(y) * cols + x];
+    }
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+      EXPECT_EQ(cells[i], 1) << "k " << k << " grid " << cols << "x" << rows
+                             << " cell " << i;
+    }
+  }
+}
+
+TEST(SampleRng, SobolPointsAreNets) {
+  for (int k = 0; k <= 10; ++k) {
+    std::vector<std::array<double, 2>> points;
+    for (std::uint32_t index = 0; index < (1u << k); ++index) {
+      std::array<std::uint32_t, 2> p = sobol_2d(index);
+      points.push_back({p[0] / 4294967296.0, p[1] / 4294967296.0});
+    }
+    expect_net(points, k);
+  }
+}
+
+TEST(SampleRng, OwenScramblingKeepsNets) {
+  for (std::uint32_t seed : {1u, 0x12345678u, 0xdeadbeefu}) {
+    constexpr int k = 8;
+    std::vector<std::array<double, 2>> points;
+    for (std::uint32_t index = 0; index < (1u << k); ++index) {
+      std::array<std::uint32_t, 2> p = sobol_2d(index);
+      points.push_back({owen_scramble(p[0], seed) / 4294967296.0,
+                        owen_scramble(p[1], seed * 3u) / 4294967296.0});
+    }
+    expect_net(points, k);
+  }
+}
+
+TEST(SampleRng, OwenScrambleIsAPermutation) {
+  // Scrambling the low bits only moves a value within its dyadic interval.
+  for (std::uint32_t seed : {7u, 0xcafef00du}) {
+    std::vector<bool> seen(1u << 12, false);
+    for (std::uint32_t x = 0; x < (1u << 12); ++x) {
+      std::uint32_t y = owen_scramble(x << 20, seed) >> 20;
+      EXPECT_FALSE(seen[y]) << "seed " << seed << " x " << x;
+      seen[y] = true;
+    }
+  }
+}
+
+TEST(SampleRng, EachPrefixIsStratified) {
+  // The first 2^k samples of each pixel and bin form a net in every pair of
+  // dimensions, whatever the shuffling of the sample order.
+  for (int dimension = 0; dimension < 4; ++dimension) {
+    for (std::uint64_t pixel = 0; pixel < 3; ++pixel) {
+      std::vector<std::array<double, 2>> points =
+          draw_points(pixel, 17 * pixel + 1, pixel % 2, dimension, 1u << 10);
+      for (int k = 0; k <= 10; ++k) {
+        std::vector<std::array<double, 2>> prefix(points.begin(),
+                                                  points.begin() + (1u << k));
+        expect_net(prefix, k);
+      }
+    }
+  }
+}
+
+TEST(SampleRng, DimensionsAreDecorrelated) {
+  // Successive pairs of dimensions use different scrambles and orders.
+  std::vector<std::array<double, 2>> first = draw_points(3, 4, 0, 0, 64);
+  std::vector<std::array<double, 2>> second = draw_points(3, 4, 0, 1, 64);
+  int same = 0;
+  for (std::size_t i = 0; i < first.size(); ++i) {
+    if (first[i] == second[i]) ++same;
+  }
+  EXPECT_EQ(same, 0);
+}
+
+TEST(SampleRng, IsDeterministic) {
+  sample_rng a = make_sample_rng(10, 20, 3, 77);
+  sample_rng b = make_sample_rng(10, 20, 3, 77);
+  EXPECT_EQ(a(), b());
+  EXPECT_EQ(a.next_2d(), b.next_2d());
+  EXPECT_EQ(a.next_1d(), b.next_1d());
+  EXPECT_EQ(a(), b());
+}
+
+}  // namespace
+}  // namespace ballistae
@@ -1,5 +1,8 @@
 #include "libballistae/scene.hh"
 
+#include <algorithm>
+#include <cmath>
+
 namespace ballistae {
 
 void crush(scene &the_scene, double time) {
@@ -15,28 +18,57 @@ void crush(scene &the_scene, double time) {
   // Produce crushed scene elements from the uncrushed scene elements.  We
   // also precompute transforms derived from each element's transform.
   std::vector<crushed_scene_element> crushed_elts;
+  the_scene.environment.clear();
   for (const auto &elt : the_scene.elements) {
     elt.the_geometry->crush(time);
     elt.the_material->crush(time);
 
     auto world_aabox = elt.model_to_world * elt.the_geometry->get_aabox();
 
+    const auto &m = elt.model_to_world.linear;
+    double det = m(0, 0) * (m(1, 1) * m(2, 2) - m(1, 2) * m(2, 1)) -
+                 m(0, 1) * (m(1, 0) * m(2, 2) - m(1, 2) * m(2, 0)) +
+                 m(0, 2) * (m(1, 0) * m(2, 1) - m(1, 1) * m(2, 0));
+
+    bool is_light = elt.the_material->emissive() && isfinite(world_aabox) &&
+                    elt.the_geometry->surface_area() > 0;
+    if (is_light) {
+      elt.the_geometry->prepare_sampling(time);
+    }
+
     crushed_scene_element crush_elt = {elt.the_geometry,
                                        elt.the_material,
                                        inverse(elt.model_to_world),
                                        elt.model_to_world,
                                        normal_linear_map(elt.model_to_world),
-                                       world_aabox};
-    crushed_elts.push_back(crush_elt);
+                                       world_aabox,
+                                       det,
+                                       is_light};
+    if (elt.the_geometry->at_infinity()) {
+      the_scene.environment.push_back(crush_elt);
+    } else {
+      crushed_elts.push_back(crush_elt);
+    }
   }
 
   the_scene.crushed_elements = kd_tree<crushed_scene_element>(
       std::move(crushed_elts), [](const auto &s) { return s.world_aabox; });
 
-  // Refine using the surface area heuristic.
+  // Refine using the surface area heuristic.  Each element can be a whole
+  // mesh, so it's worth separating elements all the way down.
+  kd_tree_build_options build_options;
+  build_options.leaf_size = 1;
   kd_tree_refine_sah(
-      the_scene.crushed_elements.root.get(),
-      [](const auto &s) { return s.world_aabox; }, 1.0, 0.9);
+      the_scene.crushed_elements,
+      [](const auto &s) { return s.world_aabox; }, build_options);
+
+  // The tree doesn't move its elements once it is built.
+  the_scene.lights.clear();
+  for (const auto &elt : the_scene.crushed_elements.finite_elements) {
+    if (elt.is_light) {
+      the_scene.lights.push_back(&elt);
+    }
+  }
 }
 
 std::tuple<contact, const crushed_scene_element *> scene_ray_intersect(
@@ -44,41 +76,71 @@ std::tuple<contact, const crushed_scene_element *> scene_ray_intersect(
   contact min_contact;
   const crushed_scene_element *min_element = nullptr;
 
-  auto selector = [&](const aabox &box) -> bool {
-    using std::isnan;
-    auto overlap = ray_test(query, box);
-    return !isnan(overlap);
-  };
-
   auto computor = [&](const crushed_scene_element &elt) -> void {
     using std::isnan;
     auto mdl_query = elt.world_to_model * query;
-    auto entry_contact = elt.the_geometry->ray_into(mdl_query);
-    if (!isnan(entry_contact.t) &&
-        contains(mdl_query.the_segment, entry_contact.t)) {
-      entry_contact = contact_transform(entry_contact, elt.model_to_world,
-                                        elt.model_to_world_normals);
-      query.the_segment.hi = entry_contact.t;
-      min_contact = entry_contact;
-      min_element = &elt;
-
-      // Remake mdl_query from the updated world-space query.
-      mdl_query = elt.world_to_model * query;
-    }
-    auto exit_contact = elt.the_geometry->ray_exit(mdl_query);
-    if (!isnan(exit_contact.t) &&
-        contains(mdl_query.the_segment, exit_contact.t)) {
-      exit_contact = contact_transform(exit_contact, elt.model_to_world,
-                                       elt.model_to_world_normals);
-      query.the_segment.hi = exit_contact.t;
-      min_contact = exit_contact;
+    int contact_type;
+    auto mdl_contact = elt.the_geometry->ray_nearest(mdl_query, &contact_type);
+    if (!isnan(mdl_contact.t) &&
+        contains(mdl_query.the_segment, mdl_contact.t)) {
+      min_contact = contact_transform(mdl_contact, elt.model_to_world,
+                                      elt.model_to_world_normals);
+      query.the_segment.hi = min_contact.t;
       min_element = &elt;
     }
   };
 
-  the_scene.crushed_elements.query(selector, computor);
+  the_scene.crushed_elements.ray_query(&query, computor);
+
+  // Everything in the environment is equally far away, so the first element
+  // that the ray reaches is taken.
+  for (auto it = the_scene.environment.begin();
+       min_element == nullptr && it != the_scene.environment.end(); ++it) {
+    computor(*it);
+  }
 
   return std::make_tuple(min_contact, min_element);
 }
 
+bool scene_ray_occluded(const scene &the_scene, const ray_segment &query) {
+  return the_scene.crushed_elements.ray_query_any(
+      query, [&](const crushed_scene_element &elt) -> bool {
+        return elt.the_geometry->ray_occluded(elt.world_to_model * query);
+      });
+}
+
+light_sample scene_sample_light(const scene &the_scene, sample_rng &rng) {
+  using std::abs;
+
+  size_t light_count = the_scene.lights.size();
+  size_t pick = std::min(size_t(uniform_1d(rng) * light_count),
+                         light_count - 1);
+  const crushed_scene_element &elt = *the_scene.lights[pick];
+
+  contact mdl_point = elt.the_geometry->sample_surface(rng);
+
+  light_sample result;
+  result.element = &elt;
+  result.point = mdl_point;
+  result.point.p = elt.model_to_world * mdl_point.p;
+  result.point.n = normalise(elt.model_to_world_normals * mdl_point.n);
+  result.pdf_area = scene_light_pdf_area(the_scene, elt, result.point.n);
+  return result;
+}
+
+double scene_light_pdf_area(const scene &the_scene,
+                            const crushed_scene_element &elt,
+                            const fixvec<double, 3> &world_normal) {
+  using std::abs;
+
+  // A patch of model-space area dA, whose normal maps to the unit normal n in
+  // world space, covers |det M| / |M^T n| dA in world space.
+  double world_area_scale =
+      abs(elt.model_to_world_det) /
+      norm(transpose(elt.model_to_world.linear) * world_normal);
+
+  return 1.0 / (the_scene.lights.size() * elt.the_geometry->surface_area() *
+                world_area_scale);
+}
+
 }  // namespace ballistae
@@ -16,6 +16,7 @@
 #include "libballistae/material.hh"
 #include "libballistae/material_map.hh"
 #include "libballistae/ray.hh"
+#include "libballistae/sample_rng.hh"
 #include "libballistae/span.hh"
 #include "libballistae/vector.hh"
 
@@ -51,19 +52,68 @@ struct crushed_scene_element {
 
   /// The element's bounding box in world coordinates.
   aabox world_aabox;
+
+  /// The determinant of model_to_world's linear part.
+  double model_to_world_det;
+
+  /// Whether the element is sampled directly as a light: its material is
+  /// emissive and its geometry is finite and can be sampled by area.
+  bool is_light;
 };
 
 struct scene {
   std::vector<scene_element> elements;
 
   kd_tree<crushed_scene_element> crushed_elements;
+
+  /// The elements of crushed_elements that are lights.
+  std::vector<const crushed_scene_element *> lights;
+
+  /// The elements whose geometry lies at infinity.  They are kept out of
+  /// crushed_elements, and are only consulted for rays that miss everything
+  /// there.
+  std::vector<crushed_scene_element> environment;
+};
+
+/// A point picked on one of a scene's lights.
+struct light_sample {
+  const crushed_scene_element *element;
+
+  /// The point, in world space.  Only P, N, MTL2, and MTL3 are set.
+  contact point;
+
+  /// The density with which POINT was picked, per unit of world-space area.
+  double pdf_area;
 };
 
 void crush(scene &the_scene, double time);
 
+/// The nearest contact within QUERY's segment, and the element it is on.
+///
+/// The environment is only checked if nothing else is hit.  The element is
+/// null if there is no contact at all.
 std::tuple<contact, const crushed_scene_element *> scene_ray_intersect(
     const scene &the_scene, ray_segment query);
 
+/// Whether anything in the scene lies within QUERY's segment.
+///
+/// Stops at the first blocker found, without working out which is nearest.
+bool scene_ray_occluded(const scene &the_scene, const ray_segment &query);
+
+/// Pick a point on the scene's lights.
+///
+/// Lights are picked with equal probability, and then a point is picked
+/// uniformly by area on the chosen light.  The scene must have at least one
+/// light.
+light_sample scene_sample_light(const scene &the_scene, sample_rng &rng);
+
+/// The density, per unit of world-space area, with which scene_sample_light
+/// picks a point on the light ELT where the world-space normal is
+/// WORLD_NORMAL.
+double scene_light_pdf_area(const scene &the_scene,
+                            const crushed_scene_element &elt,
+                            const fixvec<double, 3> &world_normal);
+
 }  // namespace ballistae
 
 #endif
@@ -1,5 +1,8 @@
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 
+#include <cmath>
+#include <limits>
+
 #include "libballistae/spectral_image.hh"
 #include "libballistae/spectral_image_file.pb.h"
 #include "libballistae/zipstream.hh"
@@ -11,7 +14,8 @@ spectral_image::spectral_image()
       col_size(0),
       wavelength_size(0),
       wavelength_min(0.0),
-      wavelength_max(0.0) {}
+      wavelength_max(0.0),
+      tracks_variance(false) {}
 
 spectral_image::spectral_image(std::size_t row_size_in, std::size_t col_size_in,
                                std::size_t wavelength_size_in,
@@ -22,7 +26,8 @@ spectral_image::spectral_image(std::size_t row_size_in, std::size_t col_size_in,
       wavelength_min(wavelength_min_in),
       wavelength_max(wavelength_max_in),
       power_density_sums(row_size * col_size * wavelength_size, 0.0),
-      power_density_counts(row_size * col_size * wavelength_size, 0.0) {}
+      power_density_counts(row_size * col_size * wavelength_size, 0.0),
+      tracks_variance(false) {}
 
 void spectral_image::resize(std::size_t row_size, std::size_t col_size,
                             std::size_t wavelength_size) {
@@ -36,6 +41,18 @@ void spectral_image::resize(std::size_t row_size, std::size_t col_size,
   this->power_density_counts.resize(row_size * col_size * wavelength_size);
   std::fill(this->power_density_counts.begin(),
             this->power_density_counts.end(), 0.0);
+
+  if (this->tracks_variance) {
+    this->power_density_square_sums.resize(row_size * col_size *
+                                           wavelength_size);
+    std::fill(this->power_density_square_sums.begin(),
+              this->power_density_square_sums.end(), 0.0);
+  }
+}
+
+void spectral_image::track_variance() {
+  this->tracks_variance = true;
+  this->power_density_square_sums.assign(this->power_density_sums.size(), 0.0);
 }
 
 span<float> spectral_image::wavelength_bin(std::size_t i) const {
@@ -58,6 +75,10 @@ void spectral_image::record_sample(std::size_t row, std::size_t col,
                              col * this->wavelength_size + wavelength_index;
   this->power_density_sums[sample_index] += power_density;
   this->power_density_counts[sample_index] += 1.0;
+  if (this->tracks_variance) {
+    this->power_density_square_sums[sample_index] +=
+        power_density * power_density;
+  }
 }
 
 spectral_image::sample spectral_image::read_sample(std::size_t r, std::size_t c,
@@ -75,13 +96,39 @@ spectral_image::sample spectral_image::read_sample(std::size_t r, std::size_t c,
                   (f + 1) * wavelength_step + wavelength_min};
   sample.power_density_sum = this->power_density_sums[sample_index];
   sample.power_density_count = this->power_density_counts[sample_index];
+  sample.power_density_square_sum =
+      this->tracks_variance ? this->power_density_square_sums[sample_index]
+                            : 0.0f;
 
   return sample;
 }
 
+float relative_error(const spectral_image::sample &sample) {
+  float n = sample.power_density_count;
+  if (n < 2.0f) {
+    return std::numeric_limits<float>::infinity();
+  }
+
+  float mean = sample.power_density_sum / n;
+  float variance =
+      (sample.power_density_square_sum - sample.power_density_sum * mean) /
+      (n - 1.0f);
+
+  // Samples are non-negative, so a zero mean implies a zero variance (up to
+  // rounding).
+  if (variance <= 0.0f || mean <= 0.0f) {
+    return 0.0f;
+  }
+
+  return std::sqrt(variance / n) / mean;
+}
+
 void spectral_image::cut(spectral_image *dst, std::size_t row_src,
                          std::size_t row_lim, std::size_t col_src,
                          std::size_t col_lim) const {
+  if (this->tracks_variance && !dst->tracks_variance) {
+    dst->track_variance();
+  }
   dst->resize(row_lim - row_src, col_lim - col_src, this->wavelength_size);
   dst->wavelength_min = this->wavelength_min;
   dst->wavelength_max = this->wavelength_max;
@@ -99,6 +146,10 @@ void spectral_image::cut(spectral_image *dst, std::size_t row_src,
             this->power_density_sums[src_index];
         dst->power_density_counts[dst_index] =
             this->power_density_counts[src_index];
+        if (this->tracks_variance) {
+          dst->power_density_square_sums[dst_index] =
+              this->power_density_square_sums[src_index];
+        }
       }
     }
   }
@@ -122,11 +173,39 @@ void spectral_image::paste(spectral_image const *src, std::size_t row_src,
             src->power_density_sums[src_index];
         this->power_density_counts[dst_index] =
             src->power_density_counts[src_index];
+        if (this->tracks_variance && src->tracks_variance) {
+          this->power_density_square_sums[dst_index] =
+              src->power_density_square_sums[src_index];
+        }
       }
     }
   }
 }
 
+spectral_image_view spectral_image::view(std::size_t row_src,
+                                         std::size_t row_lim,
+                                         std::size_t col_src,
+                                         std::size_t col_lim) {
+  return spectral_image_view{this, row_src, row_lim, col_src, col_lim};
+}
+
+span<float> spectral_image_view::wavelength_bin(std::size_t i) const {
+  return this->image->wavelength_bin(i);
+}
+
+void spectral_image_view::record_sample(std::size_t r, std::size_t c,
+                                        std::size_t wavelength_index,
+                                        float power_density) {
+  this->image->record_sample(this->row_src + r, this->col_src + c,
+                             wavelength_index, power_density);
+}
+
+spectral_image::sample spectral_image_view::read_sample(std::size_t r,
+                                                        std::size_t c,
+                                                        std::size_t f) const {
+  return this->image->read_sample(this->row_src + r, this->col_src + c, f);
+}
+
 std::string read_spectral_image_error_to_string(read_spectral_image_error err) {
   switch (err) {
     case read_spectral_image_error::ok:
@@ -166,14 +245,21 @@ read_spectral_image_error read_spectral_image(spectral_image *im,
     return read_spectral_image_error::error_reading_header;
   }
 
-  if (hdr.data_layout_version() != 1) {
+  // Layout version 1 holds sums and counts.  Version 2 adds square sums.
+  if (hdr.data_layout_version() != 1 && hdr.data_layout_version() != 2) {
     return read_spectral_image_error::error_bad_data_layout_version;
   }
+  bool has_square_sums = hdr.data_layout_version() == 2;
 
   im->wavelength_min = hdr.wavelength_min();
   im->wavelength_max = hdr.wavelength_max();
 
+  im->tracks_variance = false;
+  im->power_density_square_sums.clear();
   im->resize(hdr.row_size(), hdr.col_size(), hdr.wavelength_size());
+  if (has_square_sums) {
+    im->track_variance();
+  }
 
   ::ballistae::zipreader reader;
   if (reader.open(in, 1024 * 1024) != zipreader_error::ok) {
@@ -192,11 +278,23 @@ read_spectral_image_error read_spectral_image(spectral_image *im,
   ret =
       reader.read(reinterpret_cast<char *>(im->power_density_counts.data()), n);
   if (reader.last_read_size != n ||
-      (ret != zipreader_error::ok && ret != zipreader_error::error_eof)) {
+      (ret != zipreader_error::ok && ret != zipreader_error::error_eof) ||
+      (has_square_sums && ret != zipreader_error::ok)) {
     reader.close();
     return read_spectral_image_error::error_decompressing;
   }
 
+  if (has_square_sums) {
+    n = sizeof(float) * im->power_density_square_sums.size();
+    ret = reader.read(
+        reinterpret_cast<char *>(im->power_density_square_sums.data()), n);
+    if (reader.last_read_size != n ||
+        (ret != zipreader_error::ok && ret != zipreader_error::error_eof)) {
+      reader.close();
+      return read_spectral_image_error::error_decompressing;
+    }
+  }
+
   reader.close();
 
   return read_spectral_image_error::ok;
@@ -211,7 +309,7 @@ write_spectral_image_error write_spectral_image(spectral_image *im,
   hdr.set_wavelength_min(im->wavelength_min);
   hdr.set_wavelength_max(im->wavelength_max);
 
-  hdr.set_data_layout_version(1);
+  hdr.set_data_layout_version(im->tracks_variance ? 2 : 1);
 
   std::uint64_t header_size = hdr.ByteSizeLong();
   out->write(reinterpret_cast<char *>(&header_size), sizeof(std::uint64_t));
@@ -249,6 +347,15 @@ write_spectral_image_error write_spectral_image(spectral_image *im,
     return write_spectral_image_error::error_compressing;
   }
 
+  if (im->tracks_variance) {
+    writer_err = writer.write(
+        reinterpret_cast<char *>(im->power_density_square_sums.data()),
+        sizeof(float) * im->power_density_square_sums.size());
+    if (writer_err != ::ballistae::zipwriter_error::ok) {
+      return write_spectral_image_error::error_compressing;
+    }
+  }
+
   writer_err = writer.close();
   if (writer_err != ::ballistae::zipwriter_error::ok) {
     return write_spectral_image_error::error_compressing;
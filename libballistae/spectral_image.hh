@@ -12,6 +12,8 @@
 
 namespace ballistae {
 
+struct spectral_image_view;
+
 struct spectral_image {
   std::size_t row_size;
   std::size_t col_size;
@@ -23,6 +25,12 @@ struct spectral_image {
   std::vector<float> power_density_sums;
   std::vector<float> power_density_counts;
 
+  /// Sums of squared samples, used to estimate the variance of each bin.
+  ///
+  /// Only populated when tracks_variance is set.
+  bool tracks_variance;
+  std::vector<float> power_density_square_sums;
+
  public:
   spectral_image();
   spectral_image(std::size_t row_size_in, std::size_t col_size_in,
@@ -32,6 +40,12 @@ struct spectral_image {
   void resize(std::size_t row_size, std::size_t col_size,
               std::size_t wavelength_size);
 
+  /// Start recording the second moment of each bin.
+  ///
+  /// Samples that are already recorded don't contribute to the second moment,
+  /// so this should be called before any samples are recorded.
+  void track_variance();
+
   span<float> wavelength_bin(std::size_t i) const;
 
   void record_sample(std::size_t r, std::size_t c, std::size_t wavelength_index,
@@ -41,6 +55,9 @@ struct spectral_image {
     span<float> wavelength_span;
     float power_density_sum;
     float power_density_count;
+
+    /// Zero if the image doesn't track variance.
+    float power_density_square_sum;
   };
 
   sample read_sample(std::size_t r, std::size_t c, std::size_t f) const;
@@ -49,6 +66,42 @@ struct spectral_image {
            std::size_t col_src, std::size_t col_lim) const;
   void paste(spectral_image const *src, std::size_t row_src,
              std::size_t col_src);
+
+  spectral_image_view view(std::size_t row_src, std::size_t row_lim,
+                           std::size_t col_src, std::size_t col_lim);
+};
+
+/// Estimate the relative standard error of the mean of a sample bin.
+///
+/// Returns infinity if the bin has too few samples to estimate its variance.
+float relative_error(const spectral_image::sample &sample);
+
+/// A reference to a rectangular region of a spectral_image.
+///
+/// Rows and columns are addressed relative to the origin of the region, and
+/// samples are accumulated directly into the underlying image.  Views of
+/// non-overlapping regions may be written from different threads at the same
+/// time.
+struct spectral_image_view {
+  spectral_image *image;
+
+  std::size_t row_src;
+  std::size_t row_lim;
+  std::size_t col_src;
+  std::size_t col_lim;
+
+ public:
+  std::size_t row_size() const { return this->row_lim - this->row_src; }
+  std::size_t col_size() const { return this->col_lim - this->col_src; }
+  std::size_t wavelength_size() const { return this->image->wavelength_size; }
+
+  span<float> wavelength_bin(std::size_t i) const;
+
+  void record_sample(std::size_t r, std::size_t c, std::size_t wavelength_index,
+                     float power_density);
+
+  spectral_image::sample read_sample(std::size_t r, std::size_t c,
+                                     std::size_t f) const;
 };
 
 enum class read_spectral_image_error {
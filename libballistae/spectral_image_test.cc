@@ -74,3 +74,52 @@ TEST(SpectralImage, Paste) {
   EXPECT_EQ(sample.power_density_sum, 1.0f);
   EXPECT_EQ(sample.power_density_count, 1.0f);
 }
+
+TEST(SpectralImage, View) {
+  ballistae::spectral_image big(10, 11, 12, 0.0f, 1.0f);
+
+  ballistae::spectral_image_view view = big.view(2, 5, 3, 7);
+  EXPECT_EQ(view.row_size(), 3);
+  EXPECT_EQ(view.col_size(), 4);
+  EXPECT_EQ(view.wavelength_size(), 12);
+
+  view.record_sample(1, 2, 3, 2.0f);
+
+  ballistae::spectral_image::sample sample = big.read_sample(3, 5, 3);
+  EXPECT_EQ(sample.power_density_sum, 2.0f);
+  EXPECT_EQ(sample.power_density_count, 1.0f);
+
+  sample = view.read_sample(1, 2, 3);
+  EXPECT_EQ(sample.power_density_sum, 2.0f);
+  EXPECT_EQ(sample.power_density_count, 1.0f);
+}
+
+TEST(SpectralImage, VarianceRoundTrip) {
+  std::stringstream memstream(std::stringstream::in | std::stringstream::out |
+                              std::stringstream::binary);
+
+  ballistae::spectral_image im1(1, 2, 3, 0.0f, 1.0f);
+  im1.track_variance();
+  im1.record_sample(0, 0, 0, 1.0f);
+  im1.record_sample(0, 0, 0, 3.0f);
+
+  auto write_err = ballistae::write_spectral_image(&im1, &memstream);
+  ASSERT_EQ(write_err, ballistae::write_spectral_image_error::ok);
+
+  ballistae::spectral_image im2;
+
+  auto read_err = ballistae::read_spectral_image(&im2, &memstream);
+  ASSERT_EQ(read_err, ballistae::read_spectral_image_error::ok);
+
+  EXPECT_TRUE(im2.tracks_variance);
+  EXPECT_EQ(im1.power_density_sums, im2.power_density_sums);
+  EXPECT_EQ(im1.power_density_counts, im2.power_density_counts);
+  EXPECT_EQ(im1.power_density_square_sums, im2.power_density_square_sums);
+
+  ballistae::spectral_image::sample sample = im2.read_sample(0, 0, 0);
+  EXPECT_EQ(sample.power_density_square_sum, 10.0f);
+
+  // Samples 1 and 3 have mean 2 and variance 2, so the standard error of the
+  // mean is 1.
+  EXPECT_FLOAT_EQ(ballistae::relative_error(sample), 0.5f);
+}
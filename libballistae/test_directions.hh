@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "libballistae/vector.hh"
+
+namespace ballistae {
+
+/// Bins for a histogram of sampled unit vectors, to check a sampler against
+/// its pdf.
+///
+/// Bins are even in cos(theta) over [COS_LO, 1], which makes them even in
+/// solid angle, and even in phi.
+struct direction_bins {
+  int cos_bins;
+  int phi_bins;
+  double cos_lo;
+
+  int size() const { return cos_bins * phi_bins; }
+
+  /// The bin of the unit vector W, or -1 if it lies below COS_LO.
+  int bin_of(const fixvec<double, 3> &w) const;
+
+  /// The probability that a direction drawn from PDF lands in each bin, by
+  /// integrating it over a SUB by SUB grid in each bin.  Solid angle is
+  /// d(cos theta) d(phi).
+  template <class Pdf>
+  std::vector<double> integrate(Pdf pdf, int sub = 24) const;
+};
+
+inline int direction_bins::bin_of(const fixvec<double, 3> &w) const {
+  if (w(2) < this->cos_lo) return -1;
+  double height = (w(2) - this->cos_lo) / (1.0 - this->cos_lo);
+  int c = std::min(this->cos_bins - 1, int(height * this->cos_bins));
+  double phi = std::atan2(w(1), w(0));
+  if (phi < 0) phi += 2 * M_PI;
+  int p = std::min(this->phi_bins - 1, int(phi / (2 * M_PI) * this->phi_bins));
+  return c * this->phi_bins + p;
+}
+
+template <class Pdf>
+std::vector<double> direction_bins::integrate(Pdf pdf, int sub) const {
+  std::vector<double> result(this->size(), 0.0);
+  double dc = (1.0 - this->cos_lo) / (this->cos_bins * sub);
+  double dphi = 2 * M_PI / (this->phi_bins * sub);
+  for (int i = 0; i < this->cos_bins * sub; ++i) {
+    double c = this->cos_lo + (i + 0.5) * dc;
+    double s = std::sqrt(1 - c * c);
+    for (int j = 0; j < this->phi_bins * sub; ++j) {
+      double phi = (j + 0.5) * dphi;
+      fixvec<double, 3> w = {s * std::cos(phi), s * std::sin(phi), c};
+      result[(i / sub) * this->phi_bins + j / sub] += pdf(w) * dc * dphi;
+    }
+  }
+  return result;
+}
+
+/// Expect the share of TOTAL samples in each bin to be the probability in
+/// EXPECTED, within five standard deviations.
+///
+/// Samples that land outside every bin are left out of COUNTS, and their
+/// share has to match the probability that EXPECTED misses.
+inline void expect_matching_histogram(const std::vector<double> &expected,
+                                      const std::vector<int> &counts,
+                                      int total) {
+  double expected_sum = 0.0;
+  int count_sum = 0;
+  for (std::size_t i = 0; i < expected.size(); ++i) {
+    double p = expected[i];
+    double observed = double(counts[i]) / total;
+    double sigma = std::sqrt(p * (1 - p) / total);
+    EXPECT_NEAR(observed, p, 5 * sigma + 2e-3) << "bin " << i;
+    expected_sum += p;
+    count_sum += counts[i];
+  }
+  EXPECT_NEAR(double(count_sum) / total, expected_sum, 5e-3);
+}
+
+}  // namespace ballistae
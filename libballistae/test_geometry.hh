@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+
+#include "libballistae/geometry/tri_mesh.hh"
+#include "libballistae/ray.hh"
+#include "libballistae/vector.hh"
+
+namespace ballistae {
+
+/// A random point in [-RADIUS, RADIUS]^3.
+inline fixvec<float, 3> random_point(std::mt19937 *gen, float radius) {
+  std::uniform_real_distribution<float> coord(-radius, radius);
+  return {coord(*gen), coord(*gen), coord(*gen)};
+}
+
+/// A random ray from around [-2, 2]^3.  Some run along an axis, some have
+/// one slope component of exactly zero, and some aim at the middle of
+/// [-1, 1]^3.
+inline ray random_ray(std::mt19937 *gen) {
+  std::uniform_int_distribution<int> choice(0, 7);
+  std::uniform_int_distribution<int> axis(0, 2);
+
+  ray result;
+  fixvec<float, 3> p = random_point(gen, 2.0f);
+  fixvec<float, 3> s = random_point(gen, 1.0f);
+  result.point = {p(0), p(1), p(2)};
+  result.slope = {s(0), s(1), s(2)};
+  result.patch_area = 0.0;
+
+  int kind = choice(*gen);
+  if (kind == 1) {
+    result.slope(axis(*gen)) = 0.0;
+  } else if (kind == 2) {
+    int a = axis(*gen);
+    double sign = result.slope(a) < 0.0 ? -1.0 : 1.0;
+    result.slope = {0.0, 0.0, 0.0};
+    result.slope(a) = sign;
+  } else if (kind == 3) {
+    // Aim at the middle of the scene, so that most rays hit something.
+    fixvec<double, 3> target = {s(0) * 0.5, s(1) * 0.5, s(2) * 0.5};
+    result.slope = target - result.point;
+  }
+  result.slope = normalise(result.slope);
+  return result;
+}
+
+/// A mesh of COUNT small random triangles in [-1, 1]^3.
+inline tri_mesh random_mesh(std::mt19937 *gen, std::size_t count) {
+  tri_mesh mesh;
+  for (std::size_t i = 0; i < count; ++i) {
+    fixvec<float, 3> center = random_point(gen, 0.8f);
+    std::uint32_t base = std::uint32_t(mesh.v.size());
+    for (int j = 0; j < 3; ++j) {
+      fixvec<float, 3> offset = random_point(gen, 0.3f);
+      mesh.v.push_back({center(0) + offset(0), center(1) + offset(1),
+                        center(2) + offset(2)});
+    }
+    mesh.fv.push_back({base, base + 1, base + 2});
+  }
+  return mesh;
+}
+
+}  // namespace ballistae
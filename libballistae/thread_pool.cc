@@ -0,0 +1,183 @@
+#include "libballistae/thread_pool.hh"
+
+#include <algorithm>
+
+namespace ballistae {
+
+namespace {
+
+// Identifies the pool (and deque) that owns the current thread, if any.
+thread_local thread_pool *current_pool = nullptr;
+thread_local std::size_t current_index = 0;
+
+}  // namespace
+
+thread_pool::thread_pool(std::size_t thread_count)
+    : queued(0), next_queue(0), stopping(false) {
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+
+  for (std::size_t i = 0; i < thread_count; ++i) {
+    this->queues.push_back(std::make_unique<task_queue>());
+  }
+
+  for (std::size_t i = 0; i < thread_count; ++i) {
+    this->threads.emplace_back([this, i]() { this->worker_loop(i); });
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::scoped_lock lock{this->sleep_mutex};
+    this->stopping = true;
+  }
+  this->wake.notify_all();
+
+  for (auto &thread : this->threads) {
+    thread.join();
+  }
+}
+
+std::size_t thread_pool::size() const { return this->threads.size(); }
+
+void thread_pool::push(std::function<void()> fn) {
+  std::size_t index;
+  if (current_pool == this) {
+    index = current_index;
+  } else {
+    index = this->next_queue.fetch_add(1) % this->queues.size();
+  }
+
+  {
+    std::scoped_lock lock{this->queues[index]->mutex};
+    this->queues[index]->tasks.push_back(std::move(fn));
+  }
+  this->queued.fetch_add(1);
+
+  // Taking the sleep mutex orders this push against any thread that is
+  // between checking `queued` and going to sleep.
+  { std::scoped_lock lock{this->sleep_mutex}; }
+  this->wake.notify_one();
+}
+
+bool thread_pool::run_one() {
+  std::size_t n = this->queues.size();
+  bool own = (current_pool == this);
+  std::size_t home = own ? current_index : (this->next_queue.load() % n);
+
+  std::function<void()> task;
+  for (std::size_t i = 0; i < n && !task; ++i) {
+    task_queue &q = *(this->queues[(home + i) % n]);
+    std::scoped_lock lock{q.mutex};
+    if (q.tasks.empty()) {
+      continue;
+    }
+
+    // Work on our own deque in LIFO order, and steal in FIFO order.
+    if (own && i == 0) {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+    } else {
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+    }
+  }
+
+  if (!task) {
+    return false;
+  }
+
+  this->queued.fetch_sub(1);
+  task();
+  return true;
+}
+
+void thread_pool::notify_all() {
+  { std::scoped_lock lock{this->sleep_mutex}; }
+  this->wake.notify_all();
+}
+
+thread_pool &thread_pool::shared() {
+  static thread_pool pool([]() -> std::size_t {
+    std::size_t processor_count = std::thread::hardware_concurrency();
+    return std::max<std::size_t>(processor_count, 2) - 1;
+  }());
+  return pool;
+}
+
+void thread_pool::worker_loop(std::size_t index) {
+  current_pool = this;
+  current_index = index;
+
+  while (true) {
+    if (this->run_one()) {
+      continue;
+    }
+
+    std::unique_lock lock{this->sleep_mutex};
+    this->wake.wait(lock, [this]() {
+      return this->stopping || this->queued.load() != 0;
+    });
+    if (this->stopping && this->queued.load() == 0) {
+      return;
+    }
+  }
+}
+
+task_group::task_group(thread_pool *pool_in) : pool(pool_in), pending(0) {}
+
+task_group::~task_group() { this->wait(); }
+
+void task_group::run(std::function<void()> fn) {
+  this->pending.fetch_add(1);
+
+  // The group may be destroyed as soon as `pending` reaches zero, so the task
+  // must not touch `this` after that point.
+  thread_pool *pool = this->pool;
+  this->pool->push([this, pool, fn = std::move(fn)]() {
+    fn();
+    if (this->pending.fetch_sub(1) == 1) {
+      pool->notify_all();
+    }
+  });
+}
+
+void task_group::wait() {
+  while (this->pending.load() != 0) {
+    if (this->pool->run_one()) {
+      continue;
+    }
+
+    std::unique_lock lock{this->pool->sleep_mutex};
+    this->pool->wake.wait(lock, [this]() {
+      return this->pending.load() == 0 || this->pool->queued.load() != 0;
+    });
+  }
+}
+
+void parallel_for(thread_pool *pool, std::size_t count, std::size_t grain,
+                  const std::function<void(std::size_t, std::size_t)> &fn) {
+  if (grain == 0) {
+    grain = 1;
+  }
+
+  if (count <= grain) {
+    if (count != 0) {
+      fn(0, count);
+    }
+    return;
+  }
+
+  task_group tasks(pool);
+  for (std::size_t src = grain; src < count; src += grain) {
+    std::size_t lim = std::min(src + grain, count);
+    tasks.run([&fn, src, lim]() { fn(src, lim); });
+  }
+
+  // The calling thread takes the first range itself.
+  fn(0, grain);
+  tasks.wait();
+}
+
+}  // namespace ballistae
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ballistae {
+
+/// A fixed set of worker threads, each owning a deque of tasks.
+///
+/// A worker takes tasks from the back of its own deque.  When its deque runs
+/// dry, it steals from the front of the other workers' deques.  Tasks pushed
+/// from a worker thread land on that worker's deque; tasks pushed from outside
+/// the pool are dealt round-robin across all deques.
+///
+/// Tasks are normally pushed and waited on through a task_group.
+struct thread_pool {
+  struct task_queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<task_queue>> queues;
+  std::vector<std::thread> threads;
+
+  /// The number of tasks sitting in all of the deques.
+  std::atomic<std::size_t> queued;
+
+  /// Round-robin cursor for tasks pushed from outside the pool.
+  std::atomic<std::size_t> next_queue;
+
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  bool stopping;
+
+ public:
+  explicit thread_pool(std::size_t thread_count);
+  ~thread_pool();
+
+  thread_pool(const thread_pool &other) = delete;
+  thread_pool &operator=(const thread_pool &other) = delete;
+
+  std::size_t size() const;
+
+  /// Queue FN for execution by some worker.
+  void push(std::function<void()> fn);
+
+  /// Run a single queued task on the calling thread, if one can be found.
+  ///
+  /// Returns false if every deque was empty.
+  bool run_one();
+
+  /// Wake every thread sleeping on the pool.
+  void notify_all();
+
+  /// The process-wide pool.
+  ///
+  /// It is created on first use, and holds one fewer worker than the hardware
+  /// concurrency, since a thread waiting on a task_group executes tasks too.
+  static thread_pool &shared();
+
+ private:
+  void worker_loop(std::size_t index);
+};
+
+/// A set of tasks that can be waited on together.
+///
+/// A thread waiting on a group executes pending pool tasks instead of
+/// blocking, so tasks may themselves create and wait on nested groups.
+struct task_group {
+  thread_pool *pool;
+  std::atomic<std::size_t> pending;
+
+ public:
+  explicit task_group(thread_pool *pool_in);
+
+  /// Waits for any outstanding tasks.
+  ~task_group();
+
+  task_group(const task_group &other) = delete;
+  task_group &operator=(const task_group &other) = delete;
+
+  void run(std::function<void()> fn);
+
+  void wait();
+};
+
+/// Call FN on consecutive ranges [src, lim) that cover [0, COUNT), each at
+/// most GRAIN long, spread across POOL.
+///
+/// Returns once every range is done.  If COUNT is no more than GRAIN, FN is
+/// simply called on the calling thread.
+void parallel_for(thread_pool *pool, std::size_t count, std::size_t grain,
+                  const std::function<void(std::size_t, std::size_t)> &fn);
+
+}  // namespace ballistae
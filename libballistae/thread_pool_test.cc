@@ -0,0 +1,116 @@
+#include "libballistae/thread_pool.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace ballistae {
+namespace {
+
+// Spawn a binary tree of tasks DEPTH deep, each waiting on its children.
+void spawn_tree(thread_pool *pool, int depth, std::atomic<int> *leaves) {
+  if (depth == 0) {
+    leaves->fetch_add(1);
+    return;
+  }
+
+  task_group children(pool);
+  children.run([=]() { spawn_tree(pool, depth - 1, leaves); });
+  children.run([=]() { spawn_tree(pool, depth - 1, leaves); });
+  children.wait();
+}
+
+TEST(ThreadPool, NestedGroups) {
+  thread_pool pool(4);
+
+  std::atomic<int> leaves(0);
+  spawn_tree(&pool, 10, &leaves);
+
+  EXPECT_EQ(leaves.load(), 1 << 10);
+}
+
+TEST(ThreadPool, WaitRunsQueuedTasks) {
+  // With a single worker stuck in a task, the waiting thread has to run the
+  // rest of the group itself.
+  thread_pool pool(1);
+
+  std::atomic<bool> started(false);
+  std::atomic<bool> release(false);
+  std::atomic<int> done(0);
+
+  task_group blocker(&pool);
+  blocker.run([&]() {
+    started.store(true);
+    while (!release.load()) {
+      std::this_thread::yield();
+    }
+  });
+  while (!started.load()) {
+    std::this_thread::yield();
+  }
+
+  {
+    task_group tasks(&pool);
+    for (int i = 0; i < 100; ++i) {
+      tasks.run([&]() { done.fetch_add(1); });
+    }
+    tasks.wait();
+    EXPECT_EQ(done.load(), 100);
+  }
+
+  release.store(true);
+  blocker.wait();
+}
+
+TEST(ThreadPool, SingleThreadNestedGroups) {
+  thread_pool pool(1);
+
+  std::atomic<int> leaves(0);
+  spawn_tree(&pool, 8, &leaves);
+
+  EXPECT_EQ(leaves.load(), 1 << 8);
+}
+
+TEST(ParallelFor, CoversEachIndexOnce) {
+  thread_pool pool(3);
+
+  for (std::size_t count : {0, 1, 7, 64, 1000}) {
+    for (std::size_t grain : {0, 1, 3, 64, 2000}) {
+      std::vector<std::atomic<int>> hits(count);
+      parallel_for(&pool, count, grain, [&](std::size_t src, std::size_t lim) {
+        EXPECT_LT(src, lim);
+        EXPECT_LE(lim - src, std::max<std::size_t>(grain, 1));
+        for (std::size_t i = src; i < lim; ++i) {
+          hits[i].fetch_add(1);
+        }
+      });
+
+      for (std::size_t i = 0; i < count; ++i) {
+        EXPECT_EQ(hits[i].load(), 1)
+            << "count " << count << " grain " << grain << " index " << i;
+      }
+    }
+  }
+}
+
+TEST(ParallelFor, Nested) {
+  thread_pool pool(2);
+
+  std::atomic<int> total(0);
+  parallel_for(&pool, 16, 1, [&](std::size_t src, std::size_t lim) {
+    for (std::size_t i = src; i < lim; ++i) {
+      parallel_for(&pool, 100, 10, [&](std::size_t src, std::size_t lim) {
+        total.fetch_add(int(lim - src));
+      });
+    }
+  });
+
+  EXPECT_EQ(total.load(), 1600);
+}
+
+}  // namespace
+}  // namespace ballistae
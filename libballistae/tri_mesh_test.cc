@@ -0,0 +1,175 @@
+#include "libballistae/geometry/tri_mesh.hh"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+
+#include "gtest/gtest.h"
+#include "libballistae/test_geometry.hh"
+
+namespace ballistae {
+namespace {
+
+constexpr float nan_f = std::numeric_limits<float>::quiet_NaN();
+constexpr double inf = std::numeric_limits<double>::infinity();
+
+// A block of random triangles, with the last EMPTY lanes unused.
+tri_block random_block(std::mt19937 *gen, size_t empty) {
+  tri_block block;
+  for (size_t lane = 0; lane < tri_block_width; ++lane) {
+    fixvec<float, 3> a = random_point(gen, 1.0f);
+    fixvec<float, 3> b = random_point(gen, 1.0f);
+    fixvec<float, 3> c = random_point(gen, 1.0f);
+    bool unused = lane + empty >= tri_block_width;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      block.v0[axis][lane] = unused ? nan_f : a(axis);
+      block.v1[axis][lane] = unused ? nan_f : b(axis);
+      block.v2[axis][lane] = unused ? nan_f : c(axis);
+    }
+    block.face[lane] = unused ? UINT32_MAX : std::uint32_t(lane);
+  }
+  return block;
+}
+
+// The hit of a ray with a triangle, by Moller-Trumbore in double.
+struct reference_hit {
+  bool hit;
+  double t;
+  int type;
+
+  // Whether the ray passes too near an edge, or lies too near the plane of
+  // the triangle, for float and double to be sure to agree.
+  bool borderline;
+};
+
+reference_hit reference_intersect(const ray &r, const tri_face_verts &v) {
+  constexpr double eps = 1e-5;
+
+  reference_hit result = {false, 0.0, 0, false};
+  fixvec<double, 3> e1 = v.v1 - v.v0;
+  fixvec<double, 3> e2 = v.v2 - v.v0;
+  fixvec<double, 3> p = cprod(r.slope, e2);
+  double det = iprod(e1, p);
+  double scale = norm(e1) * norm(e2);
+  if (std::abs(det) < eps * scale) {
+    result.borderline = true;
+    return result;
+  }
+
+  fixvec<double, 3> s = r.point - v.v0;
+  double u = iprod(s, p) / det;
+  fixvec<double, 3> q = cprod(s, e1);
+  double w = iprod(r.slope, q) / det;
+  double t = iprod(e2, q) / det;
+
+  double nearest_edge = std::min({u, w, 1.0 - u - w});
+  if (std::abs(nearest_edge) < eps) {
+    result.borderline = true;
+    return result;
+  }
+
+  result.hit = nearest_edge > 0.0;
+  result.t = t;
+  result.type = iprod(cprod(e1, e2), r.slope) < 0.0 ? CONTACT_INTO
+                                                    : CONTACT_EXIT;
+  return result;
+}
+
+TEST(TriBlockTest, MatchesScalar) {
+  std::mt19937 gen(1);
+  const int want_types[] = {CONTACT_INTO, CONTACT_EXIT,
+                            CONTACT_INTO | CONTACT_EXIT};
+
+  for (int trial = 0; trial < 20000; ++trial) {
+    tri_block block = random_block(&gen, trial % 4);
+    tri_ray r = make_tri_ray(random_ray(&gen));
+    int want_type = want_types[trial % 3];
+    float t_lo = (trial % 2) ? 0.0f : -INFINITY;
+    float t_hi = (trial % 5) ? INFINITY : 2.0f;
+
+    std::array<float, tri_block_width> simd_t;
+    std::array<float, tri_block_width> scalar_t;
+    unsigned simd = tri_block_test(block, r, t_lo, t_hi, want_type, &simd_t);
+    unsigned scalar =
+        tri_block_test_scalar(block, r, t_lo, t_hi, want_type, &scalar_t);
+
+    ASSERT_EQ(simd, scalar) << "trial " << trial;
+    for (size_t i = 0; i < tri_block_width; ++i) {
+      if (block.face[i] == UINT32_MAX) {
+        EXPECT_FALSE(simd & (1u << i)) << "trial " << trial << " lane " << i;
+      } else if (simd & (1u << i)) {
+        EXPECT_NEAR(simd_t[i], scalar_t[i], 1e-5f * std::abs(scalar_t[i]))
+            << "trial " << trial << " lane " << i;
+      }
+    }
+  }
+}
+
+TEST(TriMeshTest, MatchesBruteForce) {
+  std::mt19937 gen(2);
+
+  // Not a multiple of the block width, so that some leaves end in a partly
+  // empty block.
+  tri_mesh mesh = random_mesh(&gen, 37);
+  ASSERT_TRUE(tri_mesh_sanity_check(mesh));
+  tri_mesh_crunched crunched = crunch(mesh);
+  tri_mesh_view view = make_tri_mesh_view(mesh, crunched);
+
+  int checked = 0;
+  int hits = 0;
+  for (int trial = 0; trial < 20000; ++trial) {
+    ray_segment query;
+    query.the_ray = random_ray(&gen);
+    query.the_segment = {0.0, (trial % 4) ? inf : 2.0};
+    int want_type = (trial % 3) ? (CONTACT_INTO | CONTACT_EXIT)
+                                : CONTACT_INTO;
+
+    // The nearest wanted hit, and whether anything at all is hit.
+    double nearest_t = inf;
+    int nearest_type = 0;
+    bool any_hit = false;
+    bool borderline = false;
+    for (size_t face = 0; face < mesh.fv.size(); ++face) {
+      reference_hit h =
+          reference_intersect(query.the_ray, load_face_v(view, face));
+      borderline |= h.borderline;
+      if (!h.hit) continue;
+
+      const span<double> &segment = query.the_segment;
+      if (std::abs(h.t - segment.lo) < 1e-5 ||
+          std::abs(h.t - segment.hi) < 1e-5) {
+        borderline = true;
+      }
+      if (!contains(segment, h.t)) continue;
+
+      any_hit = true;
+      if ((h.type & want_type) && h.t < nearest_t) {
+        nearest_t = h.t;
+        nearest_type = h.type;
+      }
+    }
+    if (borderline) continue;
+    ++checked;
+
+    int hit_type = 0;
+    contact c = tri_mesh_contact(query, view, want_type, &hit_type);
+    if (nearest_t == inf) {
+      EXPECT_TRUE(std::isnan(c.t)) << "trial " << trial;
+    } else {
+      ++hits;
+      EXPECT_NEAR(c.t, nearest_t, 1e-9) << "trial " << trial;
+      EXPECT_EQ(hit_type, nearest_type) << "trial " << trial;
+    }
+
+    EXPECT_EQ(tri_mesh_occluded(query, view), any_hit) << "trial " << trial;
+  }
+
+  EXPECT_GT(checked, 10000);
+  EXPECT_GT(hits, 1000);
+}
+
+}  // namespace
+}  // namespace ballistae
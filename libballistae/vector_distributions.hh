@@ -1,9 +1,13 @@
 #ifndef LIBBALLISTAE_UNIFORM_SPHERE_DIST_HH
 #define LIBBALLISTAE_UNIFORM_SPHERE_DIST_HH
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstddef>
 #include <random>
 
+#include "libballistae/sample_rng.hh"
 #include "libballistae/vector.hh"
 
 // Note that all the std:: distributions are undefined for Field types that are
@@ -11,6 +15,100 @@
 
 namespace ballistae {
 
+/// Closed-form warps from the unit square.
+///
+/// Unlike rejection sampling, these use a fixed number of dimensions from the
+/// generator, and carry its stratification through to the directions they
+/// produce.
+
+/// Map U to the unit sphere, preserving area.
+template <class Field>
+fixvec<Field, 3> warp_uniform_sphere(const std::array<double, 2> &u) {
+  using std::cos;
+  using std::max;
+  using std::sin;
+  using std::sqrt;
+
+  double z = 1.0 - 2.0 * u[0];
+  double r = sqrt(max(0.0, 1.0 - z * z));
+  double phi = 2.0 * M_PI * u[1];
+  return {Field(r * cos(phi)), Field(r * sin(phi)), Field(z)};
+}
+
+/// Two unit vectors that complete the unit vector N to an orthonormal basis
+/// (Duff et al., "Building an Orthonormal Basis, Revisited", 2017).
+template <class Field>
+void orthonormal_basis(const fixvec<Field, 3> &n, fixvec<Field, 3> *t,
+                       fixvec<Field, 3> *b) {
+  using std::copysign;
+
+  Field sign = copysign(Field(1), n(2));
+  Field a = Field(-1) / (sign + n(2));
+  Field c = n(0) * n(1) * a;
+  *t = {Field(1) + sign * n(0) * n(0) * a, sign * c, -sign * n(0)};
+  *b = {c, sign + n(1) * n(1) * a, -n(1)};
+}
+
+/// The unit vector at COSINE from the unit vector NORMAL, and at angle PHI
+/// around it.
+template <class Field>
+fixvec<Field, 3> warp_about_normal(const fixvec<Field, 3> &normal,
+                                   Field cosine, Field phi) {
+  using std::cos;
+  using std::max;
+  using std::sin;
+  using std::sqrt;
+
+  fixvec<Field, 3> t;
+  fixvec<Field, 3> b;
+  orthonormal_basis(normal, &t, &b);
+
+  Field sine = sqrt(max(Field(0), Field(1) - cosine * cosine));
+  return cosine * normal + (sine * cos(phi)) * t + (sine * sin(phi)) * b;
+}
+
+/// Map U to the unit disk, preserving area, with Shirley and Chiu's
+/// concentric mapping.  Nearby points of the square stay nearby on the disk.
+inline std::array<double, 2> warp_concentric_disk(
+    const std::array<double, 2> &u) {
+  using std::abs;
+  using std::cos;
+  using std::sin;
+
+  double a = 2.0 * u[0] - 1.0;
+  double b = 2.0 * u[1] - 1.0;
+  if (a == 0.0 && b == 0.0) {
+    return {0.0, 0.0};
+  }
+
+  double r;
+  double phi;
+  if (abs(a) > abs(b)) {
+    r = a;
+    phi = (M_PI / 4.0) * (b / a);
+  } else {
+    r = b;
+    phi = (M_PI / 2.0) - (M_PI / 4.0) * (a / b);
+  }
+  return {r * cos(phi), r * sin(phi)};
+}
+
+/// A direction drawn from a distribution, with the density (per steradian, or
+/// per unit of the sphere's measure in other dimensions) of drawing it.
+template <class Field, size_t D>
+struct unitv_sample {
+  fixvec<Field, D> direction;
+  Field pdf;
+};
+
+/// The measure of the unit sphere in D dimensions.
+template <class Field, size_t D>
+Field unit_sphere_measure() {
+  using std::pow;
+  using std::tgamma;
+  return Field(2.0 * pow(M_PI, D / 2.0) / tgamma(D / 2.0));
+}
+
 template <class Field, size_t D>
 struct uniform_unitv_distribution {
   std::uniform_real_distribution<Field> elt_dist;
@@ -19,13 +117,27 @@ struct uniform_unitv_distribution {
 
   template <class Gen>
   fixvec<Field, D> operator()(Gen &g) {
-    fixvec<Field, D> result;
+    if constexpr (D == 3) {
+      return warp_uniform_sphere<Field>(uniform_2d(g));
+    } else {
+      fixvec<Field, D> result;
+
+      do {
+        for (size_t i = 0; i < D; ++i) result(i) = elt_dist(g);
+      } while (norm(result) > Field(1) || norm(result) == Field(0));
+
+      return normalise(result);
+    }
+  }
 
-    do {
-      for (size_t i = 0; i < D; ++i) result(i) = elt_dist(g);
-    } while (norm(result) > Field(1) || norm(result) == Field(0));
+  Field pdf(const fixvec<Field, D> &direction) const {
+    return Field(1) / unit_sphere_measure<Field, D>();
+  }
 
-    return normalise(result);
+  template <class Gen>
+  unitv_sample<Field, D> sample(Gen &g) {
+    fixvec<Field, D> direction = (*this)(g);
+    return {direction, this->pdf(direction)};
   }
 };
 
@@ -43,34 +155,97 @@ struct hemisphere_unitv_distribution {
     if (iprod(candidate, normal) < Field(0)) candidate = -candidate;
     return candidate;
   }
+
+  Field pdf(const fixvec<Field, D> &direction) const {
+    if (!(iprod(direction, normal) > Field(0))) {
+      return Field(0);
+    }
+    return Field(2) / unit_sphere_measure<Field, D>();
+  }
+
+  template <class Gen>
+  unitv_sample<Field, D> sample(Gen &g) {
+    fixvec<Field, D> direction = (*this)(g);
+    return {direction, this->pdf(direction)};
+  }
 };
 
+/// Directions in the hemisphere about NORMAL, with density proportional to
+/// their cosine with it.
+///
+/// Points of the concentric disk are projected up onto the hemisphere
+/// (Malley's method).
 template <class Field, size_t D>
 struct cosine_unitv_distribution {
+  static_assert(D == 3, "cosine-weighted directions are only drawn in 3D");
+
   fixvec<Field, D> normal;
-  uniform_unitv_distribution<Field, D> backing_dist;
-  std::uniform_real_distribution<Field> rejection_dist;
 
   cosine_unitv_distribution(const fixvec<Field, D> &normal_in)
-      : normal(normal_in),
-        backing_dist(),
-        rejection_dist(Field(-1), Field(1)) {}
+      : normal(normal_in) {}
 
   template <class Gen>
   fixvec<Field, D> operator()(Gen &g) {
-    fixvec<Field, D> candidate;
-    double cosine;
-    do {
-      candidate = backing_dist(g);
-      cosine = iprod(normal, candidate);
-
-      if (cosine < Field(0)) {
-        cosine = -cosine;
-        candidate = -candidate;
-      }
-    } while (rejection_dist(g) < cosine);
+    return this->sample(g).direction;
+  }
 
-    return candidate;
+  Field pdf(const fixvec<Field, D> &direction) const {
+    using std::max;
+    return max(Field(0), iprod(direction, normal)) / Field(M_PI);
+  }
+
+  template <class Gen>
+  unitv_sample<Field, D> sample(Gen &g) {
+    using std::max;
+    using std::sqrt;
+
+    std::array<double, 2> disk = warp_concentric_disk(uniform_2d(g));
+    Field cosine =
+        Field(sqrt(max(0.0, 1.0 - disk[0] * disk[0] - disk[1] * disk[1])));
+
+    fixvec<Field, D> t;
+    fixvec<Field, D> b;
+    orthonormal_basis(normal, &t, &b);
+
+    fixvec<Field, D> direction =
+        Field(disk[0]) * t + Field(disk[1]) * b + cosine * normal;
+    return {direction, cosine / Field(M_PI)};
+  }
+};
+
+/// Directions uniformly distributed within a cone: those whose cosine with
+/// AXIS is at least COS_MAX.
+template <class Field, size_t D>
+struct cone_unitv_distribution {
+  static_assert(D == 3, "directions in a cone are only drawn in 3D");
+
+  fixvec<Field, D> axis;
+  Field cos_max;
+
+  cone_unitv_distribution(const fixvec<Field, D> &axis_in, Field cos_max_in)
+      : axis(axis_in), cos_max(cos_max_in) {}
+
+  template <class Gen>
+  fixvec<Field, D> operator()(Gen &g) {
+    return this->sample(g).direction;
+  }
+
+  Field pdf(const fixvec<Field, D> &direction) const {
+    if (iprod(direction, axis) < cos_max) {
+      return Field(0);
+    }
+    return Field(1) / (Field(2 * M_PI) * (Field(1) - cos_max));
+  }
+
+  template <class Gen>
+  unitv_sample<Field, D> sample(Gen &g) {
+    std::array<double, 2> u = uniform_2d(g);
+
+    // The cosine is uniform over [cos_max, 1].
+    Field cosine = Field(1) - Field(u[0]) * (Field(1) - cos_max);
+    fixvec<Field, D> direction =
+        warp_about_normal(axis, cosine, Field(2 * M_PI * u[1]));
+    return {direction, Field(1) / (Field(2 * M_PI) * (Field(1) - cos_max))};
   }
 };
 
@@ -0,0 +1,106 @@
+#include "libballistae/vector_distributions.hh"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "libballistae/sample_rng.hh"
+#include "libballistae/test_directions.hh"
+
+namespace ballistae {
+namespace {
+
+constexpr direction_bins sphere = {20, 16, -1.0};
+
+constexpr int total = 200000;
+
+// Directions drawn by SAMPLE(rng), binned over the whole sphere.
+template <class Sample>
+std::vector<int> sphere_counts(Sample sample) {
+  std::vector<int> counts(sphere.size(), 0);
+  for (int i = 0; i < total; ++i) {
+    sample_rng rng = make_sample_rng(0, 0, 0, i);
+    fixvec<double, 3> w = sample(rng);
+    EXPECT_NEAR(norm(w), 1.0, 1e-9) << "sample " << i;
+    ++counts[sphere.bin_of(w)];
+  }
+  return counts;
+}
+
+TEST(WarpUniformSphere, MatchesPdf) {
+  std::vector<int> counts = sphere_counts([](sample_rng &rng) {
+    return warp_uniform_sphere<double>(rng.next_2d());
+  });
+  expect_matching_histogram(
+      sphere.integrate([](const fixvec<double, 3> &) { return 0.25 / M_PI; }),
+      counts, total);
+}
+
+TEST(WarpConcentricDisk, PreservesArea) {
+  // Rings of equal area, cut into equal sectors.
+  constexpr int ring_count = 4;
+  constexpr int sector_count = 16;
+  std::vector<int> counts(ring_count * sector_count, 0);
+  for (int i = 0; i < total; ++i) {
+    sample_rng rng = make_sample_rng(0, 0, 1, i);
+    std::array<double, 2> p = warp_concentric_disk(rng.next_2d());
+    double r2 = p[0] * p[0] + p[1] * p[1];
+    ASSERT_LE(r2, 1.0 + 1e-12) << "sample " << i;
+
+    double phi = std::atan2(p[1], p[0]);
+    if (phi < 0) phi += 2 * M_PI;
+    int ring = std::min(ring_count - 1, int(r2 * ring_count));
+    int sector =
+        std::min(sector_count - 1, int(phi / (2 * M_PI) * sector_count));
+    ++counts[ring * sector_count + sector];
+  }
+
+  std::vector<double> expected(counts.size(),
+                               1.0 / (ring_count * sector_count));
+  expect_matching_histogram(expected, counts, total);
+
+  // The middle of the square goes to the middle of the disk.
+  std::array<double, 2> center = warp_concentric_disk({0.5, 0.5});
+  EXPECT_EQ(center[0], 0.0);
+  EXPECT_EQ(center[1], 0.0);
+}
+
+TEST(CosineUnitvDistribution, MatchesPdf) {
+  for (fixvec<double, 3> normal :
+       {fixvec<double, 3>{0.0, 0.0, 1.0}, fixvec<double, 3>{0.0, 0.0, -1.0},
+        normalise(fixvec<double, 3>{1.0, -2.0, 0.5})}) {
+    cosine_unitv_distribution<double, 3> dist(normal);
+    std::vector<int> counts = sphere_counts([&](sample_rng &rng) {
+      unitv_sample<double, 3> s = dist.sample(rng);
+      EXPECT_NEAR(s.pdf, dist.pdf(s.direction), 1e-9);
+      return s.direction;
+    });
+    expect_matching_histogram(
+        sphere.integrate(
+            [&](const fixvec<double, 3> &w) { return dist.pdf(w); }),
+        counts, total);
+  }
+}
+
+TEST(ConeUnitvDistribution, MatchesPdf) {
+  fixvec<double, 3> axis = normalise(fixvec<double, 3>{-0.5, 1.0, 2.0});
+  for (double cos_max : {-0.5, 0.3, 0.8}) {
+    cone_unitv_distribution<double, 3> dist(axis, cos_max);
+    std::vector<int> counts = sphere_counts([&](sample_rng &rng) {
+      unitv_sample<double, 3> s = dist.sample(rng);
+      EXPECT_GE(iprod(s.direction, axis), cos_max - 1e-9);
+      EXPECT_NEAR(s.pdf, dist.pdf(s.direction), 1e-9);
+      return s.direction;
+    });
+    expect_matching_histogram(
+        sphere.integrate(
+            [&](const fixvec<double, 3> &w) { return dist.pdf(w); }),
+        counts, total);
+  }
+}
+
+}  // namespace
+}  // namespace ballistae
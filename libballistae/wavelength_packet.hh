@@ -0,0 +1,56 @@
+#ifndef LIBBALLISTAE_WAVELENGTH_PACKET_HH
+#define LIBBALLISTAE_WAVELENGTH_PACKET_HH
+
+#include <array>
+#include <cstddef>
+
+namespace ballistae {
+
+/// The largest number of wavelengths that a single path carries.
+constexpr std::size_t wavelength_packet_capacity = 4;
+
+/// Per-wavelength values carried along a path, one lane for each wavelength in
+/// a wavelength_packet.  Lanes past the packet's size are zero.
+using packet_values = std::array<float, wavelength_packet_capacity>;
+
+/// A set of wavelengths that share one geometric path.
+///
+/// Every sampling decision along the path is made for the hero wavelength, and
+/// the other lanes follow it.  Because the hero is chosen uniformly at random
+/// from the lanes, a path through a material whose sampling depends on
+/// wavelength stays unbiased by collapsing onto the hero (see
+/// collapse_to_hero).
+struct wavelength_packet {
+  packet_values lambda;
+  std::size_t size;
+  std::size_t hero;
+};
+
+inline packet_values packet_fill(const wavelength_packet &w, float value) {
+  packet_values result = {};
+  for (std::size_t i = 0; i < w.size; ++i) result[i] = value;
+  return result;
+}
+
+/// Evaluate FN at every wavelength in W.
+template <class Fn>
+packet_values packet_map(const wavelength_packet &w, Fn fn) {
+  packet_values result = {};
+  for (std::size_t i = 0; i < w.size; ++i) result[i] = fn(w.lambda[i]);
+  return result;
+}
+
+/// Drop every lane but the hero from VALUES.
+///
+/// The hero's value is scaled by the packet size, to make up for the samples
+/// that the other lanes lose.
+inline void collapse_to_hero(const wavelength_packet &w,
+                             packet_values *values) {
+  float hero_value = (*values)[w.hero] * float(w.size);
+  values->fill(0.0f);
+  (*values)[w.hero] = hero_value;
+}
+
+}  // namespace ballistae
+
+#endif
@@ -0,0 +1,51 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "libballistae/geometry/mesh_cache.hh"
+#include "libballistae/geometry/surface_mesh.hh"
+#include "third_party/cc/absl/absl/flags/flag.h"
+#include "third_party/cc/absl/absl/flags/parse.h"
+#include "third_party/cc/absl/absl/strings/match.h"
+#include "third_party/cc/absl/absl/strings/str_format.h"
+
+ABSL_FLAG(std::string, input, "", "input obj or binary ply file");
+ABSL_FLAG(bool, swapyz, false, "swap the y and z axes of the input");
+
+ABSL_FLAG(std::string, output, "", "output mesh cache");
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+
+  std::string input = absl::GetFlag(FLAGS_input);
+  if (input == "") {
+    std::cerr << "--input must be specified" << std::endl;
+    return 1;
+  }
+
+  std::string output = absl::GetFlag(FLAGS_output);
+  if (output == "") {
+    std::cerr << "--output must be specified" << std::endl;
+    return 1;
+  }
+
+  try {
+    bool ply = absl::EndsWith(input, ".ply");
+    ballistae::surface_mesh mesh =
+        ply ? ballistae::surface_mesh_from_ply_file(
+                  input, absl::GetFlag(FLAGS_swapyz))
+            : ballistae::surface_mesh_from_obj_file(
+                  input, absl::GetFlag(FLAGS_swapyz));
+    mesh.crush(0.0);
+    ballistae::write_mesh_cache(output, mesh.view());
+
+    // Check that the cache reads back.
+    ballistae::read_mesh_cache(output, true);
+  } catch (const std::runtime_error& e) {
+    std::cerr << absl::StreamFormat("Problem converting %s: %s\n", input,
+                                    e.what());
+    return 1;
+  }
+
+  return 0;
+}